@@ -0,0 +1,144 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares the throughput of the I/O backends on the files written and read
+// by rawcompr: a sequential write through openWriteBehind, a sequential read
+// through openReadAhead and scattered positional writes (as performed by
+// decompression), using a scratch file on the filesystem to be tested.
+
+#include "fileio.h"
+#include "ioqueue.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/time.h>
+}
+
+static constexpr int CHUNK_SIZE = 1024 * 1024;
+
+static void dropPageCache(const char *filename)
+{
+	// Best effort: only works for pages that are not dirty
+	int fd = open(filename, O_RDONLY);
+	if (fd != -1)
+	{
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+static void report(const char *backendName, const char *test, int64_t bytes, int64_t elapsedMicroseconds)
+{
+	printf("%-10s %-18s %8.1f MiB/s\n", backendName, test, bytes / (1024.0 * 1024.0) / (elapsedMicroseconds / 1e6));
+}
+
+static void benchmark(const char *backendName, const char *filename, int64_t size, size_t readAheadSize)
+{
+	std::vector<uint8_t> chunk(CHUNK_SIZE);
+	for (int i = 0; i < CHUNK_SIZE; i++)
+		chunk[i] = i * 7;
+
+	AVIOContext *file;
+
+	// Sequential write (compression output)
+	int64_t start = av_gettime_relative();
+	failOnAVERROR(openWriteBehind(&file, filename), "openWriteBehind: %s", filename);
+	for (int64_t pos = 0; pos < size; pos += CHUNK_SIZE)
+		avio_write(file, chunk.data(), CHUNK_SIZE);
+	failOnAVERROR(syncWriteBehind(file, true), "syncWriteBehind");
+	failOnAVERROR(closeWriteBehind(&file), "closeWriteBehind");
+	report(backendName, "sequential write", size, av_gettime_relative() - start);
+
+	dropPageCache(filename);
+
+	// Sequential read (compression input, hash verification)
+	start = av_gettime_relative();
+	failOnAVERROR(openReadAhead(&file, filename, readAheadSize), "openReadAhead: %s", filename);
+	int64_t total = 0;
+	while (true)
+	{
+		int r = avio_read(file, chunk.data(), CHUNK_SIZE);
+		if (r <= 0)
+			break;
+		total += r;
+	}
+	failOnAVERROR(closeReadAhead(&file), "closeReadAhead");
+	if (total != size)
+		logError("Read %" PRIi64 " bytes instead of %" PRIi64 "\n", total, size);
+	report(backendName, "sequential read", size, av_gettime_relative() - start);
+
+	// Scattered writes (decompression output): chunks are written in a
+	// shuffled order, leaving no holes at the end
+	start = av_gettime_relative();
+	failOnAVERROR(openWriteBehind(&file, filename), "openWriteBehind: %s", filename);
+	int64_t chunkCount = size / CHUNK_SIZE;
+	for (int64_t i = 0; i < chunkCount; i++)
+	{
+		int64_t chunkIndex = (i * 7919) % chunkCount;
+		seekOrFail(file, chunkIndex * CHUNK_SIZE);
+		avio_write(file, chunk.data(), CHUNK_SIZE);
+	}
+	failOnAVERROR(syncWriteBehind(file, true), "syncWriteBehind");
+	failOnAVERROR(closeWriteBehind(&file), "closeWriteBehind");
+	report(backendName, "scattered write", size, av_gettime_relative() - start);
+
+	unlink(filename);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3 && argc != 4)
+	{
+		fprintf(stderr, "Usage: %s SCRATCH_FILE SIZE_MIB [READ_AHEAD_MIB]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const char *filename = argv[1];
+	int64_t size = atoll(argv[2]) * CHUNK_SIZE;
+	size_t readAheadSize = (argc == 4 ? atoll(argv[3]) : 64) * CHUNK_SIZE;
+
+	// Scattered writes need a chunk count that is coprime with 7919
+	if (size <= 0 || (size / CHUNK_SIZE) % 7919 == 0)
+	{
+		fprintf(stderr, "Invalid size\n");
+		return EXIT_FAILURE;
+	}
+
+	IoQueue::selectBackend(IoQueue::Blocking);
+	benchmark("blocking", filename, size, readAheadSize);
+
+	if (IoQueue::isBackendAvailable(IoQueue::IoUring))
+	{
+		IoQueue::selectBackend(IoQueue::IoUring);
+		benchmark("io_uring", filename, size, readAheadSize);
+	}
+	else
+	{
+		printf("io_uring    not available (built without liburing or not supported by the kernel)\n");
+	}
+
+	return EXIT_SUCCESS;
+}
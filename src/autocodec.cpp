@@ -0,0 +1,308 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "autocodec.h"
+
+#include "cpus.h"
+#include "encoders.h"
+#include "log.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+
+// Candidates tried by -v auto, all of them lossless
+static const std::vector<VideoCodecChoice> candidateCodecs
+{
+	{ AV_CODEC_ID_FFV1, { { "level", "3" }, { "slicecrc", "0" }, { "context", "1" }, { "coder", "range_def" } } },
+	{ AV_CODEC_ID_FFV1, { { "level", "3" }, { "slicecrc", "0" }, { "coder", "range_def" } } },
+	{ AV_CODEC_ID_FFV1, { { "level", "3" }, { "slicecrc", "0" } } },
+	{ AV_CODEC_ID_FFVHUFF, { { "pred", "median" }, { "context", "1" } } },
+	{ AV_CODEC_ID_UTVIDEO, { { "pred", "median" } } },
+	{ AV_CODEC_ID_MAGICYUV, { { "pred", "median" } } },
+	{ AV_CODEC_ID_HUFFYUV, { } }
+};
+
+struct TrialResult
+{
+	size_t outputSize;
+	double encodeFps, decodeFps;
+};
+
+std::vector<AVPacket*> readSampleFrames(const char *filename, int streamIndex, Decoder *decoder, size_t count)
+{
+	std::vector<AVPacket*> result;
+
+	AVFormatContext *formatContext = nullptr;
+	failOnAVERROR(avformat_open_input(&formatContext, filename, nullptr, nullptr), "avformat_open_input: %s", filename);
+	failOnAVERROR(avformat_find_stream_info(formatContext, nullptr), "avformat_find_stream_info");
+
+	const AVStream *stream = formatContext->streams[streamIndex];
+	int64_t start = (stream->start_time != AV_NOPTS_VALUE) ? stream->start_time : 0;
+	int64_t duration = stream->duration;
+	if (duration == AV_NOPTS_VALUE && formatContext->duration != AV_NOPTS_VALUE)
+		duration = av_rescale_q(formatContext->duration, AV_TIME_BASE_Q, stream->time_base);
+
+	AVPacket *packet = av_packet_alloc();
+	if (packet == nullptr)
+		logError("av_packet_alloc failed\n");
+
+	int64_t lastPts = AV_NOPTS_VALUE;
+	for (size_t i = 0; i < count; i++)
+	{
+		// Take the frame in the middle of each of the count parts of the
+		// stream. If the stream cannot be seeked, the first frames are taken.
+		if (duration != AV_NOPTS_VALUE && duration > 0)
+		{
+			int64_t timestamp = start + duration * (int64_t)(2 * i + 1) / (int64_t)(2 * count);
+			if (av_seek_frame(formatContext, streamIndex, timestamp, AVSEEK_FLAG_BACKWARD) < 0)
+				duration = AV_NOPTS_VALUE;
+		}
+
+		int r;
+		while ((r = av_read_frame(formatContext, packet)) >= 0)
+		{
+			// Compressed frames can only be decoded starting from a keyframe
+			if (packet->stream_index == streamIndex && (decoder == nullptr || (packet->flags & AV_PKT_FLAG_KEY)))
+				break;
+			av_packet_unref(packet);
+		}
+
+		if (r == AVERROR_EOF)
+			break;
+		failOnAVERROR(r, "av_read_frame");
+
+		// Short streams can have a single keyframe for several parts
+		if (packet->pts != AV_NOPTS_VALUE && packet->pts == lastPts)
+		{
+			av_packet_unref(packet);
+			continue;
+		}
+		lastPts = packet->pts;
+
+		AVPacket *sample = av_packet_alloc();
+		if (sample == nullptr)
+			logError("av_packet_alloc failed\n");
+
+		if (decoder != nullptr)
+		{
+			decoder->decodePacket(packet, sample);
+			failOnAVERROR(av_packet_copy_props(sample, packet), "av_packet_copy_props");
+			av_packet_unref(packet);
+		}
+		else
+		{
+			av_packet_move_ref(sample, packet);
+		}
+
+		result.push_back(sample);
+	}
+
+	av_packet_free(&packet);
+	avformat_close_input(&formatContext);
+
+	logDebug("Read %zu sample frames from %s\n", result.size(), filename);
+	return result;
+}
+
+static std::string describeCodec(const VideoCodecChoice &choice)
+{
+	std::string result = avcodec_get_name(choice.codecId);
+	for (const auto &[k, v] : choice.options)
+		result += " " + k + "=" + v;
+	return result;
+}
+
+// CPU time used by the calling thread, which is not affected by the trials
+// that run at the same time on other CPUs
+static double threadCpuTime()
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		logError("clock_gettime: %s\n", strerror(errno));
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void runTrial(const VideoCodecChoice &candidate, const AVStream *rawStream, const std::vector<AVPacket*> &samples,
+	int threadCount, TrialResult *outResult)
+{
+	AVFormatContext *outputFormatContext = nullptr;
+	failOnAVERROR(avformat_alloc_output_context2(&outputFormatContext, nullptr, "matroska", nullptr), "avformat_alloc_output_context2");
+
+	PacketReferences packetRefs;
+	std::vector<AVPacket*> encodedPackets;
+	double encodeTime = 0, decodeTime = 0;
+	outResult->outputSize = 0;
+
+	{
+		// Options are chosen for threadCount threads, but the trial itself
+		// runs on one thread so that its CPU time can be measured
+		AVDictionary *opts = nullptr;
+		for (const auto &[k, v] : candidate.options)
+			av_dict_set(&opts, k.c_str(), v.c_str(), 0);
+		av_dict_set(&opts, "threads", "1", 0);
+
+		VideoEncoder encoder(rawStream, outputFormatContext, &packetRefs, candidate.codecId, &opts, threadCount);
+		av_dict_free(&opts);
+
+		std::unique_ptr<FrameConverter> converter(encoder.createConverter());
+		AVFrame *convertedFrame = av_frame_alloc();
+		if (convertedFrame == nullptr)
+			logError("av_frame_alloc failed\n");
+
+		for (const AVPacket *sample : samples)
+		{
+			AVPacket *encodedPacket = av_packet_alloc();
+			if (encodedPacket == nullptr)
+				logError("av_packet_alloc failed\n");
+
+			converter->convert(sample, convertedFrame);
+
+			double startTime = threadCpuTime();
+			encoder.encodePacket(sample, convertedFrame, encodedPacket);
+			encodeTime += threadCpuTime() - startTime;
+
+			av_frame_unref(convertedFrame);
+			outResult->outputSize += encodedPacket->size;
+			encodedPackets.push_back(encodedPacket);
+		}
+
+		av_frame_free(&convertedFrame);
+	}
+
+	{
+		VideoDecoder decoder(outputFormatContext->streams[0], (AVPixelFormat)rawStream->codecpar->format, PlaneReduction(), 1);
+
+		AVPacket *rawPacket = av_packet_alloc();
+		if (rawPacket == nullptr)
+			logError("av_packet_alloc failed\n");
+
+		for (AVPacket *encodedPacket : encodedPackets)
+		{
+			double startTime = threadCpuTime();
+			decoder.decodePacket(encodedPacket, rawPacket);
+			decodeTime += threadCpuTime() - startTime;
+
+			av_packet_unref(rawPacket);
+			av_packet_free(&encodedPacket);
+		}
+
+		av_packet_free(&rawPacket);
+	}
+
+	avformat_free_context(outputFormatContext);
+
+	// Scale by the threads that the codec can actually use
+	const AVCodec *encoder = avcodec_find_encoder(candidate.codecId);
+	const AVCodec *decoder = avcodec_find_decoder(candidate.codecId);
+	int encodeThreads = (encoder->capabilities & AV_CODEC_CAP_SLICE_THREADS) ? threadCount : 1;
+	int decodeThreads = (decoder->capabilities & AV_CODEC_CAP_SLICE_THREADS) ? availableCpuCount() : 1;
+
+	outResult->encodeFps = samples.size() / std::max(encodeTime, 1e-6) * encodeThreads;
+	outResult->decodeFps = samples.size() / std::max(decodeTime, 1e-6) * decodeThreads;
+}
+
+VideoCodecChoice selectVideoCodec(const AVStream *rawStream, const std::vector<AVPacket*> &samples,
+	const AutoCodecPolicy &policy, int threadCount)
+{
+	AVPixelFormat rawPixelFormat = (AVPixelFormat)rawStream->codecpar->format;
+
+	std::vector<VideoCodecChoice> candidates;
+	for (const VideoCodecChoice &candidate : candidateCodecs)
+	{
+		const AVCodec *encoder = avcodec_find_encoder(candidate.codecId);
+		if (encoder == nullptr || avcodec_find_decoder(candidate.codecId) == nullptr)
+			continue;
+		if (!hasCompatibleLosslessPixelFormat(rawPixelFormat, encoder->pix_fmts))
+			continue;
+
+		candidates.push_back(candidate);
+	}
+
+	if (candidates.empty())
+		logError("No codec can store %s frames losslessly\n", av_get_pix_fmt_name(rawPixelFormat));
+
+	if (samples.empty())
+	{
+		logWarning("No sample frames could be read, using %s\n", describeCodec(candidates.front()).c_str());
+		return candidates.front();
+	}
+
+	std::vector<TrialResult> results(candidates.size());
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < candidates.size(); i++)
+		threads.emplace_back(runTrial, std::cref(candidates[i]), rawStream, std::cref(samples), threadCount, &results[i]);
+	for (std::thread &t : threads)
+		t.join();
+
+	size_t rawSize = 0;
+	for (const AVPacket *sample : samples)
+		rawSize += sample->size;
+
+	size_t smallestSize = SIZE_MAX;
+	for (const TrialResult &result : results)
+		smallestSize = std::min(smallestSize, result.outputSize);
+
+	logDebug("Trial encoding of %zu sample frames (%zu bytes):\n", samples.size(), rawSize);
+	for (size_t i = 0; i < candidates.size(); i++)
+	{
+		logDebug("  %s: %zu bytes (ratio %.3f), encoding %.1f fps, decoding %.1f fps\n",
+			describeCodec(candidates[i]).c_str(), results[i].outputSize, (double)rawSize / results[i].outputSize,
+			results[i].encodeFps, results[i].decodeFps);
+	}
+
+	size_t best = SIZE_MAX;
+	switch (policy.criterion)
+	{
+		case AutoCodecPolicy::SmallestAboveFps:
+			for (size_t i = 0; i < candidates.size(); i++)
+			{
+				if (std::min(results[i].encodeFps, results[i].decodeFps) < policy.threshold)
+					continue;
+				if (best == SIZE_MAX || results[i].outputSize < results[best].outputSize)
+					best = i;
+			}
+
+			if (best == SIZE_MAX)
+			{
+				for (size_t i = 0; i < candidates.size(); i++)
+				{
+					if (best == SIZE_MAX || std::min(results[i].encodeFps, results[i].decodeFps) > std::min(results[best].encodeFps, results[best].decodeFps))
+						best = i;
+				}
+
+				logWarning("No codec reaches %g fps, using the fastest one\n", policy.threshold);
+			}
+			break;
+		case AutoCodecPolicy::FastestWithinRatio:
+			for (size_t i = 0; i < candidates.size(); i++)
+			{
+				if (results[i].outputSize > smallestSize * (1 + policy.threshold / 100))
+					continue;
+				if (best == SIZE_MAX || results[i].encodeFps > results[best].encodeFps)
+					best = i;
+			}
+			break;
+	}
+
+	logDebug("Selected video codec: %s\n", describeCodec(candidates[best]).c_str());
+	return candidates[best];
+}
@@ -0,0 +1,59 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUTOCODEC_H
+#define AUTOCODEC_H
+
+#include "decoders.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// How -v auto chooses among the candidate codecs
+struct AutoCodecPolicy
+{
+	enum Criterion
+	{
+		SmallestAboveFps, // smallest output whose encoding and decoding reach threshold fps
+		FastestWithinRatio // fastest encoder whose output is at most threshold percent larger than the smallest
+	};
+
+	Criterion criterion;
+	double threshold;
+};
+
+struct VideoCodecChoice
+{
+	AVCodecID codecId;
+	std::map<std::string, std::string> options;
+};
+
+// Reads up to count video frames spread over the given stream of a file, as
+// raw packets. If decoder is not nullptr, the packets are compressed and
+// decoder turns them into raw frames (which requires seeking to keyframes).
+std::vector<AVPacket*> readSampleFrames(const char *filename, int streamIndex, Decoder *decoder, size_t count);
+
+// Encodes the raw sample frames (packets of rawStream) with each candidate
+// codec, each on its own thread, then decodes them back and picks a codec
+// according to policy. Speeds are measured in CPU time and scaled by the
+// threads that the codec can use (threadCount for encoding, all the available
+// CPUs for decoding). All the measurements and the decision are logged.
+VideoCodecChoice selectVideoCodec(const AVStream *rawStream, const std::vector<AVPacket*> &samples,
+	const AutoCodecPolicy &policy, int threadCount);
+
+#endif
@@ -0,0 +1,526 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "avireader.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavutil/intreadwrite.h>
+}
+
+// Number of threads fetching packet payloads
+static constexpr int AVI_READER_THREADS = 4;
+
+// Values of bIndexType in OpenDML indices
+static constexpr int AVI_INDEX_OF_INDEXES = 0x00;
+static constexpr int AVI_INDEX_OF_CHUNKS = 0x01;
+
+// Flag of keyframes in idx1 entries
+static constexpr uint32_t AVIIF_KEYFRAME = 0x10;
+
+// Bit of the size of non-keyframes in OpenDML standard index entries
+static constexpr uint32_t AVI_INDEX_DELTA_FRAME = 0x80000000;
+
+// Upper limit for the size of index chunks, to reject corrupt sizes early
+static constexpr uint32_t AVI_MAX_INDEX_SIZE = 256 * 1024 * 1024;
+
+struct AviStream
+{
+	uint32_t type; // fccType in strh
+	uint32_t start, sampleSize;
+	std::vector<int64_t> subIndexes; // offsets of the ix## chunks
+};
+
+// Chunk listed in an index, before timestamps are assigned
+struct ChunkRef
+{
+	int64_t pos; // of the payload
+	uint32_t size;
+	bool keyframe;
+};
+
+// Reads exactly size bytes
+static bool readAt(int fd, int64_t offset, void *buf, size_t size)
+{
+	uint8_t *dest = (uint8_t*)buf;
+
+	while (size != 0)
+	{
+		ssize_t r = pread(fd, dest, size, offset);
+		if (r <= 0)
+			return false;
+
+		dest += r;
+		offset += r;
+		size -= r;
+	}
+
+	return true;
+}
+
+// Reads the header of the chunk at offset and, if it is a list, its type
+static bool readChunkHeader(int fd, int64_t offset, uint32_t *id, uint32_t *size, uint32_t *listType)
+{
+	uint8_t header[12];
+	if (!readAt(fd, offset, header, 8))
+		return false;
+
+	*id = AV_RL32(header);
+	*size = AV_RL32(header + 4);
+	*listType = 0;
+
+	if (*id == MKTAG('L', 'I', 'S', 'T') || *id == MKTAG('R', 'I', 'F', 'F'))
+	{
+		if (*size < 4 || !readAt(fd, offset + 8, header + 8, 4))
+			return false;
+
+		*listType = AV_RL32(header + 8);
+	}
+
+	return true;
+}
+
+// Returns the stream index encoded in the first two characters of a chunk id
+// (e.g. "01wb"), or -1 if they are not digits
+static int chunkStreamIndex(uint32_t id)
+{
+	int a = id & 0xff, b = (id >> 8) & 0xff;
+	if (a < '0' || a > '9' || b < '0' || b > '9')
+		return -1;
+
+	return (a - '0') * 10 + (b - '0');
+}
+
+static bool parseStreamList(int fd, int64_t start, int64_t end, AviStream *stream)
+{
+	bool seenHeader = false;
+
+	for (int64_t offset = start; offset + 8 <= end;)
+	{
+		uint32_t id, size, listType;
+		if (!readChunkHeader(fd, offset, &id, &size, &listType))
+			return false;
+
+		if (id == MKTAG('s', 't', 'r', 'h'))
+		{
+			uint8_t strh[48];
+			if (size < sizeof(strh) || !readAt(fd, offset + 8, strh, sizeof(strh)))
+				return false;
+
+			stream->type = AV_RL32(strh);
+			stream->start = AV_RL32(strh + 28);
+			stream->sampleSize = AV_RL32(strh + 44);
+			seenHeader = true;
+		}
+		else if (id == MKTAG('i', 'n', 'd', 'x'))
+		{
+			if (size < 24 || size > AVI_MAX_INDEX_SIZE)
+				return false;
+
+			std::vector<uint8_t> indx(size);
+			if (!readAt(fd, offset + 8, indx.data(), size))
+				return false;
+
+			// Only super indices pointing to ix## chunks are supported
+			uint32_t entryCount = AV_RL32(&indx[4]);
+			if (AV_RL16(&indx[0]) != 4 || indx[3] != AVI_INDEX_OF_INDEXES || 24 + 16 * (uint64_t)entryCount > size)
+				return false;
+
+			for (uint32_t i = 0; i < entryCount; i++)
+				stream->subIndexes.push_back(AV_RL64(&indx[24 + 16 * i]));
+		}
+
+		offset += 8 + size + (size & 1);
+	}
+
+	return seenHeader;
+}
+
+static bool parseHeaderList(int fd, int64_t start, int64_t end, std::vector<AviStream> *streams)
+{
+	for (int64_t offset = start; offset + 8 <= end;)
+	{
+		uint32_t id, size, listType;
+		if (!readChunkHeader(fd, offset, &id, &size, &listType))
+			return false;
+
+		if (id == MKTAG('L', 'I', 'S', 'T') && listType == MKTAG('s', 't', 'r', 'l'))
+		{
+			AviStream stream = {};
+			if (!parseStreamList(fd, offset + 12, offset + 8 + size, &stream))
+				return false;
+
+			streams->push_back(stream);
+		}
+
+		offset += 8 + size + (size & 1);
+	}
+
+	return true;
+}
+
+// Reads the OpenDML standard index (ix##) at offset
+static bool parseStandardIndex(int fd, int64_t offset, int streamIndex, std::vector<ChunkRef> *chunks)
+{
+	uint32_t id, size, listType;
+	if (!readChunkHeader(fd, offset, &id, &size, &listType))
+		return false;
+
+	if ((id & 0xffff) != MKTAG('i', 'x', 0, 0) || chunkStreamIndex(id >> 16) != streamIndex || size < 24 || size > AVI_MAX_INDEX_SIZE)
+		return false;
+
+	std::vector<uint8_t> ix(size);
+	if (!readAt(fd, offset + 8, ix.data(), size))
+		return false;
+
+	// Field indices (bIndexSubType == AVI_INDEX_2FIELD) are not supported
+	uint32_t entryCount = AV_RL32(&ix[4]);
+	if (AV_RL16(&ix[0]) != 2 || ix[2] != 0 || ix[3] != AVI_INDEX_OF_CHUNKS || 24 + 8 * (uint64_t)entryCount > size)
+		return false;
+
+	int64_t baseOffset = AV_RL64(&ix[12]);
+	for (uint32_t i = 0; i < entryCount; i++)
+	{
+		uint32_t chunkOffset = AV_RL32(&ix[24 + 8 * i]);
+		uint32_t chunkSize = AV_RL32(&ix[28 + 8 * i]);
+		chunks->push_back({ baseOffset + chunkOffset, chunkSize & ~AVI_INDEX_DELTA_FRAME, (chunkSize & AVI_INDEX_DELTA_FRAME) == 0 });
+	}
+
+	return true;
+}
+
+// Reads the idx1 chunk, whose offsets point to chunk headers and are either
+// relative to the "movi" list type or absolute
+static bool parseIdx1(int fd, int64_t offset, uint32_t size, int64_t moviPos, std::vector<std::vector<ChunkRef>> *chunks)
+{
+	if (size > AVI_MAX_INDEX_SIZE)
+		return false;
+
+	std::vector<uint8_t> idx1(size);
+	if (!readAt(fd, offset + 8, idx1.data(), size))
+		return false;
+
+	int64_t baseOffset = -1;
+
+	for (uint32_t i = 0; i + 16 <= size; i += 16)
+	{
+		uint32_t id = AV_RL32(&idx1[i]);
+		uint32_t flags = AV_RL32(&idx1[i + 4]);
+		uint32_t chunkOffset = AV_RL32(&idx1[i + 8]);
+		uint32_t chunkSize = AV_RL32(&idx1[i + 12]);
+
+		int streamIndex = chunkStreamIndex(id);
+		if (streamIndex == -1)
+			continue; // e.g. "rec " lists
+
+		uint32_t chunkType = id >> 16;
+		if (chunkType != MKTAG('d', 'b', 0, 0) && chunkType != MKTAG('d', 'c', 0, 0) && chunkType != MKTAG('w', 'b', 0, 0))
+			return false; // e.g. palette changes
+		if (streamIndex >= (int)chunks->size())
+			return false;
+
+		// Find out how offsets are stored by looking at the first chunk
+		if (baseOffset == -1)
+		{
+			uint32_t headerId, headerSize, listType;
+			if (readChunkHeader(fd, moviPos + chunkOffset, &headerId, &headerSize, &listType) && headerId == id)
+				baseOffset = moviPos;
+			else if (readChunkHeader(fd, chunkOffset, &headerId, &headerSize, &listType) && headerId == id)
+				baseOffset = 0;
+			else
+				return false;
+		}
+
+		chunks->at(streamIndex).push_back({ baseOffset + chunkOffset + 8, chunkSize, (flags & AVIIF_KEYFRAME) != 0 });
+	}
+
+	return true;
+}
+
+AviReader *AviReader::open(const char *filename, const AVFormatContext *formatContext, size_t readAheadSize)
+{
+	int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return nullptr;
+
+	auto giveUp = [&](const char *reason) -> AviReader*
+	{
+		logDebug("Not reading AVI packets from the index: %s\n", reason);
+		close(fd);
+		return nullptr;
+	};
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return giveUp("fstat failed");
+
+	uint32_t id, size, listType;
+	if (!readChunkHeader(fd, 0, &id, &size, &listType) || id != MKTAG('R', 'I', 'F', 'F') || listType != MKTAG('A', 'V', 'I', ' '))
+		return giveUp("not an AVI file");
+
+	// Only the first RIFF chunk contains headers and the idx1 index, the
+	// following ones (AVIX) only contain data
+	std::vector<AviStream> streams;
+	int64_t riffEnd = std::min<int64_t>(8 + (int64_t)size, st.st_size);
+	int64_t moviPos = -1, idx1Pos = -1;
+	uint32_t idx1Size = 0;
+
+	for (int64_t offset = 12; offset + 8 <= riffEnd;)
+	{
+		if (!readChunkHeader(fd, offset, &id, &size, &listType))
+			return giveUp("truncated header");
+
+		if (id == MKTAG('L', 'I', 'S', 'T') && listType == MKTAG('h', 'd', 'r', 'l'))
+		{
+			if (!parseHeaderList(fd, offset + 12, offset + 8 + size, &streams))
+				return giveUp("unsupported stream headers");
+		}
+		else if (id == MKTAG('L', 'I', 'S', 'T') && listType == MKTAG('m', 'o', 'v', 'i'))
+		{
+			moviPos = offset + 8;
+		}
+		else if (id == MKTAG('i', 'd', 'x', '1'))
+		{
+			idx1Pos = offset;
+			idx1Size = size;
+		}
+
+		offset += 8 + size + (size & 1);
+	}
+
+	// Streams must be the same that libavformat found, in the same order
+	if (streams.size() != formatContext->nb_streams)
+		return giveUp("stream count mismatch");
+
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		AVMediaType expectedType;
+		if (streams[i].type == MKTAG('v', 'i', 'd', 's'))
+			expectedType = AVMEDIA_TYPE_VIDEO;
+		else if (streams[i].type == MKTAG('a', 'u', 'd', 's'))
+			expectedType = AVMEDIA_TYPE_AUDIO;
+		else
+			return giveUp("unsupported stream type");
+
+		const AVCodecParameters *codecParameters = formatContext->streams[i]->codecpar;
+		if (codecParameters->codec_type != expectedType)
+			return giveUp("stream type mismatch");
+
+		// libavformat attaches the palette of strf to the first packet, and
+		// palette changes are not listed in the OpenDML index
+		if (expectedType == AVMEDIA_TYPE_VIDEO && (codecParameters->format == AV_PIX_FMT_PAL8 ||
+			(codecParameters->bits_per_coded_sample > 0 && codecParameters->bits_per_coded_sample <= 8)))
+			return giveUp("palettized video streams are not supported");
+
+		if (streams[i].start != 0)
+			return giveUp("streams with a start delay are not supported");
+	}
+
+	// Prefer the OpenDML index, which also covers the AVIX chunks
+	std::vector<std::vector<ChunkRef>> chunks(streams.size());
+	bool hasOpenDMLIndex = std::all_of(streams.begin(), streams.end(), [](const AviStream &s) { return !s.subIndexes.empty(); });
+
+	if (hasOpenDMLIndex)
+	{
+		for (size_t i = 0; i < streams.size(); i++)
+		{
+			for (int64_t subIndex : streams[i].subIndexes)
+			{
+				if (!parseStandardIndex(fd, subIndex, i, &chunks[i]))
+					return giveUp("unsupported or corrupt OpenDML index");
+			}
+		}
+	}
+	else if (idx1Pos != -1 && moviPos != -1)
+	{
+		if (!parseIdx1(fd, idx1Pos, idx1Size, moviPos, &chunks))
+			return giveUp("unsupported or corrupt idx1 index");
+	}
+	else
+	{
+		return giveUp("no usable index");
+	}
+
+	// Assign timestamps as libavformat does: streams with a sample size
+	// count samples, the others count chunks
+	std::vector<IndexEntry> index;
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		int64_t dts = 0;
+		for (const ChunkRef &chunk : chunks[i])
+		{
+			if (chunk.size == 0 || chunk.size > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE)
+				return giveUp("unsupported chunk size");
+			if (chunk.pos < 8 || chunk.pos + chunk.size > st.st_size)
+				return giveUp("index points outside of the file");
+
+			IndexEntry entry;
+			entry.pos = chunk.pos;
+			entry.size = chunk.size;
+			entry.streamIndex = i;
+			entry.keyframe = chunk.keyframe;
+
+			uint32_t sampleSize = streams[i].sampleSize;
+			if (sampleSize != 0)
+			{
+				entry.dts = dts / sampleSize;
+				entry.duration = chunk.size / sampleSize;
+				dts += chunk.size;
+			}
+			else
+			{
+				entry.dts = dts++;
+				entry.duration = 1;
+			}
+
+			index.push_back(entry);
+		}
+	}
+
+	std::stable_sort(index.begin(), index.end(), [](const IndexEntry &a, const IndexEntry &b) { return a.pos < b.pos; });
+
+	// Each chunk must be followed by the header of the next one
+	for (size_t i = 1; i < index.size(); i++)
+	{
+		if (index[i - 1].pos + index[i - 1].size > index[i].pos - 8)
+			return giveUp("overlapping chunks in the index");
+	}
+
+	logDebug("Reading AVI packets from the index: %zu packets\n", index.size());
+	return new AviReader(fd, std::move(index), readAheadSize);
+}
+
+AviReader::AviReader(int fd, std::vector<IndexEntry> &&index, size_t readAheadSize)
+: m_fd(fd), m_index(std::move(index)), m_maxWindowBytes(readAheadSize),
+  m_windowBytes(0), m_nextEntry(0), m_stopping(false)
+{
+	for (int i = 0; i < AVI_READER_THREADS; i++)
+		m_threads.emplace_back(&AviReader::readerMain, this);
+}
+
+AviReader::~AviReader()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+
+	m_spaceAvailable.notify_all();
+	for (std::thread &thread : m_threads)
+		thread.join(); // waits for the payloads being fetched
+
+	for (Slot &slot : m_window)
+		av_packet_free(&slot.packet);
+
+	close(m_fd);
+}
+
+int AviReader::readPacket(AVPacket *packet)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_window.empty() && m_nextEntry == m_index.size())
+		return AVERROR_EOF;
+
+	m_slotReady.wait(lock, [&] { return !m_window.empty() && m_window.front().ready; });
+
+	Slot slot = m_window.front();
+	m_windowBytes -= m_index[m_nextEntry - m_window.size()].size;
+	m_window.pop_front();
+
+	lock.unlock();
+	m_spaceAvailable.notify_all();
+
+	if (slot.result == 0)
+		av_packet_move_ref(packet, slot.packet);
+
+	av_packet_free(&slot.packet);
+	return slot.result;
+}
+
+void AviReader::readerMain()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (true)
+	{
+		// Fetch the next payload, unless too much data is already waiting
+		m_spaceAvailable.wait(lock, [&] { return m_stopping || (m_nextEntry != m_index.size() &&
+			(m_window.empty() || m_windowBytes + m_index[m_nextEntry].size <= m_maxWindowBytes)); });
+		if (m_stopping)
+			break;
+
+		const IndexEntry &entry = m_index[m_nextEntry++];
+		m_window.push_back({ av_packet_alloc(), false, 0 });
+		m_windowBytes += entry.size;
+
+		// References to deque elements stay valid while others are added
+		// or removed at the ends, and this one is not removed until ready
+		Slot &slot = m_window.back();
+
+		lock.unlock();
+		int r = slot.packet != nullptr ? fetch(entry, slot.packet) : AVERROR(ENOMEM);
+		lock.lock();
+
+		slot.result = r;
+		slot.ready = true;
+		m_slotReady.notify_all();
+	}
+}
+
+int AviReader::fetch(const IndexEntry &entry, AVPacket *packet)
+{
+	int r = av_new_packet(packet, entry.size);
+	if (r < 0)
+		return r;
+
+	// The chunk header is read along with the payload, to check that the
+	// index really points to a chunk of the expected stream
+	uint8_t header[8];
+	struct iovec iov[2] = { { header, sizeof(header) }, { packet->data, (size_t)entry.size } };
+
+	ssize_t n = preadv(m_fd, iov, 2, entry.pos - sizeof(header));
+	if (n < 0)
+		return AVERROR(errno);
+	else if (n != (ssize_t)(sizeof(header) + entry.size))
+		return AVERROR_EOF;
+
+	if (chunkStreamIndex(AV_RL32(header)) != entry.streamIndex || AV_RL32(header + 4) != (uint32_t)entry.size)
+	{
+		logDebug("AVI chunk at %" PRIi64 " does not match the index\n", entry.pos);
+		return AVERROR_INVALIDDATA;
+	}
+
+	packet->stream_index = entry.streamIndex;
+	packet->pos = entry.pos;
+	packet->pts = packet->dts = entry.dts;
+	packet->duration = entry.duration;
+	if (entry.keyframe)
+		packet->flags |= AV_PKT_FLAG_KEY;
+
+	return 0;
+}
@@ -0,0 +1,88 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AVIREADER_H
+#define AVIREADER_H
+
+#include "libav.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Reads the packets of an AVI (or OpenDML) file by looking them up in its
+// index, instead of scanning the file like libavformat does. The payloads are
+// fetched ahead of time by several threads with positional reads, so that
+// reading keeps up with the encoders.
+//
+// Packets are returned in file order, with the same stream indices, positions,
+// sizes and time base as libavformat. Audio chunks are not split into smaller
+// packets, though, so the packets must always be read with the same reader.
+// Palettized video streams are left to libavformat, which passes their
+// palettes as packet side data.
+class AviReader
+{
+	public:
+		// Parses the headers and the index of filename, which formatContext
+		// has been opened on. Returns nullptr if the file is not an AVI file
+		// or if anything about it cannot be validated, in which case the
+		// packets must be read with av_read_frame instead.
+		static AviReader *open(const char *filename, const AVFormatContext *formatContext, size_t readAheadSize);
+		~AviReader();
+
+		// Same as av_read_frame
+		int readPacket(AVPacket *packet);
+
+	private:
+		struct IndexEntry
+		{
+			int64_t pos; // of the payload, the chunk header is right before it
+			int size;
+			int streamIndex;
+			int64_t dts, duration;
+			bool keyframe;
+		};
+
+		struct Slot
+		{
+			AVPacket *packet;
+			bool ready;
+			int result; // 0 or AVERROR code
+		};
+
+		AviReader(int fd, std::vector<IndexEntry> &&index, size_t readAheadSize);
+
+		void readerMain();
+		int fetch(const IndexEntry &entry, AVPacket *packet);
+
+		int m_fd;
+		std::vector<IndexEntry> m_index;
+		size_t m_maxWindowBytes;
+
+		std::mutex m_mutex;
+		std::condition_variable m_slotReady, m_spaceAvailable;
+		std::deque<Slot> m_window; // from m_nextEntry - m_window.size() to m_nextEntry
+		size_t m_windowBytes;
+		size_t m_nextEntry; // next entry to be fetched
+		bool m_stopping;
+
+		std::vector<std::thread> m_threads;
+};
+
+#endif
@@ -0,0 +1,129 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bufferpool.h"
+
+#include "log.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Buffers of at least this size are aligned so that they can be backed by
+// transparent huge pages
+static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// Alignment of each row, so that SIMD code can work on whole rows
+static constexpr int LINESIZE_ALIGNMENT = 64;
+
+static void freeBuffer(void *, uint8_t *data)
+{
+	free(data);
+}
+
+// Computes aligned linesizes and returns the size of the whole frame
+static int frameBufferSize(AVPixelFormat pixelFormat, int width, int height, int outLinesizes[4])
+{
+	failOnAVERROR(av_image_fill_linesizes(outLinesizes, pixelFormat, width), "av_image_fill_linesizes");
+
+	for (int i = 0; i < 4; i++)
+		outLinesizes[i] = FFALIGN(outLinesizes[i], LINESIZE_ALIGNMENT);
+
+	uint8_t *data[4];
+	int result = av_image_fill_pointers(data, pixelFormat, height, nullptr, outLinesizes);
+	failOnAVERROR(result, "av_image_fill_pointers");
+
+	return result;
+}
+
+BufferPool::BufferPool(int bufferSize)
+: m_bufferSize(bufferSize), m_allocationCount(0), m_requestCount(0)
+{
+	m_pool = av_buffer_pool_init2(bufferSize, this, &BufferPool::allocate, nullptr);
+	if (m_pool == nullptr)
+		logError("av_buffer_pool_init2 failed\n");
+}
+
+BufferPool::~BufferPool()
+{
+	logDebug("Buffer pool (%d bytes per buffer): %zu buffers allocated for %zu requests\n",
+		m_bufferSize, m_allocationCount.load(), m_requestCount.load());
+
+	// Buffers that are still referenced are freed when they are released
+	av_buffer_pool_uninit(&m_pool);
+}
+
+AVBufferRef *BufferPool::get()
+{
+	m_requestCount++;
+
+	AVBufferRef *result = av_buffer_pool_get(m_pool);
+	if (result == nullptr)
+		logError("av_buffer_pool_get failed\n");
+
+	return result;
+}
+
+AVBufferRef *BufferPool::allocate(void *opaque, int size)
+{
+	BufferPool *pool = (BufferPool*)opaque;
+	size_t allocSize = (size_t)size + AV_INPUT_BUFFER_PADDING_SIZE;
+	size_t alignment = allocSize >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : LINESIZE_ALIGNMENT;
+
+	void *data;
+	if (posix_memalign(&data, alignment, allocSize) != 0)
+		return nullptr;
+
+	// Only the huge pages that lie entirely inside the buffer are advised, as
+	// the memory past its end belongs to other allocations. Failure is not
+	// fatal: the kernel may not support transparent huge pages.
+	if (alignment == HUGE_PAGE_SIZE)
+		madvise(data, allocSize / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+
+	memset((uint8_t*)data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+	AVBufferRef *result = av_buffer_create((uint8_t*)data, size, freeBuffer, nullptr, 0);
+	if (result == nullptr)
+	{
+		free(data);
+		return nullptr;
+	}
+
+	pool->m_allocationCount++;
+	return result;
+}
+
+FrameBufferPool::FrameBufferPool(AVPixelFormat pixelFormat, int width, int height)
+: m_pixelFormat(pixelFormat), m_width(width), m_height(height),
+  m_pool(frameBufferSize(pixelFormat, width, height, m_linesizes))
+{
+}
+
+void FrameBufferPool::getBuffer(AVFrame *frame)
+{
+	assert(frame->buf[0] == nullptr);
+	assert(frame->format == m_pixelFormat && frame->width == m_width && frame->height == m_height);
+
+	frame->buf[0] = m_pool.get();
+
+	failOnAVERROR(av_image_fill_pointers(frame->data, m_pixelFormat, m_height, frame->buf[0]->data, m_linesizes), "av_image_fill_pointers");
+	for (int i = 0; i < 4; i++)
+		frame->linesize[i] = m_linesizes[i];
+
+	frame->extended_data = frame->data;
+}
@@ -0,0 +1,64 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include "libav.h"
+
+#include <atomic>
+
+// Pool of equally-sized, zero-padded buffers. Buffers are allocated on huge
+// pages when they are big enough, and they are never released to the system
+// until the pool is destroyed, so that processing frames of the same size does
+// not cause any allocation once the pool has grown to the number of frames in
+// flight. It is safe to get buffers from multiple threads.
+class BufferPool
+{
+	public:
+		explicit BufferPool(int bufferSize);
+		~BufferPool();
+
+		// Returns a reference to a buffer of at least bufferSize bytes,
+		// followed by AV_INPUT_BUFFER_PADDING_SIZE zero bytes
+		AVBufferRef *get();
+
+	private:
+		static AVBufferRef *allocate(void *opaque, int size);
+
+		AVBufferPool *m_pool;
+		int m_bufferSize;
+		std::atomic<size_t> m_allocationCount, m_requestCount;
+};
+
+// Pool of video frame buffers with the given format and size
+class FrameBufferPool
+{
+	public:
+		FrameBufferPool(AVPixelFormat pixelFormat, int width, int height);
+
+		// Attaches a buffer to frame, which must have no buffer yet
+		void getBuffer(AVFrame *frame);
+
+	private:
+		AVPixelFormat m_pixelFormat;
+		int m_width, m_height;
+		int m_linesizes[4];
+		BufferPool m_pool;
+};
+
+#endif
@@ -0,0 +1,136 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "checkpoint.h"
+
+#include "fileio.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static constexpr int32_t CHECKPOINT_MAGIC_SIGNATURE = MKBETAG('L', 'L', 'R', 'K');
+
+static void syncFile(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		logError("open: %s: %s\n", filename, strerror(errno));
+
+	if (fsync(fd) != 0)
+		logError("fsync: %s: %s\n", filename, strerror(errno));
+
+	close(fd);
+}
+
+std::string partialFilename(const char *outputFilename, uint32_t generation)
+{
+	return std::string(outputFilename) + "." + std::to_string(generation) + ".partial";
+}
+
+void syncParentDirectory(const char *filename)
+{
+	std::string directory = filename;
+	size_t slash = directory.rfind('/');
+	directory = (slash == std::string::npos) ? "." : directory.substr(0, slash + 1);
+
+	syncFile(directory.c_str());
+}
+
+void flushOutputToDisk(AVFormatContext *outputFormatContext)
+{
+	// Write all the packets that are still waiting in the interleaving queue
+	failOnAVERROR(av_interleaved_write_frame(outputFormatContext, nullptr), "av_interleaved_write_frame");
+
+	// Close the current Matroska cluster, so that it can be demuxed back
+	if (outputFormatContext->oformat->flags & AVFMT_ALLOW_FLUSH)
+	{
+		int r = av_write_frame(outputFormatContext, nullptr);
+		if (r < 0)
+			failOnAVERROR(r, "av_write_frame");
+	}
+
+	failOnAVERROR(syncWriteBehind(outputFormatContext->pb, true), "syncWriteBehind");
+}
+
+void writeCheckpoint(const char *checkpointFilename, const Checkpoint &checkpoint)
+{
+	std::string tempFilename = std::string(checkpointFilename) + ".tmp";
+
+	logDebug("Writing checkpoint: generation %u, %" PRIi64 " input packets, %" PRIi64 " output bytes\n",
+		checkpoint.generation, checkpoint.inputPacketCount, checkpoint.outputFileSize);
+
+	AVIOContext *file;
+	failOnAVERROR(avio_open(&file, tempFilename.c_str(), AVIO_FLAG_WRITE), "avio_open: %s", tempFilename.c_str());
+
+	failOnWriteError(avio_wb32, file, CHECKPOINT_MAGIC_SIGNATURE);
+	failOnWriteError(avio_wb32, file, checkpoint.generation);
+	failOnWriteError(avio_wb64, file, checkpoint.inputFileSize);
+	failOnWriteError(avio_wb64, file, checkpoint.inputPacketCount);
+	failOnWriteError(avio_w8, file, checkpoint.aviReader);
+	failOnWriteError(avio_wb64, file, checkpoint.outputFileSize);
+
+	failOnWriteError(avio_wb32, file, checkpoint.outputPacketCounts.size());
+	for (size_t count : checkpoint.outputPacketCounts)
+		failOnWriteError(avio_wb64, file, count);
+
+	checkpoint.packetRefs.serialize(file);
+
+	failOnAVERROR(avio_closep(&file), "avio_closep");
+
+	// Make sure that the new checkpoint is complete before replacing the old one
+	syncFile(tempFilename.c_str());
+	if (rename(tempFilename.c_str(), checkpointFilename) != 0)
+		logError("rename: %s: %s\n", checkpointFilename, strerror(errno));
+	syncParentDirectory(checkpointFilename);
+}
+
+Checkpoint readCheckpoint(const char *checkpointFilename)
+{
+	Checkpoint result;
+
+	AVIOContext *file;
+	failOnAVERROR(openReadAhead(&file, checkpointFilename, 0), "openReadAhead: %s", checkpointFilename);
+
+	if (avio_rb32(file) != CHECKPOINT_MAGIC_SIGNATURE)
+		logError("Invalid checkpoint file signature\n");
+
+	result.generation = avio_rb32(file);
+	result.inputFileSize = avio_rb64(file);
+	result.inputPacketCount = avio_rb64(file);
+	result.aviReader = avio_r8(file) != 0;
+	result.outputFileSize = avio_rb64(file);
+
+	int32_t streamCount = avio_rb32(file);
+	while (streamCount-- != 0)
+		result.outputPacketCounts.push_back(avio_rb64(file));
+
+	result.packetRefs.deserialize(file);
+
+	if (avio_feof(file))
+		logError("Truncated checkpoint file\n");
+
+	failOnAVERROR(closeReadAhead(&file), "closeReadAhead");
+
+	logDebug("Loaded checkpoint: generation %u, %" PRIi64 " input packets, %" PRIi64 " output bytes\n",
+		result.generation, result.inputPacketCount, result.outputFileSize);
+
+	return result;
+}
@@ -0,0 +1,61 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "llrfile.h"
+
+// Snapshot of a compression job, taken right after all the packets written so
+// far have been flushed to disk. It contains everything that is needed to
+// continue from the same point without encoding those packets again.
+struct Checkpoint
+{
+	// Incremented by each resumed run, whose source is the output file of the
+	// previous run renamed after this generation (see partialFilename)
+	uint32_t generation;
+
+	int64_t inputFileSize;
+	int64_t inputPacketCount; // number of input packets already processed
+
+	// AviReader splits the packets differently from libavformat, so the
+	// packets can only be counted again with the same reader
+	bool aviReader;
+
+	int64_t outputFileSize; // size of the .mkv file at checkpoint time
+	std::vector<size_t> outputPacketCounts; // per output stream
+
+	PacketReferences packetRefs;
+};
+
+// Flushes the muxer and makes sure that all the packets that have been given
+// to it so far are stored durably in the output file, which must have been
+// opened with openWriteBehind
+void flushOutputToDisk(AVFormatContext *outputFormatContext);
+
+// Atomically and durably replaces the checkpoint file
+void writeCheckpoint(const char *checkpointFilename, const Checkpoint &checkpoint);
+Checkpoint readCheckpoint(const char *checkpointFilename);
+
+// Name under which the output file written with checkpoints of the given
+// generation is kept while a resumed run copies its packets
+std::string partialFilename(const char *outputFilename, uint32_t generation);
+
+// Makes the creation or renaming of filename durable
+void syncParentDirectory(const char *filename);
+
+#endif
@@ -20,6 +20,7 @@
 #include "log.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
 
 static const std::string defaultVideoCodec = "ffv1";
@@ -28,11 +29,12 @@ static const std::map<std::string, std::string> defaultVideoCodecOptions
 	{ "level", "3" },
 	{ "slicecrc", "0" },
 	{ "context", "1" },
-	{ "coder", "range_def" },
-	{ "g", "600" },
-	{ "slices", "4" }
+	{ "coder", "range_def" }
 };
+static const AutoCodecPolicy defaultAutoCodecPolicy = { AutoCodecPolicy::FastestWithinRatio, 5 };
+static const std::string defaultAudioCodec = "flac";
 static const std::string defaultHashName = "MD5";
+static const size_t defaultReadAheadSize = 64 * 1024 * 1024;
 
 static std::string defaultLibavLogLevel = "warning";
 static std::map<std::string, int> libavLogLevels =
@@ -48,12 +50,24 @@ static std::map<std::string, int> libavLogLevels =
 	{ "trace", AV_LOG_TRACE }
 };
 
+static const std::map<std::string, IoQueue::Backend> ioBackends =
+{
+	{ "blocking", IoQueue::Blocking },
+	{ "io_uring", IoQueue::IoUring }
+};
+
 static AVCodecID parseVideoCodec(const std::string &name)
 {
 	if (name == "ffv1")
 		return AV_CODEC_ID_FFV1;
 	if (name == "huffyuv")
 		return AV_CODEC_ID_HUFFYUV;
+	if (name == "ffvhuff")
+		return AV_CODEC_ID_FFVHUFF;
+	if (name == "utvideo")
+		return AV_CODEC_ID_UTVIDEO;
+	if (name == "magicyuv")
+		return AV_CODEC_ID_MAGICYUV;
 	if (name == "h264")
 		return AV_CODEC_ID_H264;
 
@@ -61,6 +75,62 @@ static AVCodecID parseVideoCodec(const std::string &name)
 	return AV_CODEC_ID_NONE;
 }
 
+// Parses the options of -v auto, i.e. either min-fps=FPS or max-loss=PERCENT
+static bool parseAutoCodecPolicy(const std::map<std::string, std::string> &options, AutoCodecPolicy *outPolicy)
+{
+	if (options.empty())
+	{
+		*outPolicy = defaultAutoCodecPolicy;
+		return true;
+	}
+
+	if (options.size() != 1)
+	{
+		logWarning("Only one of min-fps and max-loss can be given to -v auto\n");
+		return false;
+	}
+
+	const auto &[key, value] = *options.begin();
+	if (key == "min-fps")
+		outPolicy->criterion = AutoCodecPolicy::SmallestAboveFps;
+	else if (key == "max-loss")
+		outPolicy->criterion = AutoCodecPolicy::FastestWithinRatio;
+	else
+	{
+		logWarning("Invalid option for -v auto (expected min-fps or max-loss): %s\n", key.c_str());
+		return false;
+	}
+
+	char *endptr;
+	outPolicy->threshold = strtod(value.c_str(), &endptr);
+	if (*endptr != '\0' || outPolicy->threshold < 0)
+	{
+		logWarning("Invalid value for -v auto option %s: %s\n", key.c_str(), value.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// "copy" is returned as AV_CODEC_ID_NONE
+static bool parseAudioCodec(const std::string &name, AVCodecID *outCodec)
+{
+	if (name == "flac")
+	{
+		*outCodec = AV_CODEC_ID_FLAC;
+		return true;
+	}
+
+	if (name == "copy")
+	{
+		*outCodec = AV_CODEC_ID_NONE;
+		return true;
+	}
+
+	logWarning("Invalid or unsupported audio codec: %s\n", name.c_str());
+	return false;
+}
+
 static std::pair<std::map<std::string, std::string>, bool> parseCodecOptions(char *args[], size_t count)
 {
 	std::map<std::string, std::string> result;
@@ -93,6 +163,67 @@ static std::pair<std::map<std::string, std::string>, bool> parseCodecOptions(cha
 	return { result, errorFlag };
 }
 
+static bool parseRange(const char *arg, std::pair<int64_t, int64_t> *outRange)
+{
+	char *endptr;
+
+	const char *colon = strchr(arg, ':');
+	if (colon == nullptr || colon == arg)
+		return false;
+
+	long long start = strtoll(arg, &endptr, 10);
+	if (endptr != colon || start < 0)
+		return false;
+
+	long long end = INT64_MAX; // END can be omitted to process until the end of the file
+	if (colon[1] != '\0')
+	{
+		end = strtoll(colon + 1, &endptr, 10);
+		if (*endptr != '\0' || end <= start)
+			return false;
+	}
+
+	*outRange = { start, end };
+	return true;
+}
+
+// Parses a size in bytes, optionally followed by a K, M or G binary multiplier
+static bool parseMemorySize(const char *arg, size_t *outSize)
+{
+	char *endptr;
+
+	unsigned long long value = strtoull(arg, &endptr, 10);
+	if (endptr == arg || *arg == '-' || value == 0)
+		return false;
+
+	int shift = 0;
+	switch (*endptr)
+	{
+		case '\0':
+			break;
+		case 'K':
+			shift = 10;
+			endptr++;
+			break;
+		case 'M':
+			shift = 20;
+			endptr++;
+			break;
+		case 'G':
+			shift = 30;
+			endptr++;
+			break;
+		default:
+			return false;
+	}
+
+	if (*endptr != '\0' || value > (SIZE_MAX >> shift))
+		return false;
+
+	*outSize = value << shift;
+	return true;
+}
+
 static std::string llrFileFromMkv(const char *argName, const std::string &argValue)
 {
 	if (argValue.length() >= 4 && argValue.substr(argValue.length() - 4) == ".mkv")
@@ -104,14 +235,32 @@ static std::string llrFileFromMkv(const char *argName, const std::string &argVal
 
 CommandLine::CommandLine(int argc, char *argv[])
 : m_debugFlag(false), m_libavLogLevel(libavLogLevels.at(defaultLibavLogLevel)),
-  m_decompressFlag(false),
-  m_videoCodec(parseVideoCodec(defaultVideoCodec)), m_videoCodecOptions(defaultVideoCodecOptions), m_hashName(defaultHashName)
+  m_readAheadSize(defaultReadAheadSize),
+  m_ioBackend(IoQueue::isBackendAvailable(IoQueue::IoUring) ? IoQueue::IoUring : IoQueue::Blocking), m_directIoFlag(false),
+  m_decompressFlag(false), m_recompressFlag(false),
+  m_videoCodec(parseVideoCodec(defaultVideoCodec)), m_videoCodecOptions(defaultVideoCodecOptions),
+  m_audioCodec(AV_CODEC_ID_FLAC), m_hashName(defaultHashName),
+  m_maxMemory(0), m_dedupFlag(false), m_planeReductionFlag(true), m_proxyWidth(0), m_targetFps(0), m_rawFallbackRatio(0), m_mapInputFlag(false), m_checkpointInterval(0), m_resumeFlag(false),
+  m_segmentSize(0), m_segmentTime(0)
 {
 	bool seenLibavLogLevel = false;
+	bool seenReadAheadSize = false;
+	bool seenIoBackend = false;
+	bool seenStoreDirectory = false;
 	bool seenInputFile = false;
 	bool seenOutputFile = false;
 	bool seenVideoCodec = false;
+	bool seenAudioCodec = false;
 	bool seenHashName = false;
+	bool seenMaxMemory = false;
+	bool seenTargetFps = false;
+	bool seenRawFallback = false;
+	bool seenProxyWidth = false;
+	bool seenCheckpointInterval = false;
+	bool seenInputRange = false;
+	bool seenSegmentSize = false;
+	bool seenSegmentTime = false;
+	bool seenRestoreFile = false;
 	bool seenDoubleDash = false;
 	bool valid = true;
 
@@ -181,6 +330,90 @@ process_positional_argument:
 
 			seenLibavLogLevel = true;
 		}
+		else if (strcmp(argv[i], "--read-ahead") == 0)
+		{
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --read-ahead SIZE\n");
+				valid = false;
+			}
+			else if (seenReadAheadSize)
+			{
+				logWarning("Option cannot be repeated more than once: --read-ahead SIZE\n");
+				valid = false;
+			}
+			else if (!parseMemorySize(argv[i], &m_readAheadSize))
+			{
+				logWarning("Invalid read-ahead size: %s\n", argv[i]);
+				valid = false;
+			}
+
+			seenReadAheadSize = true;
+		}
+		else if (strcmp(argv[i], "--io-backend") == 0)
+		{
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --io-backend NAME\n");
+				valid = false;
+			}
+			else if (seenIoBackend)
+			{
+				logWarning("Option cannot be repeated more than once: --io-backend NAME\n");
+				valid = false;
+			}
+			else
+			{
+				auto it = ioBackends.find(argv[i]);
+				if (it != ioBackends.end() && IoQueue::isBackendAvailable(it->second))
+				{
+					m_ioBackend = it->second;
+				}
+				else
+				{
+					logWarning("Invalid or unsupported I/O backend: %s\n", argv[i]);
+					valid = false;
+				}
+			}
+
+			seenIoBackend = true;
+		}
+		else if (strcmp(argv[i], "--direct-io") == 0)
+		{
+			if (m_directIoFlag)
+			{
+				logWarning("Option cannot be repeated more than once: --direct-io\n");
+				valid = false;
+			}
+			else
+			{
+				m_directIoFlag = true;
+			}
+		}
+		else if (strcmp(argv[i], "--store") == 0)
+		{
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --store DIR\n");
+				valid = false;
+			}
+			else if (seenStoreDirectory)
+			{
+				logWarning("Option cannot be repeated more than once: --store DIR\n");
+				valid = false;
+			}
+			else if (argv[i][0] == '\0')
+			{
+				logWarning("Invalid store directory: %s\n", argv[i]);
+				valid = false;
+			}
+			else
+			{
+				m_storeDirectory = argv[i];
+			}
+
+			seenStoreDirectory = true;
+		}
 		else if (strcmp(argv[i], "-d") == 0)
 		{
 			if (m_decompressFlag)
@@ -193,6 +426,18 @@ process_positional_argument:
 				m_decompressFlag = true;
 			}
 		}
+		else if (strcmp(argv[i], "-r") == 0)
+		{
+			if (m_recompressFlag)
+			{
+				logWarning("Option cannot be repeated more than once: -r\n");
+				valid = false;
+			}
+			else
+			{
+				m_recompressFlag = true;
+			}
+		}
 		else if (strcmp(argv[i], "-i") == 0)
 		{
 			if (++i >= argc)
@@ -224,6 +469,20 @@ process_positional_argument:
 				logWarning("Option cannot be repeated more than once: -v CODEC_NAME [key=value ...]\n");
 				valid = false;
 			}
+			else if (strcmp(argv[i], "auto") == 0)
+			{
+				m_videoCodec = AV_CODEC_ID_NONE;
+
+				auto [policyOptions, errorFlag] = parseCodecOptions(argv + i + 1, argc - i - 1);
+
+				AutoCodecPolicy policy;
+				if (errorFlag || !parseAutoCodecPolicy(policyOptions, &policy))
+					valid = false;
+				else
+					m_autoVideoCodecPolicy = policy;
+				m_videoCodecOptions.clear();
+				i += policyOptions.size();
+			}
 			else
 			{
 				m_videoCodec = parseVideoCodec(argv[i]);
@@ -238,6 +497,25 @@ process_positional_argument:
 
 			seenVideoCodec = true;
 		}
+		else if (strcmp(argv[i], "-a") == 0)
+		{
+			if (++i >= argc)
+			{
+				logWarning("Argument required: -a CODEC_NAME\n");
+				valid = false;
+			}
+			else if (seenAudioCodec)
+			{
+				logWarning("Option cannot be repeated more than once: -a CODEC_NAME\n");
+				valid = false;
+			}
+			else if (!parseAudioCodec(argv[i], &m_audioCodec))
+			{
+				valid = false;
+			}
+
+			seenAudioCodec = true;
+		}
 		else if (strcmp(argv[i], "--hash") == 0)
 		{
 			if (++i >= argc)
@@ -270,50 +548,679 @@ process_positional_argument:
 
 			seenHashName = true;
 		}
-		else if (strcmp(argv[i], "--") == 0)
+		else if (strcmp(argv[i], "--max-memory") == 0)
 		{
-			seenDoubleDash = true;
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --max-memory SIZE\n");
+				valid = false;
+			}
+			else if (seenMaxMemory)
+			{
+				logWarning("Option cannot be repeated more than once: --max-memory SIZE\n");
+				valid = false;
+			}
+			else if (!parseMemorySize(argv[i], &m_maxMemory))
+			{
+				logWarning("Invalid memory size: %s\n", argv[i]);
+				valid = false;
+			}
+
+			seenMaxMemory = true;
 		}
-		else if (argv[i][0] == '-')
+		else if (strcmp(argv[i], "--dedup") == 0)
 		{
-			logWarning("Invalid option: %s\n", argv[i]);
-			valid = false;
+			if (m_dedupFlag)
+			{
+				logWarning("Option cannot be repeated more than once: --dedup\n");
+				valid = false;
+			}
+			else
+			{
+				m_dedupFlag = true;
+			}
 		}
-		else
+		else if (strcmp(argv[i], "--no-plane-reduction") == 0)
 		{
-			goto process_positional_argument;
+			if (!m_planeReductionFlag)
+			{
+				logWarning("Option cannot be repeated more than once: --no-plane-reduction\n");
+				valid = false;
+			}
+			else
+			{
+				m_planeReductionFlag = false;
+			}
 		}
-	}
-
-	if (m_decompressFlag)
-	{
-		if (seenVideoCodec)
+		else if (strcmp(argv[i], "--proxy") == 0)
 		{
-			logWarning("Option can only be used if -d is not set: -v CODEC_NAME [key=value ...]\n");
-			valid = false;
-		}
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --proxy WIDTH\n");
+				valid = false;
+			}
+			else if (seenProxyWidth)
+			{
+				logWarning("Option cannot be repeated more than once: --proxy WIDTH\n");
+				valid = false;
+			}
+			else
+			{
+				char *endptr;
+				long value = strtol(argv[i], &endptr, 10);
+				if (*argv[i] == '\0' || *endptr != '\0' || value < 2 || value > INT_MAX)
+				{
+					logWarning("Invalid proxy width: %s\n", argv[i]);
+					valid = false;
+				}
+				else
+				{
+					m_proxyWidth = value;
+				}
+			}
 
-		if (seenHashName)
+			seenProxyWidth = true;
+		}
+		else if (strcmp(argv[i], "--target-fps") == 0)
 		{
-			logWarning("Option can only be used if -d is not set: --hash ALGORITHM\n");
-			valid = false;
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --target-fps FPS\n");
+				valid = false;
+			}
+			else if (seenTargetFps)
+			{
+				logWarning("Option cannot be repeated more than once: --target-fps FPS\n");
+				valid = false;
+			}
+			else
+			{
+				char *endptr;
+				double value = strtod(argv[i], &endptr);
+				if (*argv[i] == '\0' || *endptr != '\0' || !(value > 0))
+				{
+					logWarning("Invalid target frame rate: %s\n", argv[i]);
+					valid = false;
+				}
+				else
+				{
+					m_targetFps = value;
+				}
+			}
+
+			seenTargetFps = true;
 		}
-	}
+		else if (strcmp(argv[i], "--raw-fallback") == 0)
+		{
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --raw-fallback PERCENT\n");
+				valid = false;
+			}
+			else if (seenRawFallback)
+			{
+				logWarning("Option cannot be repeated more than once: --raw-fallback PERCENT\n");
+				valid = false;
+			}
+			else
+			{
+				char *endptr;
+				double value = strtod(argv[i], &endptr);
+				if (*argv[i] == '\0' || *endptr != '\0' || !(value > 0))
+				{
+					logWarning("Invalid raw fallback percentage: %s\n", argv[i]);
+					valid = false;
+				}
+				else
+				{
+					m_rawFallbackRatio = value / 100;
+				}
+			}
 
-	if (!seenInputFile)
-	{
-		logWarning("Missing required option: -i INPUT\n");
-		valid = false;
-	}
-	else if (m_decompressFlag)
-	{
-		m_llrFile = llrFileFromMkv("INPUT", m_inputFile);
-		if (m_llrFile.empty())
-			valid = false;
-	}
+			seenRawFallback = true;
+		}
+		else if (strcmp(argv[i], "--checkpoint") == 0)
+		{
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --checkpoint SECONDS\n");
+				valid = false;
+			}
+			else if (seenCheckpointInterval)
+			{
+				logWarning("Option cannot be repeated more than once: --checkpoint SECONDS\n");
+				valid = false;
+			}
+			else
+			{
+				char *endptr;
+				long value = strtol(argv[i], &endptr, 10);
+				if (*argv[i] == '\0' || *endptr != '\0' || value <= 0 || value > INT_MAX)
+				{
+					logWarning("Invalid checkpoint interval: %s\n", argv[i]);
+					valid = false;
+				}
+				else
+				{
+					m_checkpointInterval = value;
+				}
+			}
 
-	if (!seenOutputFile)
-	{
+			seenCheckpointInterval = true;
+		}
+		else if (strcmp(argv[i], "--mmap") == 0)
+		{
+			if (m_mapInputFlag)
+			{
+				logWarning("Option cannot be repeated more than once: --mmap\n");
+				valid = false;
+			}
+			else
+			{
+				m_mapInputFlag = true;
+			}
+		}
+		else if (strcmp(argv[i], "--resume") == 0)
+		{
+			if (m_resumeFlag)
+			{
+				logWarning("Option cannot be repeated more than once: --resume\n");
+				valid = false;
+			}
+			else
+			{
+				m_resumeFlag = true;
+			}
+		}
+		else if (strcmp(argv[i], "--range") == 0)
+		{
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --range START:END\n");
+				valid = false;
+			}
+			else if (seenInputRange)
+			{
+				logWarning("Option cannot be repeated more than once: --range START:END\n");
+				valid = false;
+			}
+			else
+			{
+				std::pair<int64_t, int64_t> range;
+				if (parseRange(argv[i], &range))
+				{
+					m_inputRange = range;
+				}
+				else
+				{
+					logWarning("Invalid byte range: %s\n", argv[i]);
+					valid = false;
+				}
+			}
+
+			seenInputRange = true;
+		}
+		else if (strcmp(argv[i], "--segment-size") == 0)
+		{
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --segment-size SIZE\n");
+				valid = false;
+			}
+			else if (seenSegmentSize)
+			{
+				logWarning("Option cannot be repeated more than once: --segment-size SIZE\n");
+				valid = false;
+			}
+			else if (!parseMemorySize(argv[i], &m_segmentSize))
+			{
+				logWarning("Invalid segment size: %s\n", argv[i]);
+				valid = false;
+			}
+
+			seenSegmentSize = true;
+		}
+		else if (strcmp(argv[i], "--segment-time") == 0)
+		{
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --segment-time SECONDS\n");
+				valid = false;
+			}
+			else if (seenSegmentTime)
+			{
+				logWarning("Option cannot be repeated more than once: --segment-time SECONDS\n");
+				valid = false;
+			}
+			else
+			{
+				char *endptr;
+				long value = strtol(argv[i], &endptr, 10);
+				if (*argv[i] == '\0' || *endptr != '\0' || value <= 0 || value > INT_MAX)
+				{
+					logWarning("Invalid segment duration: %s\n", argv[i]);
+					valid = false;
+				}
+				else
+				{
+					m_segmentTime = value;
+				}
+			}
+
+			seenSegmentTime = true;
+		}
+		else if (strcmp(argv[i], "--file") == 0)
+		{
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --file NAME\n");
+				valid = false;
+			}
+			else if (seenRestoreFile)
+			{
+				logWarning("Option cannot be repeated more than once: --file NAME\n");
+				valid = false;
+			}
+			else
+			{
+				m_restoreFile = argv[i];
+			}
+
+			seenRestoreFile = true;
+		}
+		else if (strcmp(argv[i], "--merge") == 0)
+		{
+			if (++i >= argc)
+			{
+				logWarning("Argument required: --merge PART\n");
+				valid = false;
+			}
+			else if (llrFileFromMkv("PART", argv[i]).empty())
+			{
+				valid = false;
+			}
+			else
+			{
+				m_mergeFiles.push_back(argv[i]);
+			}
+		}
+		else if (strcmp(argv[i], "--") == 0)
+		{
+			seenDoubleDash = true;
+		}
+		else if (argv[i][0] == '-')
+		{
+			logWarning("Invalid option: %s\n", argv[i]);
+			valid = false;
+		}
+		else
+		{
+			goto process_positional_argument;
+		}
+	}
+
+	if (m_decompressFlag && m_recompressFlag)
+	{
+		logWarning("Options cannot be used together: -d, -r\n");
+		valid = false;
+	}
+
+	if (!m_mergeFiles.empty())
+	{
+		if (m_decompressFlag || m_recompressFlag)
+		{
+			logWarning("Option can only be used if neither -d nor -r are set: --merge PART\n");
+			valid = false;
+		}
+
+		if (seenVideoCodec)
+		{
+			logWarning("Options cannot be used together: --merge PART, -v CODEC_NAME [key=value ...]\n");
+			valid = false;
+		}
+
+		if (seenAudioCodec)
+		{
+			logWarning("Options cannot be used together: --merge PART, -a CODEC_NAME\n");
+			valid = false;
+		}
+
+		if (seenInputRange)
+		{
+			logWarning("Options cannot be used together: --merge PART, --range START:END\n");
+			valid = false;
+		}
+
+		if (seenMaxMemory)
+		{
+			logWarning("Options cannot be used together: --merge PART, --max-memory SIZE\n");
+			valid = false;
+		}
+
+		if (m_dedupFlag)
+		{
+			logWarning("Options cannot be used together: --merge PART, --dedup\n");
+			valid = false;
+		}
+
+		if (!m_planeReductionFlag)
+		{
+			logWarning("Options cannot be used together: --merge PART, --no-plane-reduction\n");
+			valid = false;
+		}
+
+		if (seenProxyWidth)
+		{
+			logWarning("Options cannot be used together: --merge PART, --proxy WIDTH\n");
+			valid = false;
+		}
+
+		if (m_mapInputFlag)
+		{
+			logWarning("Options cannot be used together: --merge PART, --mmap\n");
+			valid = false;
+		}
+
+		if (seenTargetFps)
+		{
+			logWarning("Options cannot be used together: --merge PART, --target-fps FPS\n");
+			valid = false;
+		}
+
+		if (seenRawFallback)
+		{
+			logWarning("Options cannot be used together: --merge PART, --raw-fallback PERCENT\n");
+			valid = false;
+		}
+
+		if (seenSegmentSize)
+		{
+			logWarning("Options cannot be used together: --merge PART, --segment-size SIZE\n");
+			valid = false;
+		}
+
+		if (seenSegmentTime)
+		{
+			logWarning("Options cannot be used together: --merge PART, --segment-time SECONDS\n");
+			valid = false;
+		}
+	}
+
+	// The output streams of adaptive encoders do not map one-to-one to the
+	// input streams, which duplicate frames and checkpoints rely on
+	if (seenTargetFps && m_dedupFlag)
+	{
+		logWarning("Options cannot be used together: --target-fps FPS, --dedup\n");
+		valid = false;
+	}
+
+	// Duplicates reference packet indices that are predicted before encoding,
+	// which raw frames would shift
+	if (seenRawFallback && m_dedupFlag)
+	{
+		logWarning("Options cannot be used together: --raw-fallback PERCENT, --dedup\n");
+		valid = false;
+	}
+
+	if (seenRawFallback && seenTargetFps)
+	{
+		logWarning("Options cannot be used together: --raw-fallback PERCENT, --target-fps FPS\n");
+		valid = false;
+	}
+
+	if (seenTargetFps && (seenCheckpointInterval || m_resumeFlag))
+	{
+		logWarning("Checkpoints cannot be used together with --target-fps FPS\n");
+		valid = false;
+	}
+
+	// Resumed packets are not encoded again, so they would be missing
+	if (seenProxyWidth && (seenCheckpointInterval || m_resumeFlag))
+	{
+		logWarning("Checkpoints cannot be used together with --proxy WIDTH\n");
+		valid = false;
+	}
+
+	// Duplicates and packets loaded from the store are not encoded either
+	if (seenProxyWidth && m_dedupFlag)
+	{
+		logWarning("Options cannot be used together: --proxy WIDTH, --dedup\n");
+		valid = false;
+	}
+
+	if (seenProxyWidth && seenStoreDirectory)
+	{
+		logWarning("Options cannot be used together: --proxy WIDTH, --store DIR\n");
+		valid = false;
+	}
+
+	if (m_mapInputFlag && m_directIoFlag)
+	{
+		logWarning("Options cannot be used together: --mmap, --direct-io\n");
+		valid = false;
+	}
+
+	if (seenInputRange && seenHashName)
+	{
+		logWarning("Options cannot be used together: --range START:END, --hash ALGORITHM\n");
+		valid = false;
+	}
+
+	if ((seenInputRange || !m_mergeFiles.empty()) && (seenCheckpointInterval || m_resumeFlag))
+	{
+		logWarning("Checkpoints cannot be used together with --range START:END or --merge PART\n");
+		valid = false;
+	}
+
+	// Each segment has its own reference table, which starts empty
+	if ((seenSegmentSize || seenSegmentTime) && (seenCheckpointInterval || m_resumeFlag))
+	{
+		logWarning("Checkpoints cannot be used together with --segment-size SIZE or --segment-time SECONDS\n");
+		valid = false;
+	}
+
+	if (seenSegmentSize && seenInputRange)
+	{
+		logWarning("Options cannot be used together: --segment-size SIZE, --range START:END\n");
+		valid = false;
+	}
+
+	if (seenSegmentTime && seenInputRange)
+	{
+		logWarning("Options cannot be used together: --segment-time SECONDS, --range START:END\n");
+		valid = false;
+	}
+
+	if (seenSegmentSize && seenProxyWidth)
+	{
+		logWarning("Options cannot be used together: --segment-size SIZE, --proxy WIDTH\n");
+		valid = false;
+	}
+
+	if (seenSegmentTime && seenProxyWidth)
+	{
+		logWarning("Options cannot be used together: --segment-time SECONDS, --proxy WIDTH\n");
+		valid = false;
+	}
+
+	if (m_recompressFlag)
+	{
+		if (seenInputRange)
+		{
+			logWarning("Option can only be used if -r is not set: --range START:END\n");
+			valid = false;
+		}
+
+		if (seenHashName)
+		{
+			logWarning("Option can only be used if -r is not set: --hash ALGORITHM\n");
+			valid = false;
+		}
+
+		if (seenCheckpointInterval)
+		{
+			logWarning("Option can only be used if -r is not set: --checkpoint SECONDS\n");
+			valid = false;
+		}
+
+		if (m_resumeFlag)
+		{
+			logWarning("Option can only be used if -r is not set: --resume\n");
+			valid = false;
+		}
+
+		if (m_mapInputFlag)
+		{
+			logWarning("Option can only be used if -r is not set: --mmap\n");
+			valid = false;
+		}
+
+		if (seenTargetFps)
+		{
+			logWarning("Option can only be used if -r is not set: --target-fps FPS\n");
+			valid = false;
+		}
+
+		// Raw frames are stored as embedded chunks, which are only copied
+		// from the source LLR file
+		if (seenRawFallback)
+		{
+			logWarning("Option can only be used if -r is not set: --raw-fallback PERCENT\n");
+			valid = false;
+		}
+
+		if (seenSegmentSize)
+		{
+			logWarning("Option can only be used if -r is not set: --segment-size SIZE\n");
+			valid = false;
+		}
+
+		if (seenSegmentTime)
+		{
+			logWarning("Option can only be used if -r is not set: --segment-time SECONDS\n");
+			valid = false;
+		}
+	}
+
+	if (seenRestoreFile && !m_decompressFlag)
+	{
+		logWarning("Option can only be used if -d is set: --file NAME\n");
+		valid = false;
+	}
+
+	if (m_decompressFlag)
+	{
+		if (seenVideoCodec)
+		{
+			logWarning("Option can only be used if -d is not set: -v CODEC_NAME [key=value ...]\n");
+			valid = false;
+		}
+
+		if (seenAudioCodec)
+		{
+			logWarning("Option can only be used if -d is not set: -a CODEC_NAME\n");
+			valid = false;
+		}
+
+		if (seenMaxMemory)
+		{
+			logWarning("Option can only be used if -d is not set: --max-memory SIZE\n");
+			valid = false;
+		}
+
+		if (m_dedupFlag)
+		{
+			logWarning("Option can only be used if -d is not set: --dedup\n");
+			valid = false;
+		}
+
+		if (!m_planeReductionFlag)
+		{
+			logWarning("Option can only be used if -d is not set: --no-plane-reduction\n");
+			valid = false;
+		}
+
+		if (seenProxyWidth)
+		{
+			logWarning("Option can only be used if -d is not set: --proxy WIDTH\n");
+			valid = false;
+		}
+
+		if (seenTargetFps)
+		{
+			logWarning("Option can only be used if -d is not set: --target-fps FPS\n");
+			valid = false;
+		}
+
+		if (seenRawFallback)
+		{
+			logWarning("Option can only be used if -d is not set: --raw-fallback PERCENT\n");
+			valid = false;
+		}
+
+		if (seenHashName)
+		{
+			logWarning("Option can only be used if -d is not set: --hash ALGORITHM\n");
+			valid = false;
+		}
+
+		if (seenCheckpointInterval)
+		{
+			logWarning("Option can only be used if -d is not set: --checkpoint SECONDS\n");
+			valid = false;
+		}
+
+		if (m_resumeFlag)
+		{
+			logWarning("Option can only be used if -d is not set: --resume\n");
+			valid = false;
+		}
+
+		if (m_mapInputFlag)
+		{
+			logWarning("Option can only be used if -d is not set: --mmap\n");
+			valid = false;
+		}
+
+		if (seenInputRange)
+		{
+			logWarning("Option can only be used if -d is not set: --range START:END\n");
+			valid = false;
+		}
+
+		if (seenSegmentSize)
+		{
+			logWarning("Option can only be used if -d is not set: --segment-size SIZE\n");
+			valid = false;
+		}
+
+		if (seenSegmentTime)
+		{
+			logWarning("Option can only be used if -d is not set: --segment-time SECONDS\n");
+			valid = false;
+		}
+	}
+
+	if (!seenInputFile)
+	{
+		logWarning("Missing required option: -i INPUT\n");
+		valid = false;
+	}
+	else if (m_decompressFlag)
+	{
+		m_llrFile = llrFileFromMkv("INPUT", m_inputFile);
+		if (m_llrFile.empty())
+			valid = false;
+	}
+	else if (m_recompressFlag)
+	{
+		m_sourceLlrFile = llrFileFromMkv("INPUT", m_inputFile);
+		if (m_sourceLlrFile.empty())
+			valid = false;
+	}
+
+	if (!seenOutputFile)
+	{
 		logWarning("Missing required option: OUTPUT\n");
 		valid = false;
 	}
@@ -322,6 +1229,18 @@ process_positional_argument:
 		m_llrFile = llrFileFromMkv("OUTPUT", m_outputFile);
 		if (m_llrFile.empty())
 			valid = false;
+		else
+		{
+			m_checkpointFile = m_llrFile.substr(0, m_llrFile.length() - 4) + ".ckpt";
+			m_proxyFile = m_llrFile.substr(0, m_llrFile.length() - 4) + ".proxy.mkv";
+			m_segmentFilePrefix = m_llrFile.substr(0, m_llrFile.length() - 4) + "-";
+		}
+	}
+
+	if (m_recompressFlag && seenInputFile && seenOutputFile && m_inputFile == m_outputFile)
+	{
+		logWarning("Argument error: INPUT and OUTPUT must be different files\n");
+		valid = false;
 	}
 
 	if (!valid)
@@ -332,34 +1251,113 @@ void CommandLine::help()
 {
 	fprintf(stderr, "Losslessly compress raw streams in multimedia files.\n");
 	fprintf(stderr, "\n");
-	fprintf(stderr, "Usage: %s [-d] [OTHER OPTIONS] -i INPUT OUTPUT\n", program_invocation_short_name);
+	fprintf(stderr, "Usage: %s [-d|-r] [OTHER OPTIONS] -i INPUT OUTPUT\n", program_invocation_short_name);
 	fprintf(stderr, "\n");
 
 	fprintf(stderr, "Basic options:\n");
 	fprintf(stderr, " -d        Decompress instead of compressing\n");
-	fprintf(stderr, " -i INPUT  Input file\n");
+	fprintf(stderr, " -r        Recompress an already compressed file with a different video codec\n");
+	fprintf(stderr, " -i INPUT  Input file (if compressing, it can also be a directory containing\n");
+	fprintf(stderr, "           an image sequence)\n");
 	fprintf(stderr, " OUTPUT    Output file\n");
 	fprintf(stderr, " --debug   Enable debug output from rawcompr\n");
 	fprintf(stderr, " --libavloglevel LEVEL\n");
 	fprintf(stderr, "           Set libav log level\n");
 	fprintf(stderr, "\n");
 
-	fprintf(stderr, "Compression-only parameters:\n");
+	fprintf(stderr, "I/O parameters:\n");
+	fprintf(stderr, " --read-ahead SIZE\n");
+	fprintf(stderr, "           Amount of data to read in advance from input files (default: %zuM)\n", defaultReadAheadSize >> 20);
+	fprintf(stderr, " --io-backend NAME\n");
+	fprintf(stderr, "           Select how files are read and written (default: io_uring if available,\n");
+	fprintf(stderr, "           falling back to blocking if the kernel does not allow it)\n");
+	fprintf(stderr, " --direct-io\n");
+	fprintf(stderr, "           Bypass the page cache when reading and writing files (O_DIRECT),\n");
+	fprintf(stderr, "           or drop the pages after use if the filesystem does not support it\n");
+	fprintf(stderr, " --store DIR\n");
+	fprintf(stderr, "           Keep embedded chunks and reusable encoded frames in a directory shared\n");
+	fprintf(stderr, "           with other compressed files (it must be given again to decompress)\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "Compression and recompression parameters:\n");
 	fprintf(stderr, " -v CODEC_NAME [key=value ...]\n");
 	fprintf(stderr, "           Select video codec and options\n");
+	fprintf(stderr, " -v auto [min-fps=FPS | max-loss=PERCENT]\n");
+	fprintf(stderr, "           Select the video codec by trial encoding sample frames: the smallest\n");
+	fprintf(stderr, "           one that encodes and decodes at least FPS frames per second, or the\n");
+	fprintf(stderr, "           fastest one within PERCENT of the smallest size (default: max-loss=%g)\n",
+		defaultAutoCodecPolicy.threshold);
+	fprintf(stderr, " -a CODEC_NAME\n");
+	fprintf(stderr, "           Select codec for PCM audio: flac or copy (default: %s)\n", defaultAudioCodec.c_str());
+	fprintf(stderr, " --max-memory SIZE\n");
+	fprintf(stderr, "           Limit the memory used by packets in flight and packet references,\n");
+	fprintf(stderr, "           slowing down reading when it is reached (K, M, G suffixes accepted)\n");
+	fprintf(stderr, " --dedup   Encode video frames that are identical to a recent frame only once\n");
+	fprintf(stderr, " --no-plane-reduction\n");
+	fprintf(stderr, "           Always encode every bit of video frames, even low bits that are zero\n");
+	fprintf(stderr, "           in all the sampled frames and constant alpha planes\n");
+	fprintf(stderr, " --proxy WIDTH\n");
+	fprintf(stderr, "           Also write a copy of the video streams scaled down to WIDTH pixels,\n");
+	fprintf(stderr, "           as MJPEG, for browsing (it is not needed to decompress)\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "Compression-only parameters:\n");
 	fprintf(stderr, " --hash ALGORITHM\n");
 	fprintf(stderr, "           Embed the input file's hash using the selected algorithm (default: %s)\n", defaultHashName.c_str());
+	fprintf(stderr, " --checkpoint SECONDS\n");
+	fprintf(stderr, "           Periodically save the progress, so that compression can be resumed\n");
+	fprintf(stderr, " --resume  Resume an interrupted compression from its last checkpoint\n");
+	fprintf(stderr, " --target-fps FPS\n");
+	fprintf(stderr, "           Switch video streams to faster codec options while encoding is slower\n");
+	fprintf(stderr, "           than FPS frames per second, and back when it catches up (the .mkv\n");
+	fprintf(stderr, "           file then holds partial streams and does not play normally)\n");
+	fprintf(stderr, " --raw-fallback PERCENT\n");
+	fprintf(stderr, "           Leave video frames raw if encoding them takes more than PERCENT of\n");
+	fprintf(stderr, "           their raw size (only with codecs that encode frames independently)\n");
+	fprintf(stderr, " --mmap    Map the input file in memory and encode packets in place, instead\n");
+	fprintf(stderr, "           of copying them into separate buffers\n");
+	fprintf(stderr, " --range START:END\n");
+	fprintf(stderr, "           Only compress packets located between the given input byte offsets\n");
+	fprintf(stderr, "           and store them in a partial compressed file (END can be omitted)\n");
+	fprintf(stderr, " --merge PART\n");
+	fprintf(stderr, "           Merge partial compressed files instead of compressing (repeatable)\n");
+	fprintf(stderr, " --segment-size SIZE\n");
+	fprintf(stderr, "           Start a new numbered output segment when the current one reaches\n");
+	fprintf(stderr, "           about SIZE bytes (K, M, G suffixes accepted)\n");
+	fprintf(stderr, " --segment-time SECONDS\n");
+	fprintf(stderr, "           Start a new numbered output segment every SECONDS of input\n");
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "Decompression-only parameters:\n");
+	fprintf(stderr, " --file NAME\n");
+	fprintf(stderr, "           Only restore the given file of an image sequence\n");
 	fprintf(stderr, "\n");
 
 	fprintf(stderr, "Note:\n");
 	fprintf(stderr, " - If compressing, OUTPUT file must have .mkv extension\n");
 	fprintf(stderr, " - If decompressing, INPUT file must have .mkv extension\n");
+	fprintf(stderr, " - If recompressing, both INPUT and OUTPUT files must have .mkv extension\n");
+	fprintf(stderr, " - Image sequences are restored into the OUTPUT directory\n");
+	fprintf(stderr, " - Checkpoints are stored next to OUTPUT, with .ckpt extension\n");
+	fprintf(stderr, " - Proxies are stored next to OUTPUT, with .proxy.mkv extension\n");
+	fprintf(stderr, " - Segments are stored next to OUTPUT, with -NNN.mkv suffix, and the .llr file\n");
+	fprintf(stderr, "   of OUTPUT lists them (decompressing OUTPUT restores all of them)\n");
 	fprintf(stderr, "\n");
 
 	fprintf(stderr, "Default video codec: -v %s", defaultVideoCodec.c_str());
 	for (const auto &[k, v] : defaultVideoCodecOptions)
 		fprintf(stderr, " %s=%s", k.c_str(), v.c_str());
 	fprintf(stderr, "\n");
+	fprintf(stderr, "Unless set with -v, threads, slices (FFV1) and g are tuned automatically\n");
+	fprintf(stderr, "(threads and slices depend on the available CPUs, and so does the output)\n");
+
+	fprintf(stderr, "Available I/O backends:");
+	for (const auto &[name, backend] : ioBackends)
+	{
+		if (IoQueue::isBackendAvailable(backend))
+			fprintf(stderr, " %s", name.c_str());
+	}
+	fprintf(stderr, "\n");
 
 	fprintf(stderr, "Available hash algorithms:");
 	for (const std::string &e : enumerateHashAlgorithms())
@@ -377,9 +1375,36 @@ int CommandLine::libavLogLevel() const
 	return m_libavLogLevel;
 }
 
+size_t CommandLine::readAheadSize() const
+{
+	return m_readAheadSize;
+}
+
+IoQueue::Backend CommandLine::ioBackend() const
+{
+	return m_ioBackend;
+}
+
+const char *CommandLine::storeDirectory() const
+{
+	return m_storeDirectory.empty() ? nullptr : m_storeDirectory.c_str();
+}
+
+bool CommandLine::directIo() const
+{
+	return m_directIoFlag;
+}
+
 CommandLine::Operation CommandLine::operation() const
 {
-	return m_decompressFlag ? Decompress : Compress;
+	if (m_decompressFlag)
+		return Decompress;
+	else if (m_recompressFlag)
+		return Recompress;
+	else if (!m_mergeFiles.empty())
+		return Merge;
+	else
+		return Compress;
 }
 
 const char *CommandLine::inputFile() const
@@ -397,12 +1422,24 @@ const char *CommandLine::llrFile() const
 	return m_llrFile.c_str();
 }
 
+const char *CommandLine::sourceLlrFile() const
+{
+	assert(m_recompressFlag == true);
+	return m_sourceLlrFile.c_str();
+}
+
 AVCodecID CommandLine::videoCodec() const
 {
 	assert(m_decompressFlag == false);
 	return m_videoCodec;
 }
 
+AVCodecID CommandLine::audioCodec() const
+{
+	assert(m_decompressFlag == false);
+	return m_audioCodec;
+}
+
 void CommandLine::fillVideoCodecOptions(AVDictionary **outDict) const
 {
 	assert(m_decompressFlag == false);
@@ -411,9 +1448,136 @@ void CommandLine::fillVideoCodecOptions(AVDictionary **outDict) const
 		av_dict_set(outDict, k.c_str(), v.c_str(), 0);
 }
 
+std::optional<AutoCodecPolicy> CommandLine::autoVideoCodecPolicy() const
+{
+	assert(m_decompressFlag == false);
+	return m_autoVideoCodecPolicy;
+}
+
 std::string CommandLine::hashName() const
 {
 	assert(m_decompressFlag == false);
 
 	return m_hashName;
 }
+
+size_t CommandLine::maxMemory() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_maxMemory;
+}
+
+bool CommandLine::deduplicateFrames() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_dedupFlag;
+}
+
+bool CommandLine::planeReduction() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_planeReductionFlag;
+}
+
+int CommandLine::proxyWidth() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_proxyWidth;
+}
+
+const char *CommandLine::proxyFile() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_proxyFile.c_str();
+}
+
+double CommandLine::targetFps() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_targetFps;
+}
+
+double CommandLine::rawFallbackRatio() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_rawFallbackRatio;
+}
+
+int CommandLine::checkpointInterval() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_checkpointInterval;
+}
+
+bool CommandLine::mapInput() const
+{
+	return m_mapInputFlag;
+}
+
+const char *CommandLine::restoreFile() const
+{
+	return m_restoreFile.empty() ? nullptr : m_restoreFile.c_str();
+}
+
+bool CommandLine::resume() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_resumeFlag;
+}
+
+const char *CommandLine::checkpointFile() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_checkpointFile.c_str();
+}
+
+std::optional<std::pair<int64_t, int64_t>> CommandLine::inputRange() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_inputRange;
+}
+
+size_t CommandLine::segmentSize() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_segmentSize;
+}
+
+int CommandLine::segmentTime() const
+{
+	assert(m_decompressFlag == false);
+
+	return m_segmentTime;
+}
+
+std::string CommandLine::segmentFile(size_t index) const
+{
+	assert(m_decompressFlag == false);
+
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "%03zu", index);
+	return m_segmentFilePrefix + suffix + ".mkv";
+}
+
+std::string CommandLine::segmentLlrFile(size_t index) const
+{
+	std::string filename = segmentFile(index);
+	return filename.substr(0, filename.length() - 4) + ".llr";
+}
+
+std::vector<std::string> CommandLine::mergeFiles() const
+{
+	return m_mergeFiles;
+}
@@ -18,11 +18,14 @@
 #ifndef COMMANDLINE_H
 #define COMMANDLINE_H
 
+#include "autocodec.h"
+#include "ioqueue.h"
 #include "libav.h"
 
 #include <map>
 #include <optional>
 #include <string>
+#include <vector>
 
 class CommandLine
 {
@@ -30,36 +33,102 @@ class CommandLine
 		enum Operation
 		{
 			Compress,
-			Decompress
+			Decompress,
+			Recompress,
+			Merge
 		};
 
 		CommandLine(int argc, char *argv[]);
 
 		bool enableLogDebug() const;
 		int libavLogLevel() const;
+		size_t readAheadSize() const;
+		IoQueue::Backend ioBackend() const;
+		bool directIo() const;
+		const char *storeDirectory() const; // nullptr if no archive store
 
 		Operation operation() const;
 
 		const char *inputFile() const;
 		const char *outputFile() const;
 		const char *llrFile() const;
+		const char *sourceLlrFile() const; // only if recompressing
 
-		AVCodecID videoCodec() const;
+		AVCodecID videoCodec() const; // AV_CODEC_ID_NONE if -v auto
 		void fillVideoCodecOptions(AVDictionary **outDict) const;
+		std::optional<AutoCodecPolicy> autoVideoCodecPolicy() const; // only if -v auto
+		AVCodecID audioCodec() const; // AV_CODEC_ID_NONE if PCM audio is copied
 		std::string hashName() const;
+		size_t maxMemory() const; // bytes, 0 if unlimited
+		bool deduplicateFrames() const;
+		bool planeReduction() const; // whether unused bits and constant alpha planes are dropped
+		int proxyWidth() const; // 0 if no proxy file is written
+		const char *proxyFile() const;
+		double targetFps() const; // 0 if video encoding does not adapt to throughput
+		double rawFallbackRatio() const; // encoded/raw size ratio above which frames are left raw, 0 if disabled
+		bool mapInput() const;
+
+		// Name of the only file to be restored from an image sequence, or
+		// nullptr if all of them have to be restored (only if decompressing)
+		const char *restoreFile() const;
+
+		int checkpointInterval() const; // seconds, 0 if disabled
+		bool resume() const;
+		const char *checkpointFile() const;
+
+		// Byte range of the input file whose packets are compressed, if
+		// only a part of the input file has to be processed
+		std::optional<std::pair<int64_t, int64_t>> inputRange() const;
+
+		// If any limit is set, the output is split into segments, which
+		// are rotated after the given amount of output bytes or seconds of
+		// input (0 if not limited)
+		size_t segmentSize() const;
+		int segmentTime() const;
+		std::string segmentFile(size_t index) const; // .mkv file
+		std::string segmentLlrFile(size_t index) const;
+
+		// Partial compressed files to be merged (only if merging)
+		std::vector<std::string> mergeFiles() const;
 
 	private:
 		void help();
 
 		bool m_debugFlag;
 		int m_libavLogLevel;
+		size_t m_readAheadSize;
+		IoQueue::Backend m_ioBackend;
+		bool m_directIoFlag;
+		std::string m_storeDirectory;
 
-		bool m_decompressFlag;
-		std::string m_inputFile, m_outputFile, m_llrFile;
+		bool m_decompressFlag, m_recompressFlag;
+		std::string m_inputFile, m_outputFile, m_llrFile, m_sourceLlrFile;
 
 		AVCodecID m_videoCodec;
 		std::map<std::string, std::string> m_videoCodecOptions;
+		std::optional<AutoCodecPolicy> m_autoVideoCodecPolicy;
+		AVCodecID m_audioCodec;
 		std::string m_hashName;
+		size_t m_maxMemory;
+		bool m_dedupFlag;
+		bool m_planeReductionFlag;
+		int m_proxyWidth;
+		std::string m_proxyFile;
+		double m_targetFps;
+		double m_rawFallbackRatio;
+		bool m_mapInputFlag;
+		std::string m_restoreFile;
+
+		int m_checkpointInterval;
+		bool m_resumeFlag;
+		std::string m_checkpointFile;
+
+		size_t m_segmentSize;
+		int m_segmentTime;
+		std::string m_segmentFilePrefix;
+
+		std::optional<std::pair<int64_t, int64_t>> m_inputRange;
+		std::vector<std::string> m_mergeFiles;
 };
 
 #endif
@@ -0,0 +1,86 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cpus.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Returns the CPU quota of the current cgroup rounded up to whole CPUs, or 0
+// if there is no quota. In containers, the cgroup of the process is mounted at
+// /sys/fs/cgroup.
+static int cgroupCpuQuota()
+{
+	long long quota = -1, period = 0;
+
+	// cgroup v2: "max 100000" or "<quota> <period>"
+	if (FILE *file = fopen("/sys/fs/cgroup/cpu.max", "r"))
+	{
+		if (fscanf(file, "%lld %lld", &quota, &period) != 2)
+			quota = -1;
+		fclose(file);
+	}
+	else
+	{
+		// cgroup v1: quota is -1 if unlimited
+		if (FILE *file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r"))
+		{
+			if (fscanf(file, "%lld", &quota) != 1)
+				quota = -1;
+			fclose(file);
+		}
+
+		if (FILE *file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r"))
+		{
+			if (fscanf(file, "%lld", &period) != 1)
+				period = 0;
+			fclose(file);
+		}
+	}
+
+	if (quota <= 0 || period <= 0)
+		return 0;
+
+	return (quota + period - 1) / period;
+}
+
+int availableCpuCount()
+{
+	static int result = 0;
+
+	if (result == 0)
+	{
+		cpu_set_t set;
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+			result = CPU_COUNT(&set);
+		else
+			result = sysconf(_SC_NPROCESSORS_ONLN);
+
+		int quota = cgroupCpuQuota();
+		if (quota != 0)
+			result = std::min(result, quota);
+
+		result = std::max(result, 1);
+		logDebug("Available CPUs: %d\n", result);
+	}
+
+	return result;
+}
@@ -17,8 +17,11 @@
 
 #include "decoders.h"
 
+#include "cpus.h"
 #include "log.h"
 
+#include <string.h>
+
 Decoder::Decoder()
 {
 }
@@ -27,16 +30,13 @@ Decoder::~Decoder()
 {
 }
 
-VideoDecoder::VideoDecoder(const AVStream *inputStream, AVPixelFormat outputPixelFormat)
-: m_inputFrame(av_frame_alloc()), m_outputFrame(av_frame_alloc()),
-  m_outputPacket(av_packet_alloc())
+VideoDecoder::VideoDecoder(const AVStream *inputStream, AVPixelFormat outputPixelFormat, const PlaneReduction &reduction, int threadCount)
+: m_inputFrame(av_frame_alloc()), m_outputFrame(av_frame_alloc()), m_outputPixelFormat(outputPixelFormat),
+  m_reduction(reduction), m_reducedPixelFormat(AV_PIX_FMT_NONE), m_wideFrame(av_frame_alloc())
 {
-	if (m_inputFrame == nullptr || m_outputFrame == nullptr)
+	if (m_inputFrame == nullptr || m_outputFrame == nullptr || m_wideFrame == nullptr)
 		logError("av_frame_alloc failed\n");
 
-	if (m_outputPacket == nullptr)
-		logError("av_packet_alloc failed\n");
-
 	// Setup decoder
 
 	AVCodec *inputCodec = avcodec_find_decoder(inputStream->codecpar->codec_id);
@@ -46,39 +46,63 @@ VideoDecoder::VideoDecoder(const AVStream *inputStream, AVPixelFormat outputPixe
 		logError("avcodec_alloc_context3 failed\n");
 
 	failOnAVERROR(avcodec_parameters_to_context(m_inputCodecContext, inputStream->codecpar), "avcodec_parameters_to_context");
-	failOnAVERROR(avcodec_open2(m_inputCodecContext, inputCodec, nullptr), "avcodec_open2");
-
-	// Setup encoder
 
-	AVCodec *outputCodec = avcodec_find_encoder(AV_CODEC_ID_RAWVIDEO);
+	// Only slice threads: frame threads would delay the decoded frames, which
+	// are expected right after each packet is sent
+	m_inputCodecContext->thread_type = FF_THREAD_SLICE;
+	m_inputCodecContext->thread_count = (threadCount != 0) ? threadCount : availableCpuCount();
 
-	m_outputCodecContext = avcodec_alloc_context3(outputCodec);
-	if (m_outputCodecContext == nullptr)
-		logError("avcodec_alloc_context3 failed\n");
-
-	failOnAVERROR(avcodec_parameters_to_context(m_outputCodecContext, inputStream->codecpar), "avcodec_parameters_to_context");
-	m_outputCodecContext->codec_id = AV_CODEC_ID_RAWVIDEO;
-        m_outputCodecContext->codec_tag = 0;
-	m_outputCodecContext->time_base = inputStream->time_base;
-	m_outputCodecContext->pix_fmt = outputPixelFormat;
+	failOnAVERROR(avcodec_open2(m_inputCodecContext, inputCodec, nullptr), "avcodec_open2");
 
-	failOnAVERROR(avcodec_open2(m_outputCodecContext, outputCodec, nullptr), "avcodec_open2");
+	int width = m_inputCodecContext->width, height = m_inputCodecContext->height;
+
+	// Setup raw frame layout (same as the rawvideo encoder, i.e. no padding)
+
+	m_rawSize = av_image_get_buffer_size(outputPixelFormat, width, height, 1);
+	failOnAVERROR(m_rawSize, "av_image_get_buffer_size");
+	failOnAVERROR(av_image_fill_linesizes(m_rawLinesizes, outputPixelFormat, width), "av_image_fill_linesizes");
+
+	m_rawBufferPool.reset(new BufferPool(m_rawSize));
+
+	// swscale can write directly into the raw buffer if its rows are
+	// suitably aligned, otherwise it needs an intermediate frame
+	m_scaleToRawBuffer = (av_pix_fmt_desc_get(outputPixelFormat)->flags & AV_PIX_FMT_FLAG_PAL) == 0;
+	for (int i = 0; i < 4; i++)
+	{
+		if (m_rawLinesizes[i] % 16 != 0)
+			m_scaleToRawBuffer = false;
+	}
+
+	if (!m_scaleToRawBuffer)
+	{
+		m_outputFrame->width = width;
+		m_outputFrame->height = height;
+		m_outputFrame->format = outputPixelFormat;
+		failOnAVERROR(av_frame_get_buffer(m_outputFrame, 0), "av_frame_get_buffer");
+	}
+
+	// Reduced frames are restored to the wide format first
+
+	AVPixelFormat scaledPixelFormat = m_inputCodecContext->pix_fmt;
+	if (!m_reduction.isNone())
+	{
+		m_reducedPixelFormat = reducedPixelFormat(outputPixelFormat, m_reduction);
+		scaledPixelFormat = widePixelFormat(outputPixelFormat);
+		if (m_reducedPixelFormat == AV_PIX_FMT_NONE || scaledPixelFormat == AV_PIX_FMT_NONE)
+			logError("Unsupported plane reduction of %s\n", av_get_pix_fmt_name(outputPixelFormat));
+
+		m_wideFrame->width = width;
+		m_wideFrame->height = height;
+		m_wideFrame->format = scaledPixelFormat;
+		failOnAVERROR(av_frame_get_buffer(m_wideFrame, 0), "av_frame_get_buffer");
+	}
 
 	// Setup pixel format converter
 
 	m_swscaleContext = sws_getContext(
-		m_inputCodecContext->width, m_inputCodecContext->height, m_inputCodecContext->pix_fmt,
-		m_outputCodecContext->width, m_outputCodecContext->height, m_outputCodecContext->pix_fmt,
+		width, height, scaledPixelFormat,
+		width, height, outputPixelFormat,
 		0, nullptr, nullptr, nullptr);
-
-	// Setup temporary frame
-
-	m_outputFrame->width = m_outputCodecContext->width;
-	m_outputFrame->height = m_outputCodecContext->height;
-	m_outputFrame->sample_aspect_ratio = m_outputCodecContext->sample_aspect_ratio;
-	m_outputFrame->format = m_outputCodecContext->pix_fmt;
-	m_outputFrame->pict_type = AV_PICTURE_TYPE_NONE;
-	failOnAVERROR(av_frame_get_buffer(m_outputFrame, 0), "av_frame_get_buffer");
 }
 
 VideoDecoder::~VideoDecoder()
@@ -86,12 +110,13 @@ VideoDecoder::~VideoDecoder()
 	sws_freeContext(m_swscaleContext);
 
 	av_frame_free(&m_inputFrame);
+	av_frame_free(&m_outputFrame);
+	av_frame_free(&m_wideFrame);
 
 	avcodec_free_context(&m_inputCodecContext);
-	avcodec_free_context(&m_outputCodecContext);
 }
 
-std::vector<uint8_t> VideoDecoder::decodePacket(const AVPacket *inputPacket)
+void VideoDecoder::decodePacket(const AVPacket *inputPacket, AVPacket *outputPacket)
 {
 	failOnAVERROR(avcodec_send_packet(m_inputCodecContext, inputPacket), "avcodec_send_packet");
 	failOnAVERROR(avcodec_receive_frame(m_inputCodecContext, m_inputFrame), "avcodec_receive_frame");
@@ -101,29 +126,116 @@ std::vector<uint8_t> VideoDecoder::decodePacket(const AVPacket *inputPacket)
 
 	logDebug(" -> Converting from %s to %s\n",
 		av_get_pix_fmt_name((AVPixelFormat)m_inputFrame->format),
-		av_get_pix_fmt_name((AVPixelFormat)m_outputFrame->format));
+		av_get_pix_fmt_name(m_outputPixelFormat));
+
+	const AVFrame *scaledFrame = m_inputFrame;
+	if (!m_reduction.isNone())
+	{
+		if (m_inputFrame->format != m_reducedPixelFormat)
+			logError("Unexpected pixel format: %s\n", av_get_pix_fmt_name((AVPixelFormat)m_inputFrame->format));
+
+		expandPlanes(m_inputFrame, m_wideFrame, m_reduction);
+		scaledFrame = m_wideFrame;
+	}
+
+	AVBufferRef *rawBuffer = m_rawBufferPool->get();
+
+	if (m_scaleToRawBuffer)
+	{
+		uint8_t *rawData[4];
+		failOnAVERROR(av_image_fill_pointers(rawData, m_outputPixelFormat, m_inputFrame->height, rawBuffer->data, m_rawLinesizes), "av_image_fill_pointers");
+
+		sws_scale(m_swscaleContext,
+			scaledFrame->data, scaledFrame->linesize,
+			0, m_inputFrame->height,
+			rawData, m_rawLinesizes);
+	}
+	else
+	{
+		sws_scale(m_swscaleContext,
+			scaledFrame->data, scaledFrame->linesize,
+			0, m_inputFrame->height,
+			m_outputFrame->data, m_outputFrame->linesize);
+
+		failOnAVERROR(av_image_copy_to_buffer(rawBuffer->data, m_rawSize,
+			m_outputFrame->data, m_outputFrame->linesize, m_outputPixelFormat,
+			m_outputFrame->width, m_outputFrame->height, 1), "av_image_copy_to_buffer");
+	}
+
+	outputPacket->buf = rawBuffer;
+	outputPacket->data = rawBuffer->data;
+	outputPacket->size = m_rawSize;
 
-	sws_scale(m_swscaleContext,
-		m_inputFrame->data, m_inputFrame->linesize,
-		0, m_inputFrame->height,
-		m_outputFrame->data, m_outputFrame->linesize);
+	av_frame_unref(m_inputFrame);
+}
 
-	failOnAVERROR(avcodec_send_frame(m_outputCodecContext, m_outputFrame), "avcodec_send_frame");
-	failOnAVERROR(avcodec_receive_packet(m_outputCodecContext, m_outputPacket), "avcodec_receive_packet");
+AudioDecoder::AudioDecoder(const AVStream *inputStream, AVCodecID outputCodecId)
+: m_pcmFormat(findPcmFormat(outputCodecId)), m_inputFrame(av_frame_alloc())
+{
+	if (m_pcmFormat == nullptr)
+		logError("Unsupported PCM format: %s\n", avcodec_get_name(outputCodecId));
+	if (m_inputFrame == nullptr)
+		logError("av_frame_alloc failed\n");
 
-	std::vector<uint8_t> result(m_outputPacket->data, m_outputPacket->data + m_outputPacket->size);
+	AVCodec *inputCodec = avcodec_find_decoder(inputStream->codecpar->codec_id);
 
-	av_frame_unref(m_inputFrame);
-	av_packet_unref(m_outputPacket);
+	m_inputCodecContext = avcodec_alloc_context3(inputCodec);
+	if (m_inputCodecContext == nullptr)
+		logError("avcodec_alloc_context3 failed\n");
+
+	failOnAVERROR(avcodec_parameters_to_context(m_inputCodecContext, inputStream->codecpar), "avcodec_parameters_to_context");
+	failOnAVERROR(avcodec_open2(m_inputCodecContext, inputCodec, nullptr), "avcodec_open2");
+}
 
-	return result;
+AudioDecoder::~AudioDecoder()
+{
+	av_frame_free(&m_inputFrame);
+
+	avcodec_free_context(&m_inputCodecContext);
+}
+
+void AudioDecoder::decodePacket(const AVPacket *inputPacket, AVPacket *outputPacket)
+{
+	m_rawData.clear();
+
+	// Empty packets have no FLAC frames (and they would flush the decoder)
+	if (inputPacket->size != 0)
+	{
+		failOnAVERROR(avcodec_send_packet(m_inputCodecContext, inputPacket), "avcodec_send_packet");
+
+		// Large packets contain more than one FLAC frame
+		while (true)
+		{
+			int errnum = avcodec_receive_frame(m_inputCodecContext, m_inputFrame);
+			if (errnum == AVERROR(EAGAIN))
+				break;
+			else
+				failOnAVERROR(errnum, "avcodec_receive_frame");
+
+			if (m_inputFrame->format != m_pcmFormat->flacSampleFormat())
+				logError("Unexpected sample format: %s\n", av_get_sample_fmt_name((AVSampleFormat)m_inputFrame->format));
+
+			int count = m_inputFrame->nb_samples * m_inputFrame->channels;
+			size_t offset = m_rawData.size();
+			m_rawData.resize(offset + count * m_pcmFormat->bytesPerSample);
+			packPcmSamples(m_pcmFormat, m_inputFrame->data[0], count, m_rawData.data() + offset);
+
+			av_frame_unref(m_inputFrame);
+		}
+	}
+
+	logDebug(" -> Decoded %d bytes of FLAC to %zu bytes of %s\n", inputPacket->size,
+		m_rawData.size(), avcodec_get_name(m_pcmFormat->codecId));
+
+	failOnAVERROR(av_new_packet(outputPacket, m_rawData.size()), "av_new_packet");
+	memcpy(outputPacket->data, m_rawData.data(), m_rawData.size());
 }
 
 CopyDecoder::CopyDecoder()
 {
 }
 
-std::vector<uint8_t> CopyDecoder::decodePacket(const AVPacket *inputPacket)
+void CopyDecoder::decodePacket(const AVPacket *inputPacket, AVPacket *outputPacket)
 {
-	return std::vector<uint8_t>(inputPacket->data, inputPacket->data + inputPacket->size);
+	failOnAVERROR(av_packet_ref(outputPacket, inputPacket), "av_packet_ref");
 }
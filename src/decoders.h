@@ -18,7 +18,11 @@
 #ifndef DECODERS_H
 #define DECODERS_H
 
+#include "bufferpool.h"
 #include "llrfile.h"
+#include "pcm.h"
+
+#include <memory>
 
 class Decoder
 {
@@ -26,31 +30,62 @@ class Decoder
 		Decoder();
 		virtual ~Decoder();
 
-		virtual std::vector<uint8_t> decodePacket(const AVPacket *inputPacket) = 0;
+		// Stores the original data of inputPacket in outputPacket, which
+		// must be blank. The data is held in a pooled buffer or, if it was
+		// stored unmodified, in a new reference to the input packet's buffer.
+		virtual void decodePacket(const AVPacket *inputPacket, AVPacket *outputPacket) = 0;
 };
 
 class VideoDecoder : public Decoder
 {
 	public:
-		VideoDecoder(const AVStream *inputStream, AVPixelFormat outputPixelFormat);
+		// threadCount is the number of slice threads, 0 to use all the available CPUs.
+		// If the stream was encoded with a plane reduction, it must be given.
+		VideoDecoder(const AVStream *inputStream, AVPixelFormat outputPixelFormat, const PlaneReduction &reduction = PlaneReduction(),
+			int threadCount = 0);
 		virtual ~VideoDecoder();
 
-		std::vector<uint8_t> decodePacket(const AVPacket *inputPacket) override;
+		void decodePacket(const AVPacket *inputPacket, AVPacket *outputPacket) override;
 
 	private:
-		AVCodecContext *m_inputCodecContext, *m_outputCodecContext;
+		AVCodecContext *m_inputCodecContext;
 		AVFrame *m_inputFrame, *m_outputFrame;
-		AVPacket *m_outputPacket;
+		AVPixelFormat m_outputPixelFormat;
+
+		PlaneReduction m_reduction;
+		AVPixelFormat m_reducedPixelFormat; // expected from the decoder if m_reduction is not none
+		AVFrame *m_wideFrame; // only used if m_reduction is not none
+
+		// Size and layout of the raw frames, as rawvideo stores them
+		int m_rawSize;
+		int m_rawLinesizes[4];
+		std::unique_ptr<BufferPool> m_rawBufferPool;
+		bool m_scaleToRawBuffer; // if false, m_outputFrame is used as an intermediate step
 
 		SwsContext *m_swscaleContext;
 };
 
+class AudioDecoder : public Decoder
+{
+	public:
+		AudioDecoder(const AVStream *inputStream, AVCodecID outputCodecId);
+		~AudioDecoder() override;
+
+		void decodePacket(const AVPacket *inputPacket, AVPacket *outputPacket) override;
+
+	private:
+		const PcmFormat *m_pcmFormat;
+		AVCodecContext *m_inputCodecContext;
+		AVFrame *m_inputFrame;
+		std::vector<uint8_t> m_rawData;
+};
+
 class CopyDecoder : public Decoder
 {
 	public:
 		CopyDecoder();
 
-		std::vector<uint8_t> decodePacket(const AVPacket *inputPacket) override;
+		void decodePacket(const AVPacket *inputPacket, AVPacket *outputPacket) override;
 };
 
 #endif
@@ -0,0 +1,105 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dedup.h"
+
+#include "log.h"
+
+#include <string.h>
+
+// Number of distinct packets that each packet is compared to
+static constexpr size_t HISTORY_SIZE = 4;
+
+// Fast non-cryptographic hash. Its eight independent 32-bit lanes let the
+// compiler vectorize the main loop, so that hashing runs at memory speed.
+static uint64_t hashData(const uint8_t *data, size_t size)
+{
+	constexpr int LANES = 8;
+	constexpr uint32_t PRIME = 0x9e3779b1;
+
+	uint32_t lanes[LANES];
+	for (int j = 0; j < LANES; j++)
+		lanes[j] = j + 1;
+
+	size_t i = 0;
+	for (; i + sizeof(lanes) <= size; i += sizeof(lanes))
+	{
+		uint32_t block[LANES];
+		memcpy(block, data + i, sizeof(block));
+
+		for (int j = 0; j < LANES; j++)
+			lanes[j] = (lanes[j] ^ block[j]) * PRIME;
+	}
+
+	uint64_t result = size;
+	for (; i < size; i++)
+		result = (result ^ data[i]) * 0x100000001b3;
+	for (int j = 0; j < LANES; j++)
+		result = (result ^ lanes[j]) * 0x100000001b3;
+
+	return result;
+}
+
+DuplicateFrameDetector::DuplicateFrameDetector(MemoryBudget *memoryBudget)
+: m_memoryBudget(memoryBudget), m_lastHash(0)
+{
+}
+
+DuplicateFrameDetector::~DuplicateFrameDetector()
+{
+	for (Entry &e : m_history)
+	{
+		m_memoryBudget->release(e.packet->size);
+		av_packet_free(&e.packet);
+	}
+}
+
+std::optional<DuplicateFrameDetector::Original> DuplicateFrameDetector::find(const AVPacket *inputPacket)
+{
+	m_lastHash = hashData(inputPacket->data, inputPacket->size);
+
+	for (const Entry &e : m_history)
+	{
+		if (e.hash == m_lastHash && e.packet->size == inputPacket->size &&
+			memcmp(e.packet->data, inputPacket->data, inputPacket->size) == 0)
+		{
+			logDebug(" -> Duplicate of output packet %zu\n", e.original.packetIndex);
+			return e.original;
+		}
+	}
+
+	return std::nullopt;
+}
+
+void DuplicateFrameDetector::add(const AVPacket *inputPacket, const Original &original)
+{
+	if (m_history.size() == HISTORY_SIZE)
+	{
+		Entry &oldest = m_history.back();
+		m_memoryBudget->release(oldest.packet->size);
+		av_packet_free(&oldest.packet);
+		m_history.pop_back();
+	}
+
+	// The data is shared (not copied) if inputPacket is reference-counted
+	AVPacket *packet = av_packet_clone(inputPacket);
+	if (packet == nullptr)
+		logError("av_packet_clone failed\n");
+
+	m_memoryBudget->charge(packet->size);
+	m_history.push_front({ m_lastHash, packet, original });
+}
@@ -0,0 +1,62 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "memory.h"
+
+#include <deque>
+#include <optional>
+
+// Finds input packets that are byte-identical to one of the last packets of
+// the same stream (e.g. in screen recordings or frame-doubled captures), so
+// that they can reference the output packet of the earlier one instead of
+// being encoded again. Candidates are found by hash and then compared byte by
+// byte. The data of the remembered packets is charged to the memory budget.
+class DuplicateFrameDetector
+{
+	public:
+		// Output packet that an input packet has been (or will be) encoded to
+		struct Original
+		{
+			size_t packetIndex;
+			int64_t pts; // in the input stream's time base
+		};
+
+		DuplicateFrameDetector(MemoryBudget *memoryBudget);
+		~DuplicateFrameDetector();
+
+		// Returns the original of inputPacket, if it is a duplicate. If it is
+		// not, add must be called next with the same packet.
+		std::optional<Original> find(const AVPacket *inputPacket);
+		void add(const AVPacket *inputPacket, const Original &original);
+
+	private:
+		struct Entry
+		{
+			uint64_t hash;
+			AVPacket *packet;
+			Original original;
+		};
+
+		MemoryBudget *m_memoryBudget;
+		std::deque<Entry> m_history; // most recent first
+		uint64_t m_lastHash; // of the last packet passed to find
+};
+
+#endif
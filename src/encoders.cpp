@@ -19,6 +19,111 @@
 
 #include "log.h"
 
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+extern "C"
+{
+#include <libavutil/time.h>
+}
+
+FrameConverter::FrameConverter(const AVStream *inputStream, const AVFrame *outputFrameTemplate, FrameBufferPool *outputFramePool,
+	const PlaneReduction &reduction)
+: m_inputFrame(av_frame_alloc()), m_outputFrameTemplate(av_frame_alloc()), m_outputFramePool(outputFramePool),
+  m_reduction(reduction), m_wideFrame(av_frame_alloc())
+{
+	if (m_inputFrame == nullptr || m_outputFrameTemplate == nullptr || m_wideFrame == nullptr)
+		logError("av_frame_alloc failed\n");
+
+	failOnAVERROR(av_frame_copy_props(m_outputFrameTemplate, outputFrameTemplate), "av_frame_copy_props");
+	m_outputFrameTemplate->width = outputFrameTemplate->width;
+	m_outputFrameTemplate->height = outputFrameTemplate->height;
+	m_outputFrameTemplate->format = outputFrameTemplate->format;
+
+	AVCodec *inputCodec = avcodec_find_decoder(inputStream->codecpar->codec_id);
+
+	m_inputCodecContext = avcodec_alloc_context3(inputCodec);
+	if (m_inputCodecContext == nullptr)
+		logError("avcodec_alloc_context3 failed\n");
+
+	failOnAVERROR(avcodec_parameters_to_context(m_inputCodecContext, inputStream->codecpar), "avcodec_parameters_to_context");
+	failOnAVERROR(avcodec_open2(m_inputCodecContext, inputCodec, nullptr), "avcodec_open2");
+
+	// Reduced frames are made from frames in the wide format
+	AVPixelFormat scaledPixelFormat = (AVPixelFormat)m_outputFrameTemplate->format;
+	if (!m_reduction.isNone())
+	{
+		scaledPixelFormat = widePixelFormat(m_inputCodecContext->pix_fmt);
+
+		m_wideFrame->width = m_outputFrameTemplate->width;
+		m_wideFrame->height = m_outputFrameTemplate->height;
+		m_wideFrame->format = scaledPixelFormat;
+		failOnAVERROR(av_frame_get_buffer(m_wideFrame, 0), "av_frame_get_buffer");
+	}
+
+	m_swscaleContext = sws_getContext(
+		m_inputCodecContext->width, m_inputCodecContext->height, m_inputCodecContext->pix_fmt,
+		m_outputFrameTemplate->width, m_outputFrameTemplate->height, scaledPixelFormat,
+		0, nullptr, nullptr, nullptr);
+}
+
+FrameConverter::~FrameConverter()
+{
+	sws_freeContext(m_swscaleContext);
+
+	av_frame_free(&m_inputFrame);
+	av_frame_free(&m_outputFrameTemplate);
+	av_frame_free(&m_wideFrame);
+
+	avcodec_free_context(&m_inputCodecContext);
+}
+
+void FrameConverter::convert(const AVPacket *inputPacket, AVFrame *outputFrame)
+{
+	failOnAVERROR(avcodec_send_packet(m_inputCodecContext, inputPacket), "avcodec_send_packet");
+	failOnAVERROR(avcodec_receive_frame(m_inputCodecContext, m_inputFrame), "avcodec_receive_frame");
+
+	logDebug(" -> Decoded %dx%d %s pts %" PRIi64 "%s\n", m_inputFrame->width, m_inputFrame->height,
+		av_get_pix_fmt_name((AVPixelFormat)m_inputFrame->format), m_inputFrame->pts, m_inputFrame->key_frame ? " KEYFRAME" : "");
+
+	logDebug(" -> Converting from %s to %s\n",
+		av_get_pix_fmt_name((AVPixelFormat)m_inputFrame->format),
+		av_get_pix_fmt_name((AVPixelFormat)m_outputFrameTemplate->format));
+
+	failOnAVERROR(av_frame_copy_props(outputFrame, m_outputFrameTemplate), "av_frame_copy_props");
+	outputFrame->width = m_outputFrameTemplate->width;
+	outputFrame->height = m_outputFrameTemplate->height;
+	outputFrame->format = m_outputFrameTemplate->format;
+	m_outputFramePool->getBuffer(outputFrame);
+
+	if (m_reduction.isNone())
+	{
+		sws_scale(m_swscaleContext,
+			m_inputFrame->data, m_inputFrame->linesize,
+			0, m_inputFrame->height,
+			outputFrame->data, outputFrame->linesize);
+	}
+	else
+	{
+		sws_scale(m_swscaleContext,
+			m_inputFrame->data, m_inputFrame->linesize,
+			0, m_inputFrame->height,
+			m_wideFrame->data, m_wideFrame->linesize);
+
+		if (!reducePlanes(m_wideFrame, outputFrame, m_reduction))
+		{
+			logDebug(" -> Frame does not fit in %s\n", av_get_pix_fmt_name((AVPixelFormat)outputFrame->format));
+			outputFrame->flags |= AV_FRAME_FLAG_DISCARD;
+		}
+	}
+
+	outputFrame->pts = m_inputFrame->pts;
+	outputFrame->key_frame = false;
+
+	av_frame_unref(m_inputFrame);
+}
+
 Encoder::Encoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs)
 : m_inputStream(inputStream), m_outputFormatContext(outputFormatContext), m_outRefs(outRefs), m_outPacketIndex(0)
 {
@@ -27,11 +132,36 @@ Encoder::Encoder(const AVStream *inputStream, AVFormatContext *outputFormatConte
 		logError("avformat_new_stream failed\n");
 }
 
+Encoder::Encoder(const AVStream *inputStream, PacketReferences *outRefs)
+: m_inputStream(inputStream), m_outputFormatContext(nullptr), m_outputStream(nullptr), m_outRefs(outRefs), m_outPacketIndex(0)
+{
+}
+
 Encoder::~Encoder()
 {
 }
 
+FrameConverter *Encoder::createConverter() const
+{
+	return nullptr;
+}
+
+size_t Encoder::convertedFrameSize() const
+{
+	return 0;
+}
+
+std::vector<uint8_t> Encoder::packetReuseContext() const
+{
+	return std::vector<uint8_t>();
+}
+
 void Encoder::finalizeAndWritePacket(const AVPacket *inputPacket, AVPacket *outputPacket)
+{
+	writePacket(inputPacket, outputPacket, true);
+}
+
+void Encoder::writePacket(const AVPacket *inputPacket, AVPacket *outputPacket, bool addReference)
 {
 	outputPacket->pts = inputPacket->pts;
 	outputPacket->dts = inputPacket->dts;
@@ -43,23 +173,182 @@ void Encoder::finalizeAndWritePacket(const AVPacket *inputPacket, AVPacket *outp
 	logDebug(" -> Output packet: Stream #0:%d (index %zu size %u) - pts %" PRIi64 " dts %" PRIi64 " duration %" PRIi64 "\n",
 		outputPacket->stream_index, m_outPacketIndex, outputPacket->size, outputPacket->pts, outputPacket->dts, outputPacket->duration);
 
-	m_outRefs->addPacketReference(m_outputStream->index, m_outPacketIndex, outputPacket->pts, inputPacket->pos, inputPacket->size);
+	if (addReference)
+		m_outRefs->addPacketReference(m_outputStream->index, m_outPacketIndex, outputPacket->pts, inputPacket->pos, inputPacket->size);
 	failOnAVERROR(av_interleaved_write_frame(m_outputFormatContext, outputPacket), "av_write_frame");
 
 	m_outPacketIndex++;
 }
 
-VideoEncoder::VideoEncoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs, AVCodecID outputCodecID, AVDictionary **outputOptions)
+void Encoder::writeDuplicatePacket(const AVPacket *inputPacket, size_t packetIndex, int64_t pts)
+{
+	// Same rounding as av_packet_rescale_ts
+	pts = av_rescale_q_rnd(pts, m_inputStream->time_base, m_outputStream->time_base,
+		(AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+
+	logDebug(" -> Duplicate packet: Stream #0:%d (index %zu) - pts %" PRIi64 "\n",
+		m_outputStream->index, packetIndex, pts);
+
+	m_outRefs->addPacketReference(m_outputStream->index, packetIndex, pts, inputPacket->pos, inputPacket->size);
+}
+
+void Encoder::writeResumedPacket(AVPacket *packet, AVRational timeBase)
+{
+	av_packet_rescale_ts(packet, timeBase, m_outputStream->time_base);
+	packet->stream_index = m_outputStream->index;
+	packet->pos = -1;
+
+	logDebug(" -> Resumed packet: Stream #0:%d (index %zu size %u) - pts %" PRIi64 " dts %" PRIi64 " duration %" PRIi64 "\n",
+		packet->stream_index, m_outPacketIndex, packet->size, packet->pts, packet->dts, packet->duration);
+
+	failOnAVERROR(av_interleaved_write_frame(m_outputFormatContext, packet), "av_write_frame");
+
+	m_outPacketIndex++;
+}
+
+size_t Encoder::outputPacketCount() const
+{
+	return m_outPacketIndex;
+}
+
+const AVCodecParameters *Encoder::outputCodecParameters() const
+{
+	return m_outputStream->codecpar;
+}
+
+// Each automatically chosen FFV1 slice should cover at least this many pixels,
+// so that the contexts still adapt to the content of the slice
+static constexpr int FFV1_MIN_SLICE_PIXELS = 256 * 128;
+static constexpr int FFV1_MAX_SLICES = 256;
+
+// Target GOP length (in seconds) if it is not set explicitly
+static constexpr double DEFAULT_GOP_DURATION = 24;
+static constexpr int DEFAULT_GOP_SIZE = 600; // if the frame rate is unknown
+static constexpr int MIN_GOP_SIZE = 60, MAX_GOP_SIZE = 1200;
+
+// Returns whether FFV1 accepts the given number of slices, by mirroring the
+// slice layouts that its encoder tries
+static bool isValidFfv1SliceCount(const AVCodecContext *codecContext, int slices)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(codecContext->pix_fmt);
+	int width = codecContext->width, height = codecContext->height;
+	int maxHSlices = AV_CEIL_RSHIFT(width, desc->log2_chroma_w);
+	int maxVSlices = AV_CEIL_RSHIFT(height, desc->log2_chroma_h);
+
+	for (int v = (width > 352 || height > 288) ? 2 : 1; v < 32; v++)
+	{
+		for (int h = v; h < 2 * v; h++)
+		{
+			if (h > maxHSlices || v > maxVSlices)
+				continue;
+
+			// Each slice must fit in the encoder's buffer
+			int64_t maxSliceSize = (int64_t)((width + h - 1) / h) * ((height + v - 1) / v)
+				* (desc->comp[0].depth + 1) * desc->nb_components;
+			if (maxSliceSize > (8 << 24))
+				continue;
+
+			if (h * v == slices)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+// Picks the number of FFV1 slices: at least one per thread (but never less
+// than 4), as long as slices are not too small
+static int selectFfv1SliceCount(const AVCodecContext *codecContext, int threadCount)
+{
+	int target = std::max(threadCount, 4);
+	int limit = std::max(codecContext->width * codecContext->height / FFV1_MIN_SLICE_PIXELS, 4);
+
+	int largestBelowLimit = 0;
+	for (int slices = 1; slices <= FFV1_MAX_SLICES; slices++)
+	{
+		if (!isValidFfv1SliceCount(codecContext, slices))
+			continue;
+		if (slices > limit)
+			return largestBelowLimit != 0 ? largestBelowLimit : slices; // very large frames need more slices
+		largestBelowLimit = slices;
+		if (slices >= target)
+			return slices;
+	}
+
+	return largestBelowLimit;
+}
+
+// Whether the encoder carries state over from a frame to the next ones, so
+// that only the first packet of a GOP can be decoded on its own. Codec
+// descriptors do not tell: FFV1 is flagged as intra-only, but its
+// non-keyframes continue the range coder and context state of the previous
+// frame.
+static bool hasInterFrameState(AVCodecID codecId)
+{
+	switch (codecId)
+	{
+		case AV_CODEC_ID_RAWVIDEO:
+		case AV_CODEC_ID_HUFFYUV:
+		case AV_CODEC_ID_FFVHUFF: // with context=1, the tables are stored in each frame
+		case AV_CODEC_ID_UTVIDEO:
+		case AV_CODEC_ID_MAGICYUV:
+			return false;
+		default:
+			return true;
+	}
+}
+
+// Fills the options that the user did not set explicitly. Options that can
+// change the output are added to outputOptions, so that they are part of the
+// packet reuse context; the thread count is set directly in the codec context.
+static void tuneVideoEncoder(AVCodecContext *codecContext, const AVCodec *codec, AVRational frameRate, int threadCount, AVDictionary **outputOptions)
+{
+	// Frame threads would delay the output, which is expected right after
+	// each frame is sent (see VideoEncoder::encodePacket)
+	codecContext->thread_type = FF_THREAD_SLICE;
+	codecContext->thread_count = (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) ? threadCount : 1;
+
+	if (codec->id == AV_CODEC_ID_FFV1 && av_dict_get(*outputOptions, "slices", nullptr, 0) == nullptr)
+	{
+		// Slices require FFV1 version 2 or later
+		const AVDictionaryEntry *level = av_dict_get(*outputOptions, "level", nullptr, 0);
+		if (level == nullptr || atoi(level->value) >= 3)
+		{
+			int slices = selectFfv1SliceCount(codecContext, threadCount);
+			if (slices != 0)
+				failOnAVERROR(av_dict_set_int(outputOptions, "slices", slices, 0), "av_dict_set_int");
+		}
+	}
+
+	// Keyframes cost more than the other frames only in codecs that carry
+	// state between frames (FFV1 included, despite being intra-only)
+	if (hasInterFrameState(codec->id) && av_dict_get(*outputOptions, "g", nullptr, 0) == nullptr)
+	{
+		int gopSize = DEFAULT_GOP_SIZE;
+		if (frameRate.num > 0 && frameRate.den > 0)
+			gopSize = (int)std::clamp(lrint(av_q2d(frameRate) * DEFAULT_GOP_DURATION), (long)MIN_GOP_SIZE, (long)MAX_GOP_SIZE);
+		failOnAVERROR(av_dict_set_int(outputOptions, "g", gopSize, 0), "av_dict_set_int");
+	}
+
+	logDebug("    threads=%d", codecContext->thread_count);
+	for (const char *key : { "slices", "g" })
+	{
+		const AVDictionaryEntry *e = av_dict_get(*outputOptions, key, nullptr, 0);
+		if (e != nullptr)
+			logDebug(" %s=%s", key, e->value);
+	}
+	logDebug("\n");
+}
+
+VideoEncoder::VideoEncoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs, AVCodecID outputCodecID, AVDictionary **outputOptions,
+	int threadCount, const PlaneReduction &reduction)
 : Encoder(inputStream, outputFormatContext, outRefs),
-  m_inputFrame(av_frame_alloc()), m_outputFrame(av_frame_alloc()),
-  m_outputPacket(av_packet_alloc())
+  m_independentPackets(false), m_rawFallbackRatio(0), m_rawFallbackCount(0), m_reduction(reduction), m_proxy(nullptr), m_proxyStreamIndex(-1),
+  m_outputFrameTemplate(av_frame_alloc())
 {
-	if (m_inputFrame == nullptr || m_outputFrame == nullptr)
+	if (m_outputFrameTemplate == nullptr)
 		logError("av_frame_alloc failed\n");
 
-	if (m_outputPacket == nullptr)
-		logError("av_packet_alloc failed\n");
-
 	failOnAVERROR(avcodec_parameters_copy(m_outputStream->codecpar, inputStream->codecpar), "avcodec_parameters_copy");
 	m_outputStream->codecpar->codec_id = outputCodecID;
         m_outputStream->codecpar->codec_tag = 0;
@@ -67,17 +356,20 @@ VideoEncoder::VideoEncoder(const AVStream *inputStream, AVFormatContext *outputF
 	m_outputStream->time_base = inputStream->time_base;
 	m_outputStream->duration = inputStream->duration;
 
-	// Setup decoder
+	// Probe input pixel format (actual decoding is done by FrameConverter)
 
 	AVCodec *inputCodec = avcodec_find_decoder(inputStream->codecpar->codec_id);
 
-	m_inputCodecContext = avcodec_alloc_context3(inputCodec);
-	if (m_inputCodecContext == nullptr)
+	AVCodecContext *inputCodecContext = avcodec_alloc_context3(inputCodec);
+	if (inputCodecContext == nullptr)
 		logError("avcodec_alloc_context3 failed\n");
 
-	failOnAVERROR(avcodec_parameters_to_context(m_inputCodecContext, inputStream->codecpar), "avcodec_parameters_to_context");
-	failOnAVERROR(avcodec_open2(m_inputCodecContext, inputCodec, nullptr), "avcodec_open2");
-	outRefs->addVideoStream(m_inputCodecContext->pix_fmt);
+	failOnAVERROR(avcodec_parameters_to_context(inputCodecContext, inputStream->codecpar), "avcodec_parameters_to_context");
+	failOnAVERROR(avcodec_open2(inputCodecContext, inputCodec, nullptr), "avcodec_open2");
+	AVPixelFormat inputPixelFormat = inputCodecContext->pix_fmt;
+	avcodec_free_context(&inputCodecContext);
+
+	outRefs->addVideoStream(inputPixelFormat, reduction);
 
 	// Setup encoder
 
@@ -89,94 +381,496 @@ VideoEncoder::VideoEncoder(const AVStream *inputStream, AVFormatContext *outputF
 
 	failOnAVERROR(avcodec_parameters_to_context(m_outputCodecContext, m_outputStream->codecpar), "avcodec_parameters_to_context");
 	m_outputCodecContext->time_base = inputStream->time_base;
-	m_outputCodecContext->pix_fmt = selectCompatibleLosslessPixelFormat(m_inputCodecContext->pix_fmt, outputCodec->pix_fmts);
+	if (reduction.isNone())
+		m_outputCodecContext->pix_fmt = selectCompatibleLosslessPixelFormat(inputPixelFormat, outputCodec->pix_fmts);
+	else
+		m_outputCodecContext->pix_fmt = reducedPixelFormat(inputPixelFormat, reduction);
 	m_outputCodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
+	tuneVideoEncoder(m_outputCodecContext, outputCodec, inputStream->avg_frame_rate, threadCount, outputOptions);
+
+	// The options are consumed by avcodec_open2
+	char *optionsString = nullptr;
+	failOnAVERROR(av_dict_get_string(*outputOptions, &optionsString, '=', ','), "av_dict_get_string");
+	std::string reuseContext = std::string(outputCodec->name) + ":" + optionsString;
+	av_freep(&optionsString);
+
 	failOnAVERROR(avcodec_open2(m_outputCodecContext, outputCodec, outputOptions), "avcodec_open2");
 	failOnAVERROR(avcodec_parameters_from_context(m_outputStream->codecpar, m_outputCodecContext), "avcodec_parameters_from_context");
 
-	// Setup pixel format converter
+	// Packets that do not depend on the previous frames can be reused, as long
+	// as the raw frames and the encoder configuration are the same (frames that
+	// do not fit in a reduced format cannot, since they are not referenced).
+	// A reused packet is never seen by the encoder, so the next frames must
+	// not depend on its state either. The same holds for packets dropped by
+	// the raw fallback, which the decoder never sees.
+	m_independentPackets = !hasInterFrameState(outputCodecID) || m_outputCodecContext->gop_size <= 1;
+	if (m_independentPackets && reduction.isNone())
+	{
+		char dimensions[32];
+		snprintf(dimensions, sizeof(dimensions), ":%dx%d:", m_outputCodecContext->width, m_outputCodecContext->height);
+
+		reuseContext += dimensions;
+		reuseContext += av_get_pix_fmt_name(inputPixelFormat);
+		reuseContext += ":";
+		reuseContext += av_get_pix_fmt_name(m_outputCodecContext->pix_fmt);
+		reuseContext += ":";
+
+		m_packetReuseContext.assign(reuseContext.begin(), reuseContext.end());
+		m_packetReuseContext.insert(m_packetReuseContext.end(), m_outputCodecContext->extradata,
+			m_outputCodecContext->extradata + m_outputCodecContext->extradata_size);
+	}
+
+	// Setup template for converted frames
+
+	m_outputFrameTemplate->width = m_outputCodecContext->width;
+	m_outputFrameTemplate->height = m_outputCodecContext->height;
+	m_outputFrameTemplate->sample_aspect_ratio = m_outputCodecContext->sample_aspect_ratio;
+	m_outputFrameTemplate->format = m_outputCodecContext->pix_fmt;
+	m_outputFrameTemplate->pict_type = AV_PICTURE_TYPE_NONE;
+	m_outputFrameTemplate->interlaced_frame = m_outputCodecContext->field_order != AV_FIELD_PROGRESSIVE;
+	m_outputFrameTemplate->top_field_first = m_outputCodecContext->field_order == AV_FIELD_TT || m_outputCodecContext->field_order == AV_FIELD_TB;
+
+	m_outputFramePool.reset(new FrameBufferPool(m_outputCodecContext->pix_fmt, m_outputCodecContext->width, m_outputCodecContext->height));
+}
 
-	m_swscaleContext = sws_getContext(
-		m_inputCodecContext->width, m_inputCodecContext->height, m_inputCodecContext->pix_fmt,
-		m_outputCodecContext->width, m_outputCodecContext->height, m_outputCodecContext->pix_fmt,
-		0, nullptr, nullptr, nullptr);
+VideoEncoder::~VideoEncoder()
+{
+	if (m_rawFallbackCount != 0)
+		logDebug("Stream #0:%d: %zu frames left raw\n", m_inputStream->index, m_rawFallbackCount);
+	if (!m_unreferencedPackets.empty())
+		logWarning("Stream #0:%d: %zu frames do not fit in %s, they are stored uncompressed (see --no-plane-reduction)\n",
+			m_inputStream->index, m_unreferencedPackets.size(), av_get_pix_fmt_name(m_outputCodecContext->pix_fmt));
 
-	// Setup temporary frame
+	av_frame_free(&m_outputFrameTemplate);
+	m_outputFramePool.reset();
 
-	m_outputFrame->width = m_outputCodecContext->width;
-	m_outputFrame->height = m_outputCodecContext->height;
-	m_outputFrame->sample_aspect_ratio = m_outputCodecContext->sample_aspect_ratio;
-	m_outputFrame->format = m_outputCodecContext->pix_fmt;
-	m_outputFrame->pict_type = AV_PICTURE_TYPE_NONE;
-	m_outputFrame->interlaced_frame = m_outputCodecContext->field_order != AV_FIELD_PROGRESSIVE;
-	m_outputFrame->top_field_first = m_outputCodecContext->field_order == AV_FIELD_TT || m_outputCodecContext->field_order == AV_FIELD_TB;
-	failOnAVERROR(av_frame_get_buffer(m_outputFrame, 0), "av_frame_get_buffer");
+	avcodec_free_context(&m_outputCodecContext);
 }
 
-VideoEncoder::~VideoEncoder()
+FrameConverter *VideoEncoder::createConverter() const
 {
-	sws_freeContext(m_swscaleContext);
+	return new FrameConverter(m_inputStream, m_outputFrameTemplate, m_outputFramePool.get(), m_reduction);
+}
 
-	av_frame_free(&m_inputFrame);
-	av_frame_free(&m_outputFrame);
-	av_packet_free(&m_outputPacket);
+size_t VideoEncoder::convertedFrameSize() const
+{
+	return av_image_get_buffer_size((AVPixelFormat)m_outputFrameTemplate->format,
+		m_outputFrameTemplate->width, m_outputFrameTemplate->height, 1);
+}
 
-	avcodec_free_context(&m_inputCodecContext);
-	avcodec_free_context(&m_outputCodecContext);
+std::vector<uint8_t> VideoEncoder::packetReuseContext() const
+{
+	return m_packetReuseContext;
 }
 
-void VideoEncoder::processPacket(const AVPacket *inputPacket)
+void VideoEncoder::encodePacket(const AVPacket *inputPacket, AVFrame *convertedFrame, AVPacket *outputPacket)
 {
-	failOnAVERROR(avcodec_send_packet(m_inputCodecContext, inputPacket), "avcodec_send_packet");
-	failOnAVERROR(avcodec_receive_frame(m_inputCodecContext, m_inputFrame), "avcodec_receive_frame");
+	// Set by FrameConverter, and passed on to finalizeAndWritePacket
+	bool unfit = (convertedFrame->flags & AV_FRAME_FLAG_DISCARD) != 0;
+	convertedFrame->flags &= ~AV_FRAME_FLAG_DISCARD;
 
-	logDebug(" -> Decoded %dx%d %s pts %" PRIi64 "%s\n", m_inputFrame->width, m_inputFrame->height,
-		av_get_pix_fmt_name((AVPixelFormat)m_inputFrame->format), m_inputFrame->pts, m_inputFrame->key_frame ? " KEYFRAME" : "");
+	failOnAVERROR(avcodec_send_frame(m_outputCodecContext, convertedFrame), "avcodec_send_frame");
+	failOnAVERROR(avcodec_receive_packet(m_outputCodecContext, outputPacket), "avcodec_receive_packet");
 
-	logDebug(" -> Converting from %s to %s\n",
-		av_get_pix_fmt_name((AVPixelFormat)m_inputFrame->format),
-		av_get_pix_fmt_name((AVPixelFormat)m_outputFrame->format));
+	if (unfit)
+		outputPacket->flags |= AV_PKT_FLAG_DISCARD;
 
-	av_frame_make_writable(m_outputFrame);
-	sws_scale(m_swscaleContext,
-		m_inputFrame->data, m_inputFrame->linesize,
-		0, m_inputFrame->height,
-		m_outputFrame->data, m_outputFrame->linesize);
-	m_outputFrame->pts = m_inputFrame->pts;
-	m_outputFrame->key_frame = false;
+	if (m_proxy != nullptr)
+		m_proxy->writeFrame(m_proxyStreamIndex, convertedFrame, inputPacket->duration);
 
-	failOnAVERROR(avcodec_send_frame(m_outputCodecContext, m_outputFrame), "avcodec_send_frame");
-	failOnAVERROR(avcodec_receive_packet(m_outputCodecContext, m_outputPacket), "avcodec_receive_packet");
+	logDebug(" -> Encoded %dx%d %s pts %" PRIi64 "%s\n", convertedFrame->width, convertedFrame->height,
+		av_get_pix_fmt_name((AVPixelFormat)convertedFrame->format), convertedFrame->pts,
+		(outputPacket->flags & AV_PKT_FLAG_KEY) ? " KEYFRAME" : "");
+}
 
-	logDebug(" -> Encoded %dx%d %s pts %" PRIi64 "%s\n", m_outputFrame->width, m_outputFrame->height,
-		av_get_pix_fmt_name((AVPixelFormat)m_outputFrame->format), m_outputFrame->pts,
-		(m_outputPacket->flags & AV_PKT_FLAG_KEY) ? " KEYFRAME" : "");
+void VideoEncoder::finalizeAndWritePacket(const AVPacket *inputPacket, AVPacket *outputPacket)
+{
+	// Without a reference, the raw frame is stored as part of an embedded chunk
+	if (m_rawFallbackRatio != 0 && outputPacket->size > inputPacket->size * m_rawFallbackRatio)
+	{
+		logDebug(" -> Raw fallback: Stream #0:%d - encoded size %d, raw size %d\n",
+			m_outputStream->index, outputPacket->size, inputPacket->size);
+		m_rawFallbackCount++;
+		return;
+	}
+
+	// The packet is still needed to decode the next ones, but the original
+	// frame is stored as part of an embedded chunk
+	if (outputPacket->flags & AV_PKT_FLAG_DISCARD)
+	{
+		outputPacket->flags &= ~AV_PKT_FLAG_DISCARD;
+		m_unreferencedPackets.insert(outputPacketCount());
+		writePacket(inputPacket, outputPacket, false);
+		return;
+	}
+
+	Encoder::finalizeAndWritePacket(inputPacket, outputPacket);
+}
 
-	finalizeAndWritePacket(inputPacket, m_outputPacket);
+void VideoEncoder::writeDuplicatePacket(const AVPacket *inputPacket, size_t packetIndex, int64_t pts)
+{
+	if (m_unreferencedPackets.count(packetIndex) != 0)
+	{
+		logDebug(" -> Duplicate of an unreferenced packet: Stream #0:%d (index %zu)\n", m_outputStream->index, packetIndex);
+		return;
+	}
 
-	av_frame_unref(m_inputFrame);
+	Encoder::writeDuplicatePacket(inputPacket, packetIndex, pts);
 }
 
-CopyEncoder::CopyEncoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs)
-: Encoder(inputStream, outputFormatContext, outRefs), m_outputPacket(av_packet_alloc())
+void VideoEncoder::enableRawFallback(double maxRatio)
+{
+	if (!m_independentPackets)
+	{
+		logWarning("Stream #0:%d: raw fallback needs frames that are encoded independently (e.g. g=1 with FFV1), disabled\n",
+			m_inputStream->index);
+		return;
+	}
+
+	m_rawFallbackRatio = maxRatio;
+}
+
+void VideoEncoder::enableProxy(ProxyWriter *proxy)
+{
+	m_proxy = proxy;
+	m_proxyStreamIndex = proxy->addStream(m_outputFrameTemplate, m_inputStream->time_base);
+}
+
+const AVFrame *VideoEncoder::convertedFrameTemplate() const
 {
-	if (m_outputPacket == nullptr)
+	return m_outputFrameTemplate;
+}
+
+// Length of the intervals over which the encoding speed is measured
+static constexpr double ADAPT_INTERVAL_DURATION = 2;
+
+// The previous (slower) level is tried again only if the speed is at least
+// STEP_UP_MARGIN times the target, and after some intervals. That number
+// doubles whenever the previous level turns out to be too slow again.
+static constexpr double STEP_UP_MARGIN = 1.5;
+static constexpr int INITIAL_STEP_UP_DELAY = 4, MAX_STEP_UP_DELAY = 256;
+
+AdaptiveVideoEncoder::AdaptiveVideoEncoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs, AVCodecID outputCodecID, AVDictionary **outputOptions,
+	int threadCount, double targetFps)
+: Encoder(inputStream, outRefs), m_targetFps(targetFps), m_proxy(nullptr), m_proxyStreamIndex(-1), m_currentLevel(0), m_framesInInterval(0), m_encodeTimeInInterval(0),
+  m_intervalsSinceSwitch(0), m_stepUpDelay(INITIAL_STEP_UP_DELAY), m_lastSwitchWasUp(false), m_behindWarningShown(false)
+{
+	m_intervalFrames = std::max((int)lrint(targetFps * ADAPT_INTERVAL_DURATION), 1);
+
+	AVDictionary *baseOptions = nullptr;
+	failOnAVERROR(av_dict_copy(&baseOptions, *outputOptions, 0), "av_dict_copy");
+
+	// Level 0 consumes the options given by the user, so that unused ones can be reported
+	addLevel(outputFormatContext, outRefs, outputCodecID, outputOptions, threadCount);
+
+	// FFV1 gets faster without the context model and with Golomb-Rice coding.
+	// The slice count is not changed, because it already follows the threads.
+	if (outputCodecID == AV_CODEC_ID_FFV1)
+	{
+		std::string previousOptions;
+		for (const std::map<std::string, std::string> &overrides : {
+			std::map<std::string, std::string> { { "context", "0" } },
+			std::map<std::string, std::string> { { "context", "0" }, { "coder", "rice" } } })
+		{
+			AVDictionary *opts = nullptr;
+			failOnAVERROR(av_dict_copy(&opts, baseOptions, 0), "av_dict_copy");
+			for (const auto &[k, v] : overrides)
+				failOnAVERROR(av_dict_set(&opts, k.c_str(), v.c_str(), 0), "av_dict_set");
+
+			char *optionsString = nullptr;
+			failOnAVERROR(av_dict_get_string(opts, &optionsString, '=', ','), "av_dict_get_string");
+			std::string levelName = std::string("ffv1 ") + optionsString;
+			av_freep(&optionsString);
+
+			// Skip variants that the user already asked for
+			if (std::find(m_levelNames.begin(), m_levelNames.end(), levelName) == m_levelNames.end())
+				addLevel(outputFormatContext, outRefs, AV_CODEC_ID_FFV1, &opts, threadCount);
+			av_dict_free(&opts);
+		}
+	}
+
+	// Last resort: FFVHUFF, as long as it takes the same converted frames
+	AVPixelFormat inputPixelFormat = (AVPixelFormat)inputStream->codecpar->format;
+	const AVCodec *fallbackCodec = avcodec_find_encoder(AV_CODEC_ID_FFVHUFF);
+	if (outputCodecID != AV_CODEC_ID_FFVHUFF && outputCodecID != AV_CODEC_ID_HUFFYUV && fallbackCodec != nullptr &&
+		hasCompatibleLosslessPixelFormat(inputPixelFormat, fallbackCodec->pix_fmts) &&
+		selectCompatibleLosslessPixelFormat(inputPixelFormat, fallbackCodec->pix_fmts) == m_levels[0]->outputCodecParameters()->format)
+	{
+		AVDictionary *opts = nullptr;
+		failOnAVERROR(av_dict_set(&opts, "pred", "left", 0), "av_dict_set");
+		addLevel(outputFormatContext, outRefs, AV_CODEC_ID_FFVHUFF, &opts, threadCount);
+		av_dict_free(&opts);
+	}
+
+	av_dict_free(&baseOptions);
+
+	if (m_levels.size() == 1)
+		logWarning("No faster codec options available for stream #0:%d, --target-fps has no effect\n", inputStream->index);
+}
+
+AdaptiveVideoEncoder::~AdaptiveVideoEncoder()
+{
+}
+
+void AdaptiveVideoEncoder::addLevel(AVFormatContext *outputFormatContext, PacketReferences *outRefs, AVCodecID outputCodecID, AVDictionary **outputOptions,
+	int threadCount)
+{
+	char *optionsString = nullptr;
+	failOnAVERROR(av_dict_get_string(*outputOptions, &optionsString, '=', ','), "av_dict_get_string");
+	std::string levelName = std::string(avcodec_get_name(outputCodecID)) + " " + optionsString;
+	av_freep(&optionsString);
+
+	m_levels.emplace_back(new VideoEncoder(m_inputStream, outputFormatContext, outRefs, outputCodecID, outputOptions, threadCount));
+	m_levelNames.push_back(levelName);
+
+	logDebug("    level %zu: Stream #0:%u %s\n", m_levels.size() - 1, outputFormatContext->nb_streams - 1, levelName.c_str());
+}
+
+FrameConverter *AdaptiveVideoEncoder::createConverter() const
+{
+	// All the levels take the same pixel format
+	return m_levels[0]->createConverter();
+}
+
+size_t AdaptiveVideoEncoder::convertedFrameSize() const
+{
+	return m_levels[0]->convertedFrameSize();
+}
+
+void AdaptiveVideoEncoder::encodePacket(const AVPacket *inputPacket, AVFrame *convertedFrame, AVPacket *outputPacket)
+{
+	int64_t startTime = av_gettime_relative();
+	m_levels[m_currentLevel]->encodePacket(inputPacket, convertedFrame, outputPacket);
+	m_encodeTimeInInterval += av_gettime_relative() - startTime;
+
+	// Not part of the measured time, since it does not depend on the level
+	if (m_proxy != nullptr)
+		m_proxy->writeFrame(m_proxyStreamIndex, convertedFrame, inputPacket->duration);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pendingLevels.push_back(m_currentLevel);
+	}
+
+	if (++m_framesInInterval == m_intervalFrames)
+		adapt();
+}
+
+void AdaptiveVideoEncoder::finalizeAndWritePacket(const AVPacket *inputPacket, AVPacket *outputPacket)
+{
+	size_t level;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		level = m_pendingLevels.front();
+		m_pendingLevels.pop_front();
+	}
+
+	m_levels[level]->finalizeAndWritePacket(inputPacket, outputPacket);
+}
+
+void AdaptiveVideoEncoder::enableProxy(ProxyWriter *proxy)
+{
+	// All the levels take the frames converted for the first one
+	m_proxy = proxy;
+	m_proxyStreamIndex = proxy->addStream(m_levels[0]->convertedFrameTemplate(), m_inputStream->time_base);
+}
+
+void AdaptiveVideoEncoder::adapt()
+{
+	double fps = m_framesInInterval * 1e6 / std::max(m_encodeTimeInInterval, (int64_t)1);
+	m_framesInInterval = 0;
+	m_encodeTimeInInterval = 0;
+	m_intervalsSinceSwitch++;
+
+	size_t newLevel = m_currentLevel;
+	if (fps < m_targetFps && m_currentLevel + 1 < m_levels.size())
+	{
+		newLevel = m_currentLevel + 1;
+
+		if (m_lastSwitchWasUp)
+			m_stepUpDelay = std::min(m_stepUpDelay * 2, MAX_STEP_UP_DELAY);
+		m_lastSwitchWasUp = false;
+	}
+	else if (fps < m_targetFps)
+	{
+		if (!m_behindWarningShown)
+		{
+			logWarning("Stream #0:%d: encoding at %.1f fps with the fastest options, below the target of %g fps\n",
+				m_inputStream->index, fps, m_targetFps);
+			m_behindWarningShown = true;
+		}
+	}
+	else if (m_currentLevel != 0 && fps >= m_targetFps * STEP_UP_MARGIN && m_intervalsSinceSwitch >= m_stepUpDelay)
+	{
+		newLevel = m_currentLevel - 1;
+		m_lastSwitchWasUp = true;
+	}
+
+	logDebug(" -> Stream #0:%d: encoding at %.1f fps with level %zu (%s)%s\n", m_inputStream->index, fps, m_currentLevel,
+		m_levelNames[m_currentLevel].c_str(), newLevel != m_currentLevel ? ", switching" : "");
+
+	if (newLevel != m_currentLevel)
+	{
+		logDebug(" -> Stream #0:%d: switched to level %zu (%s)\n", m_inputStream->index, newLevel, m_levelNames[newLevel].c_str());
+		m_currentLevel = newLevel;
+		m_intervalsSinceSwitch = 0;
+	}
+}
+
+// Largest block size allowed by FLAC. Input packets with more samples are
+// split into several FLAC frames.
+static constexpr int FLAC_MAX_BLOCK_SIZE = 65535;
+
+AudioEncoder::AudioEncoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs)
+: Encoder(inputStream, outputFormatContext, outRefs),
+  m_pcmFormat(findPcmFormat(inputStream->codecpar->codec_id)), m_unalignedPacketCount(0), m_frame(av_frame_alloc()), m_flacPacket(av_packet_alloc()),
+  m_outputBufferSize(0)
+{
+	if (m_frame == nullptr)
+		logError("av_frame_alloc failed\n");
+	if (m_flacPacket == nullptr)
 		logError("av_packet_alloc failed\n");
 
-	outRefs->addCopyStream();
+	outRefs->addAudioStream(inputStream->codecpar->codec_id);
 
-	failOnAVERROR(avcodec_parameters_copy(m_outputStream->codecpar, inputStream->codecpar), "avcodec_parameters_copy");
-        m_outputStream->codecpar->codec_tag = 0;
+	AVCodec *outputCodec = avcodec_find_encoder(AV_CODEC_ID_FLAC);
+
+	m_outputCodecContext = avcodec_alloc_context3(outputCodec);
+	if (m_outputCodecContext == nullptr)
+		logError("avcodec_alloc_context3 failed\n");
+
+	const AVCodecParameters *inputCodecParameters = inputStream->codecpar;
+	m_outputCodecContext->sample_rate = inputCodecParameters->sample_rate;
+	m_outputCodecContext->channels = inputCodecParameters->channels;
+	m_outputCodecContext->channel_layout = inputCodecParameters->channel_layout != 0 ?
+		inputCodecParameters->channel_layout : av_get_default_channel_layout(inputCodecParameters->channels);
+	m_outputCodecContext->sample_fmt = m_pcmFormat->flacSampleFormat();
+	m_outputCodecContext->bits_per_raw_sample = m_pcmFormat->flacBitsPerSample();
+	m_outputCodecContext->time_base = inputStream->time_base;
+	m_outputCodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	// Smaller frames are accepted too, so that each input packet can be
+	// encoded as it is, whatever its number of samples
+	m_outputCodecContext->frame_size = FLAC_MAX_BLOCK_SIZE;
+
+	failOnAVERROR(avcodec_open2(m_outputCodecContext, outputCodec, nullptr), "avcodec_open2");
+
+	failOnAVERROR(avcodec_parameters_from_context(m_outputStream->codecpar, m_outputCodecContext), "avcodec_parameters_from_context");
+	m_outputStream->time_base = inputStream->time_base;
+	m_outputStream->duration = inputStream->duration;
+
+	m_frame->nb_samples = FLAC_MAX_BLOCK_SIZE;
+	m_frame->format = m_outputCodecContext->sample_fmt;
+	m_frame->channels = m_outputCodecContext->channels;
+	m_frame->channel_layout = m_outputCodecContext->channel_layout;
+	m_frame->sample_rate = m_outputCodecContext->sample_rate;
+	failOnAVERROR(av_frame_get_buffer(m_frame, 0), "av_frame_get_buffer");
+}
+
+AudioEncoder::~AudioEncoder()
+{
+	if (m_unalignedPacketCount != 0)
+		logWarning("Stream #0:%d: %zu packets do not hold a whole number of samples, they are stored uncompressed\n",
+			m_inputStream->index, m_unalignedPacketCount);
+
+	av_packet_free(&m_flacPacket);
+	av_frame_free(&m_frame);
+
+	avcodec_free_context(&m_outputCodecContext);
+}
+
+bool AudioEncoder::isSupported(const AVStream *inputStream)
+{
+	const AVCodecParameters *inputCodecParameters = inputStream->codecpar;
+
+	return inputCodecParameters->codec_type == AVMEDIA_TYPE_AUDIO &&
+		findPcmFormat(inputCodecParameters->codec_id) != nullptr &&
+		inputCodecParameters->channels >= 1 && inputCodecParameters->channels <= 8 &&
+		inputCodecParameters->sample_rate > 0 && inputCodecParameters->sample_rate <= 655350;
 }
 
-CopyEncoder::~CopyEncoder()
+void AudioEncoder::encodePacket(const AVPacket *inputPacket, AVFrame *, AVPacket *outputPacket)
 {
-	av_packet_free(&m_outputPacket);
+	int channels = m_outputCodecContext->channels;
+	int sampleSize = m_pcmFormat->bytesPerSample * channels;
+	m_encodedData.clear();
+
+	const uint8_t *src = inputPacket->data;
+	for (int remaining = inputPacket->size / sampleSize; remaining != 0; )
+	{
+		int count = std::min(remaining, FLAC_MAX_BLOCK_SIZE);
+
+		// The encoder has released the frame by now, so this does not
+		// allocate. A copy would keep room for the largest block.
+		m_frame->nb_samples = FLAC_MAX_BLOCK_SIZE;
+		failOnAVERROR(av_frame_make_writable(m_frame), "av_frame_make_writable");
+		m_frame->nb_samples = count;
+
+		unpackPcmSamples(m_pcmFormat, src, count * channels, m_frame->data[0]);
+
+		failOnAVERROR(avcodec_send_frame(m_outputCodecContext, m_frame), "avcodec_send_frame");
+		failOnAVERROR(avcodec_receive_packet(m_outputCodecContext, m_flacPacket), "avcodec_receive_packet");
+		m_encodedData.insert(m_encodedData.end(), m_flacPacket->data, m_flacPacket->data + m_flacPacket->size);
+
+		av_packet_unref(m_flacPacket);
+
+		src += count * sampleSize;
+		remaining -= count;
+	}
+
+	// Packets usually have the same size, so the pool rarely has to grow
+	int size = m_encodedData.size();
+	if (size > m_outputBufferSize || m_outputPool == nullptr)
+	{
+		m_outputBufferSize = std::max({ size, m_outputBufferSize * 2, 1 });
+		m_outputPool.reset(new BufferPool(m_outputBufferSize));
+	}
+
+	outputPacket->buf = m_outputPool->get();
+	outputPacket->data = outputPacket->buf->data;
+	outputPacket->size = size;
+	memcpy(outputPacket->data, m_encodedData.data(), size);
+	outputPacket->flags |= AV_PKT_FLAG_KEY;
+
+	// The trailing bytes cannot be restored from FLAC: passed on to
+	// finalizeAndWritePacket
+	if (inputPacket->size % sampleSize != 0)
+	{
+		logDebug(" -> PCM packet size (%d) is not a multiple of the sample size (%d)\n", inputPacket->size, sampleSize);
+		outputPacket->flags |= AV_PKT_FLAG_DISCARD;
+	}
+
+	logDebug(" -> Encoded %d bytes of %s to %d bytes of FLAC\n", inputPacket->size,
+		avcodec_get_name(m_pcmFormat->codecId), outputPacket->size);
+}
+
+void AudioEncoder::finalizeAndWritePacket(const AVPacket *inputPacket, AVPacket *outputPacket)
+{
+	// The packet keeps the stream complete, but the original samples are
+	// stored as part of an embedded chunk
+	if (outputPacket->flags & AV_PKT_FLAG_DISCARD)
+	{
+		outputPacket->flags &= ~AV_PKT_FLAG_DISCARD;
+		m_unalignedPacketCount++;
+		writePacket(inputPacket, outputPacket, false);
+		return;
+	}
+
+	Encoder::finalizeAndWritePacket(inputPacket, outputPacket);
+}
+
+CopyEncoder::CopyEncoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs)
+: Encoder(inputStream, outputFormatContext, outRefs)
+{
+	outRefs->addCopyStream();
+
+	failOnAVERROR(avcodec_parameters_copy(m_outputStream->codecpar, inputStream->codecpar), "avcodec_parameters_copy");
+        m_outputStream->codecpar->codec_tag = 0;
 }
 
-void CopyEncoder::processPacket(const AVPacket *inputPacket)
+void CopyEncoder::encodePacket(const AVPacket *inputPacket, AVFrame *, AVPacket *outputPacket)
 {
-	av_packet_ref(m_outputPacket, inputPacket);
-	finalizeAndWritePacket(inputPacket, m_outputPacket);
+	failOnAVERROR(av_packet_ref(outputPacket, inputPacket), "av_packet_ref");
 }
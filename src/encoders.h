@@ -18,7 +18,44 @@
 #ifndef ENCODERS_H
 #define ENCODERS_H
 
+#include "bufferpool.h"
 #include "llrfile.h"
+#include "pcm.h"
+#include "proxy.h"
+#include "reduction.h"
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+
+// Decodes raw input packets and converts them to the pixel format expected by
+// the encoder. Unlike encoders, converters have no state that depends on the
+// previous frames, as long as each packet of a palettized stream carries its
+// palette (see EncoderPipeline::submit): multiple instances can process frames
+// of the same stream in parallel.
+//
+// If a plane reduction is given, the output frames are in the reduced format.
+// Frames that do not fit in it are flagged with AV_FRAME_FLAG_DISCARD.
+class FrameConverter
+{
+	public:
+		FrameConverter(const AVStream *inputStream, const AVFrame *outputFrameTemplate, FrameBufferPool *outputFramePool,
+			const PlaneReduction &reduction = PlaneReduction());
+		~FrameConverter();
+
+		void convert(const AVPacket *inputPacket, AVFrame *outputFrame);
+
+	private:
+		AVCodecContext *m_inputCodecContext;
+		AVFrame *m_inputFrame, *m_outputFrameTemplate;
+		FrameBufferPool *m_outputFramePool;
+
+		PlaneReduction m_reduction;
+		AVFrame *m_wideFrame; // only used if m_reduction is not none
+
+		SwsContext *m_swscaleContext;
+};
 
 class Encoder
 {
@@ -26,10 +63,42 @@ class Encoder
 		Encoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs);
 		virtual ~Encoder();
 
-		virtual void processPacket(const AVPacket *inputPacket) = 0;
+		// Returns a new converter whose output must be passed to encodePacket,
+		// or nullptr if this encoder does not need it
+		virtual FrameConverter *createConverter() const;
+		virtual size_t convertedFrameSize() const;
+
+		// Returns a description of everything but the input packet that
+		// affects the output packets, if they can be reused for identical
+		// input packets in other files (see ArchiveStore), or an empty vector
+		virtual std::vector<uint8_t> packetReuseContext() const;
+
+		// Called by EncoderPipeline: encodePacket can be called from any
+		// thread (but never concurrently on the same encoder) in the same
+		// order as the input packets. finalizeAndWritePacket must be called
+		// in the same order too, from the thread that owns the muxer.
+		virtual void encodePacket(const AVPacket *inputPacket, AVFrame *convertedFrame, AVPacket *outputPacket) = 0;
+		virtual void finalizeAndWritePacket(const AVPacket *inputPacket, AVPacket *outputPacket);
+
+		// Called by EncoderPipeline instead of finalizeAndWritePacket if the
+		// input packet is identical to the one that has been encoded to the
+		// given output packet (pts in the input stream's time base)
+		virtual void writeDuplicatePacket(const AVPacket *inputPacket, size_t packetIndex, int64_t pts);
+
+		// Used to resume from a checkpoint: packets that were already encoded
+		// by a previous run are copied as they are
+		void writeResumedPacket(AVPacket *packet, AVRational timeBase);
+		size_t outputPacketCount() const;
+		const AVCodecParameters *outputCodecParameters() const;
 
 	protected:
-		void finalizeAndWritePacket(const AVPacket *inputPacket, AVPacket *outputPacket);
+		// For encoders that have no output stream of their own, but write
+		// their packets through other encoders
+		Encoder(const AVStream *inputStream, PacketReferences *outRefs);
+
+		// Writes the next output packet. If addReference is not set, the
+		// input packet is stored as part of an embedded chunk instead.
+		void writePacket(const AVPacket *inputPacket, AVPacket *outputPacket, bool addReference);
 
 		const AVStream *m_inputStream;
 
@@ -41,32 +110,130 @@ class Encoder
 		size_t m_outPacketIndex;
 };
 
+// The slice count, GOP length and thread count that are not given in
+// outputOptions are derived from threadCount (i.e. the CPUs available to this
+// encoder), the frame size and the capabilities of the output codec.
+//
+// If a plane reduction is given (see fitPlaneReduction), frames are encoded in
+// the reduced format. The few frames that do not fit in it are still encoded,
+// so that the following ones can be decoded, but they are not referenced.
 class VideoEncoder : public Encoder
 {
 	public:
-		VideoEncoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs, AVCodecID outputCodecID, AVDictionary **outputOptions);
+		VideoEncoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs, AVCodecID outputCodecID, AVDictionary **outputOptions,
+			int threadCount, const PlaneReduction &reduction = PlaneReduction());
 		~VideoEncoder() override;
 
-		void processPacket(const AVPacket *inputPacket) override;
+		FrameConverter *createConverter() const override;
+		size_t convertedFrameSize() const override;
+		std::vector<uint8_t> packetReuseContext() const override;
+		void encodePacket(const AVPacket *inputPacket, AVFrame *convertedFrame, AVPacket *outputPacket) override;
+		void finalizeAndWritePacket(const AVPacket *inputPacket, AVPacket *outputPacket) override;
+		void writeDuplicatePacket(const AVPacket *inputPacket, size_t packetIndex, int64_t pts) override;
+
+		// Frames whose encoded size exceeds maxRatio times their raw size are
+		// not written: they are left to the LLR file as embedded chunks, which
+		// are copied back on decompression. Only possible if every packet can
+		// be decoded on its own, otherwise a warning is shown.
+		void enableRawFallback(double maxRatio);
+
+		// Each encoded frame is also written to a new stream of proxy
+		void enableProxy(ProxyWriter *proxy);
+
+		// Size, pixel format and aspect ratio of the frames taken by encodePacket
+		const AVFrame *convertedFrameTemplate() const;
 
 	private:
-		AVCodecContext *m_inputCodecContext, *m_outputCodecContext;
-		AVFrame *m_inputFrame, *m_outputFrame;
-		AVPacket *m_outputPacket;
+		std::vector<uint8_t> m_packetReuseContext;
+		bool m_independentPackets;
+		double m_rawFallbackRatio; // 0 if disabled
+		size_t m_rawFallbackCount;
+		PlaneReduction m_reduction;
+		std::set<size_t> m_unreferencedPackets; // frames that do not fit in the reduced format
+		ProxyWriter *m_proxy; // nullptr if disabled
+		int m_proxyStreamIndex;
+		AVCodecContext *m_outputCodecContext;
+		AVFrame *m_outputFrameTemplate;
+		std::unique_ptr<FrameBufferPool> m_outputFramePool; // shared by all converters
+};
 
-		SwsContext *m_swscaleContext;
+// Stores PCM audio (see PcmFormat) as FLAC. Each input packet is encoded to
+// one output packet, which contains as many FLAC frames as needed. Packets that
+// end with a partial sample are encoded without it, so that the output stream
+// stays complete, but they are not referenced: the original packet is stored
+// as part of an embedded chunk.
+class AudioEncoder : public Encoder
+{
+	public:
+		AudioEncoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs);
+		~AudioEncoder() override;
+
+		static bool isSupported(const AVStream *inputStream);
+
+		void encodePacket(const AVPacket *inputPacket, AVFrame *convertedFrame, AVPacket *outputPacket) override;
+		void finalizeAndWritePacket(const AVPacket *inputPacket, AVPacket *outputPacket) override;
+
+	private:
+		const PcmFormat *m_pcmFormat;
+		size_t m_unalignedPacketCount;
+		AVCodecContext *m_outputCodecContext;
+		AVFrame *m_frame; // with room for the largest FLAC block, reused for every block
+		AVPacket *m_flacPacket;
+		std::vector<uint8_t> m_encodedData;
+		std::unique_ptr<BufferPool> m_outputPool; // replaced by a bigger one when needed
+		int m_outputBufferSize;
 };
 
-class CopyEncoder : public Encoder
+// Encodes a raw video stream with a ladder of VideoEncoders, from the given
+// codec and options down to faster variants, each one writing to its own output
+// stream. The encoding speed is measured over intervals of a few seconds: if it
+// is below targetFps, the next level is used; if it has been well above for a
+// while, the previous one is tried again. Since each level has its own stream,
+// the parameters of each stream never change and every switch is recorded by
+// the packet references themselves.
+class AdaptiveVideoEncoder : public Encoder
 {
 	public:
-		CopyEncoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs);
-		~CopyEncoder() override;
+		AdaptiveVideoEncoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs, AVCodecID outputCodecID, AVDictionary **outputOptions,
+			int threadCount, double targetFps);
+		~AdaptiveVideoEncoder() override;
+
+		FrameConverter *createConverter() const override;
+		size_t convertedFrameSize() const override;
+		void encodePacket(const AVPacket *inputPacket, AVFrame *convertedFrame, AVPacket *outputPacket) override;
+		void finalizeAndWritePacket(const AVPacket *inputPacket, AVPacket *outputPacket) override;
 
-		void processPacket(const AVPacket *inputPacket) override;
+		// Same as VideoEncoder::enableProxy, whatever the level
+		void enableProxy(ProxyWriter *proxy);
 
 	private:
-		AVPacket *m_outputPacket;
+		void addLevel(AVFormatContext *outputFormatContext, PacketReferences *outRefs, AVCodecID outputCodecID, AVDictionary **outputOptions,
+			int threadCount);
+		void adapt();
+
+		std::vector<std::unique_ptr<VideoEncoder>> m_levels;
+		std::vector<std::string> m_levelNames;
+		double m_targetFps;
+		ProxyWriter *m_proxy; // nullptr if disabled
+		int m_proxyStreamIndex;
+
+		// Only accessed by the thread that encodes packets
+		size_t m_currentLevel;
+		int m_intervalFrames, m_framesInInterval;
+		int64_t m_encodeTimeInInterval; // microseconds
+		int m_intervalsSinceSwitch, m_stepUpDelay;
+		bool m_lastSwitchWasUp, m_behindWarningShown;
+
+		std::mutex m_mutex;
+		std::deque<size_t> m_pendingLevels; // of the packets that have been encoded but not written yet
+};
+
+class CopyEncoder : public Encoder
+{
+	public:
+		CopyEncoder(const AVStream *inputStream, AVFormatContext *outputFormatContext, PacketReferences *outRefs);
+
+		void encodePacket(const AVPacket *inputPacket, AVFrame *convertedFrame, AVPacket *outputPacket) override;
 };
 
 #endif
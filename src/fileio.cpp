@@ -0,0 +1,827 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fileio.h"
+
+#include "ioqueue.h"
+#include "log.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Size of each read request issued by the read-ahead thread
+static constexpr int READ_AHEAD_BLOCK_SIZE = 4 * 1024 * 1024;
+
+// Size of the AVIOContext buffer for files opened with openReadAhead
+static constexpr int READ_AHEAD_AVIO_BUFFER_SIZE = 1024 * 1024;
+
+// Maximum amount of data in each buffer handed to the writer thread
+static constexpr int WRITE_BEHIND_BLOCK_SIZE = 4 * 1024 * 1024;
+
+// Maximum number of buffers waiting to be written or being written
+static constexpr size_t WRITE_BEHIND_MAX_PENDING_BLOCKS = 16;
+
+// Alignment of buffers, offsets and sizes of direct I/O requests
+static constexpr size_t BLOCK_ALIGNMENT = 4096;
+
+// Size of the buffers handed to the writer thread, including room for the
+// padding that aligns direct writes to whole sectors
+static constexpr size_t WRITE_BEHIND_BUFFER_SIZE = WRITE_BEHIND_BLOCK_SIZE + 2 * BLOCK_ALIGNMENT;
+
+// How files interact with the page cache
+enum class CacheMode
+{
+	Normal,
+	Direct, // opened with O_DIRECT
+	DropBehind // pages are dropped after use, because O_DIRECT was rejected
+};
+
+static bool directIoEnabled = false;
+
+class ReadAheadFile
+{
+	public:
+		ReadAheadFile(int fd, size_t readAheadSize, CacheMode cacheMode);
+		~ReadAheadFile();
+
+		int read(uint8_t *buf, int size);
+		int64_t seek(int64_t offset, int whence);
+
+		// Returns the first read error, or 0 if none occurred
+		int error();
+
+	private:
+		struct Block
+		{
+			uint8_t *data;
+			int64_t offset;
+			uint64_t generation;
+			bool completed;
+			int64_t result; // number of bytes read or AVERROR code
+		};
+
+		void recycleBlock(Block *block);
+		void readerMain();
+
+		int m_fd;
+		CacheMode m_cacheMode;
+		size_t m_maxBlocks;
+		std::unique_ptr<IoQueue> m_ioQueue; // only used by the reader thread
+
+		std::mutex m_mutex;
+		std::condition_variable m_blockCompleted, m_spaceAvailable;
+		std::deque<Block*> m_blocks; // in file order, possibly still being read
+		std::vector<Block*> m_freeBlocks;
+		int64_t m_position; // position of the next byte returned by read
+		int64_t m_prefetchPosition; // position of the next block to be read
+		uint64_t m_generation; // incremented on each seek that discards the blocks
+		bool m_endReached; // a short read or an error occurred in the current generation
+		int m_error; // first read error, not counting blocks discarded by seek
+		bool m_stopping;
+
+		std::thread m_thread;
+};
+
+ReadAheadFile::ReadAheadFile(int fd, size_t readAheadSize, CacheMode cacheMode)
+: m_fd(fd), m_cacheMode(cacheMode), m_maxBlocks(std::max<size_t>(1, readAheadSize / READ_AHEAD_BLOCK_SIZE)),
+  m_ioQueue(IoQueue::create(m_maxBlocks)),
+  m_position(0), m_prefetchPosition(0), m_generation(0), m_endReached(false), m_error(0), m_stopping(false)
+{
+	// Failure is not fatal: this is just a hint
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	m_thread = std::thread(&ReadAheadFile::readerMain, this);
+}
+
+ReadAheadFile::~ReadAheadFile()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+
+	m_spaceAvailable.notify_all();
+	m_thread.join(); // waits for all the requests to complete
+
+	for (Block *block : m_blocks)
+		recycleBlock(block);
+
+	for (Block *block : m_freeBlocks)
+	{
+		free(block->data);
+		delete block;
+	}
+
+	close(m_fd);
+}
+
+// Must be called with m_mutex locked
+void ReadAheadFile::recycleBlock(Block *block)
+{
+	if (m_cacheMode == CacheMode::DropBehind)
+		posix_fadvise(m_fd, block->offset, READ_AHEAD_BLOCK_SIZE, POSIX_FADV_DONTNEED);
+
+	m_freeBlocks.push_back(block);
+	m_spaceAvailable.notify_all();
+}
+
+int ReadAheadFile::read(uint8_t *buf, int size)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_blockCompleted.wait(lock, [&] { return !m_blocks.empty() && m_blocks.front()->completed; });
+
+	Block *block = m_blocks.front();
+	if (block->result < 0)
+		return block->result;
+
+	int64_t offsetInBlock = m_position - block->offset;
+	if (offsetInBlock >= block->result)
+		return AVERROR_EOF;
+
+	int result = std::min<int64_t>(size, block->result - offsetInBlock);
+	memcpy(buf, block->data + offsetInBlock, result);
+	m_position += result;
+
+	if (m_position == block->offset + READ_AHEAD_BLOCK_SIZE)
+	{
+		m_blocks.pop_front();
+		recycleBlock(block);
+	}
+
+	return result;
+}
+
+int ReadAheadFile::error()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_error;
+}
+
+int64_t ReadAheadFile::seek(int64_t offset, int whence)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	switch (whence & ~AVSEEK_FORCE)
+	{
+		case AVSEEK_SIZE:
+		{
+			struct stat st;
+			if (fstat(m_fd, &st) != 0)
+				return AVERROR(errno);
+			return st.st_size;
+		}
+		case SEEK_SET:
+			break;
+		case SEEK_CUR:
+			offset += m_position;
+			break;
+		default: // SEEK_END is never used by libavformat
+			return AVERROR(EINVAL);
+	}
+
+	if (offset < 0)
+		return AVERROR(EINVAL);
+
+	// Short forward seeks within the blocks that have already been read
+	// (e.g. when skipping gaps between packets) do not discard them
+	while (!m_blocks.empty() && m_blocks.front()->completed && m_blocks.front()->result == READ_AHEAD_BLOCK_SIZE &&
+		offset >= m_blocks.front()->offset + READ_AHEAD_BLOCK_SIZE)
+	{
+		recycleBlock(m_blocks.front());
+		m_blocks.pop_front();
+	}
+
+	if (m_blocks.empty() || offset < m_blocks.front()->offset || offset >= m_blocks.front()->offset + READ_AHEAD_BLOCK_SIZE)
+	{
+		// Blocks that are still being read are recycled by the reader
+		// thread, which recognizes them by their generation
+		for (Block *block : m_blocks)
+		{
+			if (block->completed)
+				recycleBlock(block);
+		}
+
+		m_blocks.clear();
+		m_generation++;
+
+		// Direct reads must start at an aligned offset: the first block
+		// simply begins with some bytes before the requested position
+		m_prefetchPosition = offset;
+		if (m_cacheMode == CacheMode::Direct)
+			m_prefetchPosition &= ~(int64_t)(BLOCK_ALIGNMENT - 1);
+
+		m_endReached = false;
+		m_spaceAvailable.notify_all();
+	}
+
+	m_position = offset;
+	return offset;
+}
+
+void ReadAheadFile::readerMain()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	size_t inFlight = 0;
+
+	while (true)
+	{
+		// Keep the read-ahead window full
+		while (!m_stopping && !m_endReached && m_blocks.size() < m_maxBlocks && inFlight < m_maxBlocks)
+		{
+			Block *block;
+			if (!m_freeBlocks.empty())
+			{
+				block = m_freeBlocks.back();
+				m_freeBlocks.pop_back();
+			}
+			else
+			{
+				block = new Block;
+				if (posix_memalign((void**)&block->data, BLOCK_ALIGNMENT, READ_AHEAD_BLOCK_SIZE) != 0)
+					logError("posix_memalign failed\n");
+			}
+
+			block->offset = m_prefetchPosition;
+			block->generation = m_generation;
+			block->completed = false;
+			m_prefetchPosition += READ_AHEAD_BLOCK_SIZE;
+			m_blocks.push_back(block);
+			inFlight++;
+
+			// The blocking backend performs the read right away
+			lock.unlock();
+			m_ioQueue->submitRead(m_fd, block->data, READ_AHEAD_BLOCK_SIZE, block->offset, block);
+			lock.lock();
+		}
+
+		if (inFlight == 0)
+		{
+			if (m_stopping)
+				break;
+
+			m_spaceAvailable.wait(lock);
+			continue;
+		}
+
+		lock.unlock();
+		auto [tag, result] = m_ioQueue->waitCompletion();
+		lock.lock();
+
+		inFlight--;
+
+		Block *block = (Block*)tag;
+		if (block->generation != m_generation) // discarded by seek
+		{
+			recycleBlock(block);
+			continue;
+		}
+
+		block->completed = true;
+		block->result = result;
+		if (result != READ_AHEAD_BLOCK_SIZE)
+			m_endReached = true; // end of file or error
+		if (result < 0 && m_error == 0)
+			m_error = result;
+
+		m_blockCompleted.notify_all();
+	}
+}
+
+class WriteBehindFile
+{
+	public:
+		WriteBehindFile(int fd, CacheMode cacheMode, int64_t base);
+		~WriteBehindFile();
+
+		int write(const uint8_t *buf, int size);
+		int64_t seek(int64_t offset, int whence);
+		int sync(bool durable);
+		int close();
+
+	private:
+		// In direct mode, data starts at the beginning of the sector that
+		// contains offset, i.e. the block's bytes are found at
+		// data + offset % BLOCK_ALIGNMENT
+		struct Block
+		{
+			uint8_t *data;
+			size_t size;
+			int64_t offset;
+		};
+
+		std::pair<int64_t, int64_t> writtenRange(const Block &block) const;
+		int fillPadding(const Block &block);
+		int readSector(int64_t offset);
+		void writerMain();
+
+		int m_fd;
+		CacheMode m_cacheMode;
+		uint8_t *m_sectorBuffer; // only used by the writer thread, in direct mode
+		int64_t m_base; // offset in the file of position 0
+		int64_t m_position, m_size; // including data that is still pending
+		std::unique_ptr<IoQueue> m_ioQueue; // only used by the writer thread
+
+		std::mutex m_mutex;
+		std::condition_variable m_blockQueued, m_blockWritten;
+		std::deque<Block> m_pendingBlocks;
+		std::vector<Block> m_inFlightBlocks;
+		std::vector<uint8_t*> m_freeBuffers;
+		int m_error;
+		bool m_stopping;
+
+		std::thread m_thread;
+};
+
+WriteBehindFile::WriteBehindFile(int fd, CacheMode cacheMode, int64_t base)
+: m_fd(fd), m_cacheMode(cacheMode), m_sectorBuffer(nullptr), m_base(base), m_position(0), m_size(0), m_ioQueue(IoQueue::create(WRITE_BEHIND_MAX_PENDING_BLOCKS)),
+  m_error(0), m_stopping(false)
+{
+	if (m_cacheMode == CacheMode::Direct && posix_memalign((void**)&m_sectorBuffer, BLOCK_ALIGNMENT, BLOCK_ALIGNMENT) != 0)
+		logError("posix_memalign failed\n");
+
+	m_thread = std::thread(&WriteBehindFile::writerMain, this);
+}
+
+WriteBehindFile::~WriteBehindFile()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+
+	m_blockQueued.notify_all();
+	m_thread.join(); // waits for all the requests to complete
+
+	for (const Block &block : m_pendingBlocks) // only if an error occurred
+		free(block.data);
+
+	for (uint8_t *buffer : m_freeBuffers)
+		free(buffer);
+
+	free(m_sectorBuffer);
+
+	if (m_fd != -1)
+		::close(m_fd);
+}
+
+int WriteBehindFile::write(const uint8_t *buf, int size)
+{
+	int written = 0;
+
+	while (written != size)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_blockWritten.wait(lock, [&] { return m_error != 0 ||
+			m_pendingBlocks.size() + m_inFlightBlocks.size() < WRITE_BEHIND_MAX_PENDING_BLOCKS; });
+		if (m_error != 0)
+			return m_error;
+
+		Block block;
+		if (!m_freeBuffers.empty())
+		{
+			block.data = m_freeBuffers.back();
+			m_freeBuffers.pop_back();
+		}
+		else if (posix_memalign((void**)&block.data, BLOCK_ALIGNMENT, WRITE_BEHIND_BUFFER_SIZE) != 0)
+		{
+			return AVERROR(ENOMEM);
+		}
+
+		block.size = std::min(size - written, WRITE_BEHIND_BLOCK_SIZE);
+		block.offset = m_base + m_position;
+
+		size_t head = m_cacheMode == CacheMode::Direct ? block.offset % BLOCK_ALIGNMENT : 0;
+		memcpy(block.data + head, buf + written, block.size);
+
+		m_pendingBlocks.push_back(block);
+		m_position += block.size;
+		m_size = std::max(m_size, m_position);
+		written += block.size;
+
+		lock.unlock();
+		m_blockQueued.notify_one();
+	}
+
+	return written;
+}
+
+int64_t WriteBehindFile::seek(int64_t offset, int whence)
+{
+	// Blocks remember their own offset, so there is no need to wait
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	switch (whence & ~AVSEEK_FORCE)
+	{
+		case AVSEEK_SIZE:
+			return m_size;
+		case SEEK_SET:
+			break;
+		case SEEK_CUR:
+			offset += m_position;
+			break;
+		case SEEK_END:
+			offset += m_size;
+			break;
+		default:
+			return AVERROR(EINVAL);
+	}
+
+	if (offset < 0)
+		return AVERROR(EINVAL);
+
+	m_position = offset;
+	return offset;
+}
+
+int WriteBehindFile::sync(bool durable)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_blockWritten.wait(lock, [&] { return m_error != 0 || (m_pendingBlocks.empty() && m_inFlightBlocks.empty()); });
+
+	if (m_error == 0 && durable && fsync(m_fd) != 0)
+		m_error = AVERROR(errno);
+
+	return m_error;
+}
+
+int WriteBehindFile::close()
+{
+	int r = sync(false);
+
+	// Remove the padding after the last sector written in direct mode
+	if (r == 0 && m_cacheMode == CacheMode::Direct && ftruncate(m_fd, m_base + m_size) != 0)
+		r = AVERROR(errno);
+
+	if (::close(m_fd) != 0 && r == 0)
+		r = AVERROR(errno);
+	m_fd = -1;
+
+	return r;
+}
+
+// Returns the range of the file that is written for a block, which is
+// extended to whole sectors in direct mode
+std::pair<int64_t, int64_t> WriteBehindFile::writtenRange(const Block &block) const
+{
+	int64_t start = block.offset;
+	int64_t end = block.offset + block.size;
+
+	if (m_cacheMode == CacheMode::Direct)
+	{
+		start &= ~(int64_t)(BLOCK_ALIGNMENT - 1);
+		end = (end + BLOCK_ALIGNMENT - 1) & ~(int64_t)(BLOCK_ALIGNMENT - 1);
+	}
+
+	return { start, end };
+}
+
+// In direct mode, fills the bytes of the first and the last sector that are
+// not part of the block with the current contents of the file, so that writing
+// the whole sectors does not change them
+int WriteBehindFile::fillPadding(const Block &block)
+{
+	if (m_cacheMode != CacheMode::Direct)
+		return 0;
+
+	auto [start, end] = writtenRange(block);
+	size_t head = block.offset - start;
+	size_t tail = head + block.size;
+
+	if (head != 0)
+	{
+		int r = readSector(start);
+		if (r < 0)
+			return r;
+
+		memcpy(block.data, m_sectorBuffer, head);
+	}
+
+	if (tail != (size_t)(end - start))
+	{
+		int r = readSector(end - BLOCK_ALIGNMENT);
+		if (r < 0)
+			return r;
+
+		size_t offsetInSector = tail % BLOCK_ALIGNMENT;
+		memcpy(block.data + tail, m_sectorBuffer + offsetInSector, BLOCK_ALIGNMENT - offsetInSector);
+	}
+
+	return 0;
+}
+
+int WriteBehindFile::readSector(int64_t offset)
+{
+	// Bytes past the end of the file are zeros
+	memset(m_sectorBuffer, 0, BLOCK_ALIGNMENT);
+
+	if (pread(m_fd, m_sectorBuffer, BLOCK_ALIGNMENT, offset) < 0)
+		return AVERROR(errno);
+
+	return 0;
+}
+
+void WriteBehindFile::writerMain()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	auto overlapsInFlightBlocks = [&](const Block &block)
+	{
+		auto [start, end] = writtenRange(block);
+		for (const Block &other : m_inFlightBlocks)
+		{
+			auto [otherStart, otherEnd] = writtenRange(other);
+			if (start < otherEnd && otherStart < end)
+				return true;
+		}
+
+		return false;
+	};
+
+	while (true)
+	{
+		// Submit blocks in order. A block that overlaps a block that is
+		// still being written (e.g. a header being rewritten after a seek)
+		// waits for it, so that writes are applied in the right order.
+		// In direct mode, this also applies to blocks sharing a sector, so
+		// that the padding is read after the previous write has completed.
+		while (m_error == 0 && !m_pendingBlocks.empty() && !overlapsInFlightBlocks(m_pendingBlocks.front()))
+		{
+			Block block = m_pendingBlocks.front();
+			m_pendingBlocks.pop_front();
+			m_inFlightBlocks.push_back(block);
+
+			auto [start, end] = writtenRange(block);
+
+			// The blocking backend performs the write right away
+			lock.unlock();
+			int r = fillPadding(block);
+			if (r == 0)
+				m_ioQueue->submitWrite(m_fd, block.data, end - start, start, block.data);
+			lock.lock();
+
+			if (r < 0)
+			{
+				m_inFlightBlocks.pop_back();
+				m_freeBuffers.push_back(block.data);
+				m_error = r;
+				m_blockWritten.notify_all();
+			}
+		}
+
+		if (m_inFlightBlocks.empty())
+		{
+			if (m_stopping)
+				break;
+
+			m_blockQueued.wait(lock, [&] { return m_stopping || (m_error == 0 && !m_pendingBlocks.empty()); });
+			continue;
+		}
+
+		lock.unlock();
+		auto [tag, result] = m_ioQueue->waitCompletion();
+		lock.lock();
+
+		auto it = std::find_if(m_inFlightBlocks.begin(), m_inFlightBlocks.end(), [&](const Block &b) { return b.data == tag; });
+
+		if (m_cacheMode == CacheMode::DropBehind && result >= 0)
+		{
+			// Dirty pages cannot be dropped, so wait until they are on disk.
+			// The block is still in flight, so the file cannot be closed
+			// meanwhile, and only this thread modifies m_inFlightBlocks.
+			lock.unlock();
+			sync_file_range(m_fd, it->offset, it->size, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(m_fd, it->offset, it->size, POSIX_FADV_DONTNEED);
+			lock.lock();
+		}
+
+		m_freeBuffers.push_back(it->data);
+		m_inFlightBlocks.erase(it);
+
+		if (result < 0 && m_error == 0)
+			m_error = result;
+
+		m_blockWritten.notify_all();
+	}
+}
+
+static int readPacketCallback(void *opaque, uint8_t *buf, int size)
+{
+	return ((ReadAheadFile*)opaque)->read(buf, size);
+}
+
+static int64_t readAheadSeekCallback(void *opaque, int64_t offset, int whence)
+{
+	return ((ReadAheadFile*)opaque)->seek(offset, whence);
+}
+
+static int writePacketCallback(void *opaque, uint8_t *buf, int size)
+{
+	return ((WriteBehindFile*)opaque)->write(buf, size);
+}
+
+static int64_t writeBehindSeekCallback(void *opaque, int64_t offset, int whence)
+{
+	return ((WriteBehindFile*)opaque)->seek(offset, whence);
+}
+
+// Opens filename with O_DIRECT if direct I/O is enabled, the filesystem
+// supports it and directAllowed is set
+static int openFile(const char *filename, int flags, CacheMode *cacheMode, bool directAllowed = true)
+{
+	*cacheMode = CacheMode::Normal;
+
+	if (directIoEnabled && !directAllowed)
+	{
+		*cacheMode = CacheMode::DropBehind;
+	}
+	else if (directIoEnabled)
+	{
+		int fd = open(filename, flags | O_DIRECT, 0666);
+		if (fd != -1 || errno != EINVAL)
+		{
+			*cacheMode = CacheMode::Direct;
+			return fd;
+		}
+
+		logDebug("O_DIRECT is not supported for %s, dropping its pages from the cache after use\n", filename);
+		*cacheMode = CacheMode::DropBehind;
+	}
+
+	return open(filename, flags, 0666);
+}
+
+int openReadAhead(AVIOContext **pb, const char *filename, size_t readAheadSize)
+{
+	CacheMode cacheMode;
+	int fd = openFile(filename, O_RDONLY | O_CLOEXEC, &cacheMode);
+	if (fd == -1)
+		return AVERROR(errno);
+
+	unsigned char *buffer = (unsigned char*)av_malloc(READ_AHEAD_AVIO_BUFFER_SIZE);
+	if (buffer == nullptr)
+	{
+		close(fd);
+		return AVERROR(ENOMEM);
+	}
+
+	ReadAheadFile *file = new ReadAheadFile(fd, readAheadSize, cacheMode);
+
+	*pb = avio_alloc_context(buffer, READ_AHEAD_AVIO_BUFFER_SIZE, 0, file, readPacketCallback, nullptr, readAheadSeekCallback);
+	if (*pb == nullptr)
+	{
+		delete file;
+		av_free(buffer);
+		return AVERROR(ENOMEM);
+	}
+
+	return 0;
+}
+
+int closeReadAhead(AVIOContext **pb)
+{
+	if (*pb == nullptr)
+		return 0;
+
+	ReadAheadFile *file = (ReadAheadFile*)(*pb)->opaque;
+	int r = (*pb)->error < 0 ? (*pb)->error : file->error();
+	delete file;
+
+	av_freep(&(*pb)->buffer);
+	avio_context_free(pb);
+
+	return r;
+}
+
+int openInputFormat(AVFormatContext **formatContext, const char *filename, size_t readAheadSize)
+{
+	AVIOContext *pb;
+	int r = openReadAhead(&pb, filename, readAheadSize);
+	if (r < 0)
+		return r;
+
+	*formatContext = avformat_alloc_context();
+	if (*formatContext == nullptr)
+	{
+		closeReadAhead(&pb);
+		return AVERROR(ENOMEM);
+	}
+
+	(*formatContext)->pb = pb;
+	(*formatContext)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	r = avformat_open_input(formatContext, filename, nullptr, nullptr);
+	if (r < 0) // formatContext has already been freed
+		closeReadAhead(&pb);
+
+	return r;
+}
+
+void closeInputFormat(AVFormatContext **formatContext)
+{
+	if (*formatContext == nullptr)
+		return;
+
+	AVIOContext *pb = (*formatContext)->pb;
+	avformat_close_input(formatContext);
+	closeReadAhead(&pb);
+}
+
+static int openWriteBehindFile(AVIOContext **pb, const char *filename, int flags, int64_t base, bool directAllowed)
+{
+	// Direct mode needs to read back the sectors that are partially written
+	CacheMode cacheMode;
+	int fd = openFile(filename, (directIoEnabled && directAllowed ? O_RDWR : O_WRONLY) | flags | O_CLOEXEC, &cacheMode, directAllowed);
+	if (fd == -1)
+		return AVERROR(errno);
+
+	unsigned char *buffer = (unsigned char*)av_malloc(WRITE_BEHIND_BLOCK_SIZE);
+	if (buffer == nullptr)
+	{
+		close(fd);
+		return AVERROR(ENOMEM);
+	}
+
+	WriteBehindFile *file = new WriteBehindFile(fd, cacheMode, base);
+
+	*pb = avio_alloc_context(buffer, WRITE_BEHIND_BLOCK_SIZE, 1, file, nullptr, writePacketCallback, writeBehindSeekCallback);
+	if (*pb == nullptr)
+	{
+		delete file;
+		av_free(buffer);
+		return AVERROR(ENOMEM);
+	}
+
+	return 0;
+}
+
+int openWriteBehind(AVIOContext **pb, const char *filename)
+{
+	return openWriteBehindFile(pb, filename, O_CREAT | O_TRUNC, 0, true);
+}
+
+int openWriteBehindAt(AVIOContext **pb, const char *filename, int64_t offset)
+{
+	// Direct writes of the sectors shared with the neighboring ranges would
+	// overwrite them with what they contained when their padding was read
+	return openWriteBehindFile(pb, filename, O_CREAT, offset, false);
+}
+
+int syncWriteBehind(AVIOContext *pb, bool durable)
+{
+	avio_flush(pb);
+	if (pb->error < 0)
+		return pb->error;
+
+	return ((WriteBehindFile*)pb->opaque)->sync(durable);
+}
+
+int closeWriteBehind(AVIOContext **pb)
+{
+	if (*pb == nullptr)
+		return 0;
+
+	avio_flush(*pb);
+	int r = (*pb)->error;
+
+	WriteBehindFile *file = (WriteBehindFile*)(*pb)->opaque;
+	int closeResult = file->close();
+	if (r >= 0)
+		r = closeResult;
+
+	delete file;
+
+	av_freep(&(*pb)->buffer);
+	avio_context_free(pb);
+
+	return r;
+}
+
+void setDirectIo(bool enabled)
+{
+	directIoEnabled = enabled;
+}
@@ -0,0 +1,60 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include "libav.h"
+
+// Opens filename for reading through an AVIOContext that is fed by a
+// background thread, which reads sequentially up to readAheadSize bytes past
+// the current position using large requests. Seeking outside of the data that
+// has already been read restarts the read-ahead from the new position.
+int openReadAhead(AVIOContext **pb, const char *filename, size_t readAheadSize);
+int closeReadAhead(AVIOContext **pb);
+
+// Same as avformat_open_input and avformat_close_input, but the file is read
+// through openReadAhead
+int openInputFormat(AVFormatContext **formatContext, const char *filename, size_t readAheadSize);
+void closeInputFormat(AVFormatContext **formatContext);
+
+// Opens filename for writing (truncating it) through an AVIOContext whose
+// buffers are written by a background thread, so that the caller only blocks
+// if too much data is waiting to be written. Seeking is supported. Write
+// errors are reported by the next write, syncWriteBehind or closeWriteBehind
+// call. Return values follow the avio_open/avio_closep convention.
+int openWriteBehind(AVIOContext **pb, const char *filename);
+
+// Same as openWriteBehind, but the file is not truncated, and position 0 of
+// the AVIOContext is at offset in the file. Distinct ranges of the same file
+// can then be written at the same time, through several AVIOContexts. Direct
+// I/O is never used: if it is enabled, the pages are only dropped from the
+// cache after use.
+int openWriteBehindAt(AVIOContext **pb, const char *filename, int64_t offset);
+
+// Waits until all the data written so far has been handed to the kernel and,
+// if durable is true, until it has been stored on disk
+int syncWriteBehind(AVIOContext *pb, bool durable);
+
+int closeWriteBehind(AVIOContext **pb);
+
+// Makes the files opened from now on by openReadAhead and openWriteBehind
+// bypass the page cache (O_DIRECT). On filesystems that do not support it,
+// they go through the page cache but their pages are dropped after use.
+void setDirectIo(bool enabled);
+
+#endif
@@ -0,0 +1,742 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "imagesequence.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <map>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavutil/intreadwrite.h>
+}
+
+// Same default as the image2 demuxer
+static constexpr AVRational IMAGE_SEQUENCE_FRAME_RATE = { 25, 1 };
+
+// Size of the AVIOContext buffer of concatenated files
+static constexpr int SEQUENCE_AVIO_BUFFER_SIZE = 1024 * 1024;
+
+// Size of the reads performed while hashing files that are not images
+static constexpr int64_t SEQUENCE_HASH_BUFFER_SIZE = 1024 * 1024;
+
+// Location and format of the pixel data in an image file
+struct ImageLayout
+{
+	int64_t pixelOffset;
+	int width, height;
+	AVPixelFormat format;
+};
+
+// Reads exactly size bytes, returns 0 or an AVERROR code
+static int readAt(int fd, int64_t offset, void *buf, size_t size)
+{
+	uint8_t *dest = (uint8_t*)buf;
+
+	while (size != 0)
+	{
+		ssize_t r = pread(fd, dest, size, offset);
+		if (r < 0)
+			return AVERROR(errno);
+		else if (r == 0)
+			return AVERROR_EOF;
+
+		dest += r;
+		offset += r;
+		size -= r;
+	}
+
+	return 0;
+}
+
+// Uncompressed BMP, without row padding. Bottom-up images (the most common
+// ones) are encoded upside down, which makes no difference once restored.
+static bool probeBMP(int fd, ImageLayout *layout)
+{
+	uint8_t h[54];
+	if (readAt(fd, 0, h, sizeof(h)) != 0 || h[0] != 'B' || h[1] != 'M' || AV_RL32(h + 14) < 40)
+		return false;
+
+	int32_t width = AV_RL32(h + 18), height = AV_RL32(h + 22);
+	int bitsPerPixel = AV_RL16(h + 28);
+	if (AV_RL16(h + 26) != 1 || AV_RL32(h + 30) != 0 /* BI_RGB */ || width <= 0 || height == 0 || height == INT32_MIN)
+		return false;
+
+	if (bitsPerPixel == 24)
+		layout->format = AV_PIX_FMT_BGR24;
+	else if (bitsPerPixel == 32)
+		layout->format = AV_PIX_FMT_BGRA;
+	else
+		return false;
+
+	// Rows are padded to multiples of 4 bytes
+	if ((int64_t)width * bitsPerPixel / 8 % 4 != 0)
+		return false;
+
+	layout->pixelOffset = AV_RL32(h + 10);
+	layout->width = width;
+	layout->height = height < 0 ? -height : height;
+	return true;
+}
+
+// Uncompressed true-color or grayscale TGA, without color map
+static bool probeTGA(int fd, ImageLayout *layout)
+{
+	uint8_t h[18];
+	if (readAt(fd, 0, h, sizeof(h)) != 0 || h[1] != 0)
+		return false;
+
+	int imageType = h[2], bitsPerPixel = h[16];
+	if (imageType == 2 && bitsPerPixel == 16)
+		layout->format = AV_PIX_FMT_RGB555LE;
+	else if (imageType == 2 && bitsPerPixel == 24)
+		layout->format = AV_PIX_FMT_BGR24;
+	else if (imageType == 2 && bitsPerPixel == 32)
+		layout->format = AV_PIX_FMT_BGRA;
+	else if (imageType == 3 && bitsPerPixel == 8)
+		layout->format = AV_PIX_FMT_GRAY8;
+	else
+		return false;
+
+	layout->pixelOffset = sizeof(h) + h[0];
+	layout->width = AV_RL16(h + 12);
+	layout->height = AV_RL16(h + 14);
+	return true;
+}
+
+// DPX with a single 8 or 16 bit image element (10 and 12 bit packed samples
+// do not map to any pixel format)
+static bool probeDPX(int fd, ImageLayout *layout)
+{
+	uint8_t h[808];
+	if (readAt(fd, 0, h, sizeof(h)) != 0)
+		return false;
+
+	bool bigEndian;
+	if (AV_RB32(h) == MKBETAG('S', 'D', 'P', 'X'))
+		bigEndian = true;
+	else if (AV_RB32(h) == MKBETAG('X', 'P', 'D', 'S'))
+		bigEndian = false;
+	else
+		return false;
+
+	auto r16 = [&](int offset) { return bigEndian ? AV_RB16(h + offset) : AV_RL16(h + offset); };
+	auto r32 = [&](int offset) { return bigEndian ? AV_RB32(h + offset) : AV_RL32(h + offset); };
+
+	int descriptor = h[800], bitDepth = h[803];
+	if (r16(770) != 1 /* element count */ || r16(806) != 0 /* encoding */)
+		return false;
+
+	if (descriptor == 50 && bitDepth == 8)
+		layout->format = AV_PIX_FMT_RGB24;
+	else if (descriptor == 50 && bitDepth == 16)
+		layout->format = bigEndian ? AV_PIX_FMT_RGB48BE : AV_PIX_FMT_RGB48LE;
+	else if (descriptor == 51 && bitDepth == 8)
+		layout->format = AV_PIX_FMT_RGBA;
+	else if (descriptor == 51 && bitDepth == 16)
+		layout->format = bigEndian ? AV_PIX_FMT_RGBA64BE : AV_PIX_FMT_RGBA64LE;
+	else if (descriptor == 6 && bitDepth == 8)
+		layout->format = AV_PIX_FMT_GRAY8;
+	else if (descriptor == 6 && bitDepth == 16)
+		layout->format = bigEndian ? AV_PIX_FMT_GRAY16BE : AV_PIX_FMT_GRAY16LE;
+	else
+		return false;
+
+	layout->pixelOffset = r32(4);
+	layout->width = r32(772);
+	layout->height = r32(776);
+	return layout->width > 0 && layout->height > 0;
+}
+
+// Uncompressed, chunky TIFF whose strips are stored contiguously
+static bool probeTIFF(int fd, ImageLayout *layout)
+{
+	uint8_t h[8];
+	if (readAt(fd, 0, h, sizeof(h)) != 0)
+		return false;
+
+	bool bigEndian;
+	if (memcmp(h, "II*\0", 4) == 0)
+		bigEndian = false;
+	else if (memcmp(h, "MM\0*", 4) == 0)
+		bigEndian = true;
+	else
+		return false;
+
+	auto r16 = [&](const uint8_t *p) { return bigEndian ? AV_RB16(p) : AV_RL16(p); };
+	auto r32 = [&](const uint8_t *p) { return bigEndian ? AV_RB32(p) : AV_RL32(p); };
+
+	uint32_t ifdOffset = r32(h + 4);
+	uint8_t countBuffer[2];
+	if (readAt(fd, ifdOffset, countBuffer, 2) != 0)
+		return false;
+
+	std::vector<uint8_t> entries(12 * r16(countBuffer));
+	if (readAt(fd, ifdOffset + 2, entries.data(), entries.size()) != 0)
+		return false;
+
+	// Values of SHORT or LONG fields, which are stored in the entry itself
+	// if they fit
+	auto readValues = [&](const uint8_t *entry, std::vector<uint32_t> *values)
+	{
+		int type = r16(entry + 2);
+		uint32_t count = r32(entry + 4);
+		int size = type == 3 ? 2 : type == 4 ? 4 : 0;
+		if (size == 0 || count == 0 || count > 1024 * 1024)
+			return false;
+
+		std::vector<uint8_t> data(size * count);
+		if (data.size() <= 4)
+			memcpy(data.data(), entry + 8, data.size());
+		else if (readAt(fd, r32(entry + 8), data.data(), data.size()) != 0)
+			return false;
+
+		for (uint32_t i = 0; i < count; i++)
+			values->push_back(size == 2 ? r16(&data[2 * i]) : r32(&data[4 * i]));
+
+		return true;
+	};
+
+	std::map<int, std::vector<uint32_t>> fields;
+	for (size_t i = 0; i < entries.size(); i += 12)
+	{
+		int tag = r16(&entries[i]);
+		if (tag == 256 || tag == 257 || tag == 258 || tag == 259 || tag == 262 || tag == 273 || tag == 277 || tag == 279 || tag == 284)
+		{
+			if (!readValues(&entries[i], &fields[tag]))
+				return false;
+		}
+	}
+
+	auto field = [&](int tag, uint32_t defaultValue) { return fields.count(tag) != 0 ? fields[tag][0] : defaultValue; };
+
+	if (fields.count(256) == 0 || fields.count(257) == 0 || fields.count(258) == 0 || fields.count(273) == 0 || fields.count(279) == 0)
+		return false;
+	if (field(259, 1) != 1 /* compression */ || field(284, 1) != 1 /* planar configuration */)
+		return false;
+
+	const std::vector<uint32_t> &bitsPerSample = fields[258];
+	if (std::any_of(bitsPerSample.begin(), bitsPerSample.end(), [&](uint32_t b) { return b != bitsPerSample[0]; }))
+		return false;
+
+	int photometric = field(262, 0), samplesPerPixel = field(277, 1), bitDepth = bitsPerSample[0];
+	if (photometric == 2 && samplesPerPixel == 3 && bitDepth == 8)
+		layout->format = AV_PIX_FMT_RGB24;
+	else if (photometric == 2 && samplesPerPixel == 3 && bitDepth == 16)
+		layout->format = bigEndian ? AV_PIX_FMT_RGB48BE : AV_PIX_FMT_RGB48LE;
+	else if (photometric == 2 && samplesPerPixel == 4 && bitDepth == 8)
+		layout->format = AV_PIX_FMT_RGBA;
+	else if (photometric == 2 && samplesPerPixel == 4 && bitDepth == 16)
+		layout->format = bigEndian ? AV_PIX_FMT_RGBA64BE : AV_PIX_FMT_RGBA64LE;
+	else if (photometric == 1 && samplesPerPixel == 1 && bitDepth == 8)
+		layout->format = AV_PIX_FMT_GRAY8;
+	else if (photometric == 1 && samplesPerPixel == 1 && bitDepth == 16)
+		layout->format = bigEndian ? AV_PIX_FMT_GRAY16BE : AV_PIX_FMT_GRAY16LE;
+	else
+		return false;
+
+	// All the strips must form a single block of pixel data
+	const std::vector<uint32_t> &stripOffsets = fields[273], &stripByteCounts = fields[279];
+	if (stripOffsets.size() != stripByteCounts.size())
+		return false;
+
+	for (size_t i = 1; i < stripOffsets.size(); i++)
+	{
+		if ((int64_t)stripOffsets[i - 1] + stripByteCounts[i - 1] != stripOffsets[i])
+			return false;
+	}
+
+	layout->pixelOffset = stripOffsets[0];
+	layout->width = field(256, 0);
+	layout->height = field(257, 0);
+	return layout->width > 0 && layout->height > 0;
+}
+
+// Returns the location of the pixel data, if filename is an uncompressed
+// image whose pixel data can be read as a single rawvideo frame
+static bool probeImage(int fd, const std::string &filename, int64_t fileSize, ImageLayout *layout, int *pixelSize)
+{
+	const char *extension = strrchr(filename.c_str(), '.');
+	if (extension == nullptr)
+		return false;
+
+	bool supported;
+	if (strcasecmp(extension, ".bmp") == 0)
+		supported = probeBMP(fd, layout);
+	else if (strcasecmp(extension, ".tga") == 0)
+		supported = probeTGA(fd, layout);
+	else if (strcasecmp(extension, ".dpx") == 0)
+		supported = probeDPX(fd, layout);
+	else if (strcasecmp(extension, ".tif") == 0 || strcasecmp(extension, ".tiff") == 0)
+		supported = probeTIFF(fd, layout);
+	else
+		supported = false;
+
+	if (!supported)
+		return false;
+
+	// The whole file becomes the packet's buffer
+	*pixelSize = av_image_get_buffer_size(layout->format, layout->width, layout->height, 1);
+	return *pixelSize > 0 && fileSize <= INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE &&
+		layout->pixelOffset + *pixelSize <= fileSize;
+}
+
+ImageSequence *ImageSequence::open(const char *directory, const char *hashName)
+{
+	DIR *dir = opendir(directory);
+	if (dir == nullptr)
+		logError("opendir: %s: %s\n", directory, strerror(errno));
+
+	std::vector<std::string> names;
+	while (const struct dirent *entry = readdir(dir))
+	{
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+			names.push_back(entry->d_name);
+	}
+
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+
+	ImageSequence *sequence = new ImageSequence(directory, hashName);
+	ImageLayout streamLayout = {};
+	int imageCount = 0;
+	bool mismatchWarningShown = false;
+
+	for (const std::string &name : names)
+	{
+		std::string path = sequence->m_directory + "/" + name;
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			logError("open: %s: %s\n", path.c_str(), strerror(errno));
+
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+			logError("fstat: %s: %s\n", path.c_str(), strerror(errno));
+
+		if (!S_ISREG(st.st_mode))
+		{
+			logWarning("Ignoring %s: not a regular file\n", path.c_str());
+			close(fd);
+			continue;
+		}
+
+		SequenceFile file;
+		file.name = name;
+		file.size = st.st_size;
+
+		Image image = { -1, 0 };
+		ImageLayout layout;
+		int pixelSize;
+		if (probeImage(fd, name, st.st_size, &layout, &pixelSize))
+		{
+			if (imageCount == 0)
+				streamLayout = layout;
+
+			if (layout.width == streamLayout.width && layout.height == streamLayout.height && layout.format == streamLayout.format)
+			{
+				image.pixelOffset = layout.pixelOffset;
+				image.pixelSize = pixelSize;
+				imageCount++;
+			}
+			else if (!mismatchWarningShown)
+			{
+				logWarning("%s: image size or format differs from the first image, storing it uncompressed\n", path.c_str());
+				mismatchWarningShown = true;
+			}
+		}
+
+		close(fd);
+
+		sequence->m_files.push_back(file);
+		sequence->m_images.push_back(image);
+	}
+
+	if (imageCount == 0)
+		logError("No supported uncompressed images found in %s\n", directory);
+
+	logDebug("Image sequence: %zu files, %d images %dx%d %s\n", sequence->m_files.size(), imageCount,
+		streamLayout.width, streamLayout.height, av_get_pix_fmt_name(streamLayout.format));
+
+	AVFormatContext *formatContext = avformat_alloc_context();
+	if (formatContext == nullptr)
+		logError("avformat_alloc_context failed\n");
+
+	AVStream *stream = avformat_new_stream(formatContext, nullptr);
+	if (stream == nullptr)
+		logError("avformat_new_stream failed\n");
+
+	stream->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+	stream->codecpar->codec_id = AV_CODEC_ID_RAWVIDEO;
+	stream->codecpar->format = streamLayout.format;
+	stream->codecpar->width = streamLayout.width;
+	stream->codecpar->height = streamLayout.height;
+	stream->time_base = av_inv_q(IMAGE_SEQUENCE_FRAME_RATE);
+	stream->avg_frame_rate = stream->r_frame_rate = IMAGE_SEQUENCE_FRAME_RATE;
+	stream->duration = imageCount;
+
+	failOnAVERROR(openSequenceInput(&formatContext->pb, directory, sequence->m_files), "openSequenceInput: %s", directory);
+	formatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	sequence->m_formatContext = formatContext;
+	return sequence;
+}
+
+ImageSequence::ImageSequence(const char *directory, const char *hashName)
+: m_directory(directory), m_hashName(hashName), m_formatContext(nullptr),
+  m_nextFile(0), m_nextFileOffset(0), m_nextPts(0)
+{
+}
+
+ImageSequence::~ImageSequence()
+{
+	if (m_formatContext != nullptr)
+	{
+		closeSequenceFiles(&m_formatContext->pb);
+		avformat_free_context(m_formatContext);
+	}
+}
+
+AVFormatContext *ImageSequence::formatContext() const
+{
+	return m_formatContext;
+}
+
+const std::vector<SequenceFile> &ImageSequence::files() const
+{
+	return m_files;
+}
+
+int ImageSequence::readPacket(AVPacket *packet)
+{
+	static unsigned char hashBuffer[SEQUENCE_HASH_BUFFER_SIZE];
+
+	while (m_nextFile != m_files.size())
+	{
+		SequenceFile &file = m_files[m_nextFile];
+		const Image &image = m_images[m_nextFile];
+		int64_t fileOffset = m_nextFileOffset;
+
+		m_nextFile++;
+		m_nextFileOffset += file.size;
+
+		std::string path = m_directory + "/" + file.name;
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			return AVERROR(errno);
+
+		AVHashContext *hashCtx;
+		failOnAVERROR(av_hash_alloc(&hashCtx, m_hashName.c_str()), "av_hash_alloc");
+		av_hash_init(hashCtx);
+
+		// Images are read at once into the packet's buffer, the other files
+		// are only hashed
+		AVBufferRef *buffer = nullptr;
+		int r = 0;
+
+		if (image.pixelOffset != -1)
+		{
+			buffer = av_buffer_alloc(file.size + AV_INPUT_BUFFER_PADDING_SIZE);
+			if (buffer == nullptr)
+				r = AVERROR(ENOMEM);
+			else
+				r = readAt(fd, 0, buffer->data, file.size);
+
+			if (r == 0)
+			{
+				memset(buffer->data + file.size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+				av_hash_update(hashCtx, buffer->data, file.size);
+			}
+		}
+		else
+		{
+			for (int64_t pos = 0; pos != file.size && r == 0;)
+			{
+				int64_t size = std::min(SEQUENCE_HASH_BUFFER_SIZE, file.size - pos);
+				r = readAt(fd, pos, hashBuffer, size);
+				av_hash_update(hashCtx, hashBuffer, size);
+				pos += size;
+			}
+		}
+
+		close(fd);
+
+		file.hashBuffer.resize(av_hash_get_size(hashCtx));
+		av_hash_final(hashCtx, file.hashBuffer.data());
+		av_hash_freep(&hashCtx);
+
+		if (r < 0)
+		{
+			av_buffer_unref(&buffer);
+			return r == AVERROR_EOF ? AVERROR(EIO) : r; // the file has been truncated meanwhile
+		}
+
+		if (buffer != nullptr)
+		{
+			packet->buf = buffer;
+			packet->data = buffer->data + image.pixelOffset;
+			packet->size = image.pixelSize;
+			packet->stream_index = 0;
+			packet->pos = fileOffset + image.pixelOffset;
+			packet->pts = packet->dts = m_nextPts++;
+			packet->duration = 1;
+			packet->flags |= AV_PKT_FLAG_KEY;
+			return 0;
+		}
+	}
+
+	return AVERROR_EOF;
+}
+
+// Presents the files of a sequence as if they were concatenated
+class ConcatenatedFiles
+{
+	public:
+		ConcatenatedFiles(const char *directory, const std::vector<SequenceFile> &files, bool write, int onlyFile);
+		~ConcatenatedFiles();
+
+		int read(uint8_t *buf, int size);
+		int write(const uint8_t *buf, int size);
+		int64_t seek(int64_t offset, int whence);
+
+	private:
+		size_t fileAt(int64_t position) const;
+		int selectFile(size_t index);
+
+		std::string m_directory;
+		std::vector<std::string> m_names;
+		std::vector<int64_t> m_offsets; // start of each file, followed by the total size
+		bool m_write;
+		int m_onlyFile;
+
+		int m_fd; // of file m_fdIndex
+		size_t m_fdIndex;
+		int64_t m_position;
+};
+
+ConcatenatedFiles::ConcatenatedFiles(const char *directory, const std::vector<SequenceFile> &files, bool write, int onlyFile)
+: m_directory(directory), m_write(write), m_onlyFile(onlyFile), m_fd(-1), m_fdIndex(0), m_position(0)
+{
+	int64_t offset = 0;
+	for (const SequenceFile &file : files)
+	{
+		m_names.push_back(file.name);
+		m_offsets.push_back(offset);
+		offset += file.size;
+	}
+
+	m_offsets.push_back(offset);
+}
+
+ConcatenatedFiles::~ConcatenatedFiles()
+{
+	if (m_fd != -1)
+		close(m_fd);
+}
+
+size_t ConcatenatedFiles::fileAt(int64_t position) const
+{
+	// Empty files are skipped, because the next file starts at the same offset
+	return std::upper_bound(m_offsets.begin(), m_offsets.end() - 1, position) - m_offsets.begin() - 1;
+}
+
+int ConcatenatedFiles::selectFile(size_t index)
+{
+	if (m_fd != -1 && m_fdIndex == index)
+		return 0;
+
+	if (m_fd != -1)
+		close(m_fd);
+
+	std::string path = m_directory + "/" + m_names[index];
+	m_fd = open(path.c_str(), (m_write ? O_WRONLY : O_RDONLY) | O_CLOEXEC);
+	m_fdIndex = index;
+
+	return m_fd != -1 ? 0 : AVERROR(errno);
+}
+
+int ConcatenatedFiles::read(uint8_t *buf, int size)
+{
+	if (m_position >= m_offsets.back())
+		return AVERROR_EOF;
+
+	size_t index = fileAt(m_position);
+	int r = selectFile(index);
+	if (r < 0)
+		return r;
+
+	int64_t n = std::min<int64_t>(size, m_offsets[index + 1] - m_position);
+	ssize_t result = pread(m_fd, buf, n, m_position - m_offsets[index]);
+	if (result < 0)
+		return AVERROR(errno);
+	else if (result == 0)
+		return AVERROR_EOF; // the file is shorter than expected
+
+	m_position += result;
+	return result;
+}
+
+int ConcatenatedFiles::write(const uint8_t *buf, int size)
+{
+	int written = 0;
+
+	while (written != size)
+	{
+		if (m_position >= m_offsets.back())
+			return AVERROR(EINVAL);
+
+		size_t index = fileAt(m_position);
+		int64_t n = std::min<int64_t>(size - written, m_offsets[index + 1] - m_position);
+
+		if (m_onlyFile == -1 || index == (size_t)m_onlyFile)
+		{
+			int r = selectFile(index);
+			if (r < 0)
+				return r;
+
+			for (int64_t done = 0; done != n;)
+			{
+				ssize_t result = pwrite(m_fd, buf + written + done, n - done, m_position - m_offsets[index] + done);
+				if (result < 0)
+					return AVERROR(errno);
+
+				done += result;
+			}
+		}
+
+		m_position += n;
+		written += n;
+	}
+
+	return written;
+}
+
+int64_t ConcatenatedFiles::seek(int64_t offset, int whence)
+{
+	switch (whence & ~AVSEEK_FORCE)
+	{
+		case AVSEEK_SIZE:
+			return m_offsets.back();
+		case SEEK_SET:
+			break;
+		case SEEK_CUR:
+			offset += m_position;
+			break;
+		case SEEK_END:
+			offset += m_offsets.back();
+			break;
+		default:
+			return AVERROR(EINVAL);
+	}
+
+	if (offset < 0)
+		return AVERROR(EINVAL);
+
+	m_position = offset;
+	return offset;
+}
+
+static int concatenatedReadCallback(void *opaque, uint8_t *buf, int size)
+{
+	return ((ConcatenatedFiles*)opaque)->read(buf, size);
+}
+
+static int concatenatedWriteCallback(void *opaque, uint8_t *buf, int size)
+{
+	return ((ConcatenatedFiles*)opaque)->write(buf, size);
+}
+
+static int64_t concatenatedSeekCallback(void *opaque, int64_t offset, int whence)
+{
+	return ((ConcatenatedFiles*)opaque)->seek(offset, whence);
+}
+
+static int openConcatenatedFiles(AVIOContext **pb, ConcatenatedFiles *files, bool write)
+{
+	unsigned char *buffer = (unsigned char*)av_malloc(SEQUENCE_AVIO_BUFFER_SIZE);
+	if (buffer == nullptr)
+	{
+		delete files;
+		return AVERROR(ENOMEM);
+	}
+
+	*pb = avio_alloc_context(buffer, SEQUENCE_AVIO_BUFFER_SIZE, write, files,
+		write ? nullptr : concatenatedReadCallback, write ? concatenatedWriteCallback : nullptr, concatenatedSeekCallback);
+	if (*pb == nullptr)
+	{
+		delete files;
+		av_free(buffer);
+		return AVERROR(ENOMEM);
+	}
+
+	return 0;
+}
+
+int openSequenceInput(AVIOContext **pb, const char *directory, const std::vector<SequenceFile> &files)
+{
+	return openConcatenatedFiles(pb, new ConcatenatedFiles(directory, files, false, -1), false);
+}
+
+int openSequenceOutput(AVIOContext **pb, const char *directory, const std::vector<SequenceFile> &files, int onlyFile)
+{
+	if (mkdir(directory, 0777) != 0 && errno != EEXIST)
+		return AVERROR(errno);
+
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		// Names come from the LLR file, never write outside of directory
+		const std::string &name = files[i].name;
+		if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos)
+			return AVERROR_INVALIDDATA;
+
+		if (onlyFile != -1 && i != (size_t)onlyFile)
+			continue;
+
+		std::string path = std::string(directory) + "/" + name;
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (fd == -1)
+			return AVERROR(errno);
+
+		close(fd);
+	}
+
+	return openConcatenatedFiles(pb, new ConcatenatedFiles(directory, files, true, onlyFile), true);
+}
+
+int closeSequenceFiles(AVIOContext **pb)
+{
+	if (*pb == nullptr)
+		return 0;
+
+	avio_flush(*pb);
+	int r = (*pb)->error;
+
+	delete (ConcatenatedFiles*)(*pb)->opaque;
+
+	av_freep(&(*pb)->buffer);
+	avio_context_free(pb);
+
+	return r;
+}
@@ -0,0 +1,74 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMAGESEQUENCE_H
+#define IMAGESEQUENCE_H
+
+#include "llrfile.h"
+
+#include <string>
+#include <vector>
+
+// Directory of uncompressed images (BMP, TGA, DPX or TIFF), presented as a
+// single rawvideo stream whose packets are the pixel data of the images, in
+// name order. The "input file" is the concatenation of all the files, so that
+// headers end up in the LLR file as embedded chunks, like in any other file.
+//
+// Files that are not uncompressed images, or whose dimensions or pixel format
+// differ from the first image, produce no packet and are entirely embedded.
+class ImageSequence
+{
+	public:
+		static ImageSequence *open(const char *directory, const char *hashName);
+		~ImageSequence();
+
+		// Format context with the video stream, whose pb reads the
+		// concatenation of the files
+		AVFormatContext *formatContext() const;
+
+		// Same as av_read_frame. Also computes the hash of each file.
+		int readPacket(AVPacket *packet);
+
+		// Files in the sequence, whose hashes are only set after all the
+		// packets have been read
+		const std::vector<SequenceFile> &files() const;
+
+	private:
+		struct Image
+		{
+			int64_t pixelOffset; // within the file, -1 if not an image of the stream
+			int pixelSize;
+		};
+
+		ImageSequence(const char *directory, const char *hashName);
+
+		std::string m_directory, m_hashName;
+		std::vector<SequenceFile> m_files;
+		std::vector<Image> m_images;
+		AVFormatContext *m_formatContext;
+		size_t m_nextFile;
+		int64_t m_nextFileOffset, m_nextPts;
+};
+
+// Open the files of an image sequence as if they were concatenated. When
+// writing, directory and the files are created, and the data that falls in
+// files other than onlyFile is discarded, unless onlyFile is -1.
+int openSequenceInput(AVIOContext **pb, const char *directory, const std::vector<SequenceFile> &files);
+int openSequenceOutput(AVIOContext **pb, const char *directory, const std::vector<SequenceFile> &files, int onlyFile);
+int closeSequenceFiles(AVIOContext **pb);
+
+#endif
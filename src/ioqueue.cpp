@@ -0,0 +1,312 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ioqueue.h"
+
+#include "libav.h"
+#include "log.h"
+
+#include <deque>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#ifdef HAVE_LIBURING
+static IoQueue::Backend selectedBackend = IoQueue::IoUring;
+#else
+static IoQueue::Backend selectedBackend = IoQueue::Blocking;
+#endif
+
+IoQueue::~IoQueue()
+{
+}
+
+class BlockingIoQueue : public IoQueue
+{
+	public:
+		void submitRead(int fd, uint8_t *buf, size_t size, int64_t offset, void *tag) override;
+		void submitWrite(int fd, const uint8_t *buf, size_t size, int64_t offset, void *tag) override;
+		std::pair<void*, int64_t> waitCompletion() override;
+
+	private:
+		std::deque<std::pair<void*, int64_t>> m_completions;
+};
+
+void BlockingIoQueue::submitRead(int fd, uint8_t *buf, size_t size, int64_t offset, void *tag)
+{
+	size_t done = 0;
+
+	while (done != size)
+	{
+		ssize_t r = pread(fd, buf + done, size - done, offset + done);
+		if (r == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			m_completions.emplace_back(tag, AVERROR(errno));
+			return;
+		}
+		else if (r == 0)
+		{
+			break;
+		}
+
+		done += r;
+	}
+
+	m_completions.emplace_back(tag, done);
+}
+
+void BlockingIoQueue::submitWrite(int fd, const uint8_t *buf, size_t size, int64_t offset, void *tag)
+{
+	size_t done = 0;
+
+	while (done != size)
+	{
+		ssize_t r = pwrite(fd, buf + done, size - done, offset + done);
+		if (r == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			m_completions.emplace_back(tag, AVERROR(errno));
+			return;
+		}
+
+		done += r;
+	}
+
+	m_completions.emplace_back(tag, done);
+}
+
+std::pair<void*, int64_t> BlockingIoQueue::waitCompletion()
+{
+	std::pair<void*, int64_t> result = m_completions.front();
+	m_completions.pop_front();
+	return result;
+}
+
+#ifdef HAVE_LIBURING
+
+class IoUringQueue : public IoQueue
+{
+	public:
+		explicit IoUringQueue(size_t depth);
+		~IoUringQueue() override;
+
+		// Returns false if io_uring cannot be used (e.g. old kernel or
+		// blocked by a seccomp policy)
+		bool init();
+
+		void submitRead(int fd, uint8_t *buf, size_t size, int64_t offset, void *tag) override;
+		void submitWrite(int fd, const uint8_t *buf, size_t size, int64_t offset, void *tag) override;
+		std::pair<void*, int64_t> waitCompletion() override;
+
+	private:
+		struct Request
+		{
+			bool isWrite;
+			int fd;
+			uint8_t *buf;
+			size_t size, done;
+			int64_t offset;
+			void *tag;
+		};
+
+		void submit(Request *request);
+
+		size_t m_depth;
+		bool m_initialized;
+		struct io_uring m_ring;
+		std::vector<Request> m_requests;
+		std::vector<Request*> m_freeRequests;
+};
+
+IoUringQueue::IoUringQueue(size_t depth)
+: m_depth(depth), m_initialized(false), m_requests(depth)
+{
+	for (Request &request : m_requests)
+		m_freeRequests.push_back(&request);
+}
+
+IoUringQueue::~IoUringQueue()
+{
+	if (m_initialized)
+		io_uring_queue_exit(&m_ring);
+}
+
+bool IoUringQueue::init()
+{
+	int r = io_uring_queue_init(m_depth, &m_ring, 0);
+	if (r < 0)
+	{
+		logDebug("io_uring_queue_init failed (%s), falling back to blocking I/O\n", strerror(-r));
+		return false;
+	}
+
+	m_initialized = true;
+
+	// IORING_OP_READ and IORING_OP_WRITE require Linux 5.6
+	struct io_uring_probe *probe = io_uring_get_probe_ring(&m_ring);
+	bool supported = probe != nullptr &&
+		io_uring_opcode_supported(probe, IORING_OP_READ) &&
+		io_uring_opcode_supported(probe, IORING_OP_WRITE);
+	io_uring_free_probe(probe);
+
+	if (!supported)
+		logDebug("io_uring does not support IORING_OP_READ/WRITE, falling back to blocking I/O\n");
+
+	return supported;
+}
+
+void IoUringQueue::submitRead(int fd, uint8_t *buf, size_t size, int64_t offset, void *tag)
+{
+	Request *request = m_freeRequests.back();
+	m_freeRequests.pop_back();
+
+	*request = { false, fd, buf, size, 0, offset, tag };
+	submit(request);
+}
+
+void IoUringQueue::submitWrite(int fd, const uint8_t *buf, size_t size, int64_t offset, void *tag)
+{
+	Request *request = m_freeRequests.back();
+	m_freeRequests.pop_back();
+
+	*request = { true, fd, (uint8_t*)buf, size, 0, offset, tag };
+	submit(request);
+}
+
+void IoUringQueue::submit(Request *request)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&m_ring);
+	if (sqe == nullptr) // cannot happen, as there are never more than m_depth requests
+		logError("io_uring_get_sqe failed\n");
+
+	uint8_t *buf = request->buf + request->done;
+	size_t size = request->size - request->done;
+	int64_t offset = request->offset + request->done;
+
+	if (request->isWrite)
+		io_uring_prep_write(sqe, request->fd, buf, size, offset);
+	else
+		io_uring_prep_read(sqe, request->fd, buf, size, offset);
+
+	io_uring_sqe_set_data(sqe, request);
+
+	int r = io_uring_submit(&m_ring);
+	if (r < 0)
+		failOnAVERROR(r, "io_uring_submit");
+}
+
+std::pair<void*, int64_t> IoUringQueue::waitCompletion()
+{
+	while (true)
+	{
+		struct io_uring_cqe *cqe;
+		int r = io_uring_wait_cqe(&m_ring, &cqe);
+		if (r == -EINTR)
+			continue;
+		else if (r < 0)
+			failOnAVERROR(r, "io_uring_wait_cqe");
+
+		Request *request = (Request*)io_uring_cqe_get_data(cqe);
+		int res = cqe->res;
+		io_uring_cqe_seen(&m_ring, cqe);
+
+		if (res == -EINTR || res == -EAGAIN)
+		{
+			submit(request); // try again
+			continue;
+		}
+
+		int64_t result;
+		if (res < 0)
+		{
+			result = res; // already a negative errno, i.e. an AVERROR code
+		}
+		else if (res == 0 && request->isWrite)
+		{
+			result = AVERROR(EIO);
+		}
+		else
+		{
+			request->done += res;
+			if (res != 0 && request->done != request->size)
+			{
+				submit(request); // transfer the rest
+				continue;
+			}
+
+			result = request->done;
+		}
+
+		m_freeRequests.push_back(request);
+		return { request->tag, result };
+	}
+}
+
+#endif
+
+IoQueue *IoQueue::create([[maybe_unused]] size_t depth)
+{
+#ifdef HAVE_LIBURING
+	if (selectedBackend == IoUring)
+	{
+		IoUringQueue *queue = new IoUringQueue(depth);
+		if (queue->init())
+			return queue;
+
+		delete queue;
+		logWarning("io_uring cannot be used, falling back to blocking I/O\n");
+		selectedBackend = Blocking; // do not try again for the next files
+	}
+#endif
+
+	return new BlockingIoQueue();
+}
+
+void IoQueue::selectBackend(Backend backend)
+{
+	selectedBackend = backend;
+}
+
+bool IoQueue::isBackendAvailable(Backend backend)
+{
+	if (backend == Blocking)
+		return true;
+
+#ifdef HAVE_LIBURING
+	// Being built with liburing is not enough: the kernel must support it
+	// too, which is probed once by setting up a real ring
+	static const bool ioUringAvailable = []
+	{
+		IoUringQueue queue(1);
+		return queue.init();
+	}();
+
+	return ioUringAvailable;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,59 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOQUEUE_H
+#define IOQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+
+// Queue of positional read and write requests, which are executed
+// asynchronously and can complete in any order. Short writes are completed by
+// the queue itself, whereas reads only return fewer bytes than requested if
+// the end of the file is reached. Each queue must be used by one thread only.
+class IoQueue
+{
+	public:
+		enum Backend
+		{
+			Blocking, // requests are executed immediately with pread/pwrite
+			IoUring
+		};
+
+		virtual ~IoQueue();
+
+		// At most depth requests (as given to create) can be in flight
+		virtual void submitRead(int fd, uint8_t *buf, size_t size, int64_t offset, void *tag) = 0;
+		virtual void submitWrite(int fd, const uint8_t *buf, size_t size, int64_t offset, void *tag) = 0;
+
+		// Waits for one of the submitted requests to complete and returns
+		// its tag and the number of bytes transferred (or an AVERROR code)
+		virtual std::pair<void*, int64_t> waitCompletion() = 0;
+
+		// Creates a queue using the selected backend, or the blocking one if
+		// the selected backend is not available
+		static IoQueue *create(size_t depth);
+
+		static void selectBackend(Backend backend);
+
+		// Returns whether the backend is both built in and supported by the
+		// running kernel
+		static bool isBackendAvailable(Backend backend);
+};
+
+#endif
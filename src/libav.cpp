@@ -127,6 +127,19 @@ AVPixelFormat selectCompatibleLosslessPixelFormat(AVPixelFormat src, const enum
 		return result;
 }
 
+// Same check as selectCompatibleLosslessPixelFormat, without logging
+bool hasCompatibleLosslessPixelFormat(AVPixelFormat src, const enum AVPixelFormat *candidates)
+{
+	for (; candidates && *candidates != AV_PIX_FMT_NONE; candidates++)
+	{
+		if (av_get_pix_fmt_loss(*candidates, src, false) == 0 && av_get_pix_fmt_loss(src, *candidates, true) == 0
+			&& sws_isSupportedInput(*candidates) != 0 && sws_isSupportedOutput(*candidates) != 0)
+			return true;
+	}
+
+	return false;
+}
+
 std::vector<std::string> enumerateHashAlgorithms()
 {
 	std::vector<std::string> result;
@@ -28,6 +28,7 @@ extern "C"
 #include <libavformat/avformat.h>
 #include <libavutil/common.h>
 #include <libavutil/hash.h>
+#include <libavutil/imgutils.h>
 #include <libavutil/pixdesc.h>
 #include <libavutil/timestamp.h>
 #include <libswscale/swscale.h>
@@ -44,6 +45,7 @@ void _failOnWriteError(AVIOContext *s, const char *op);
 void writeInChunks(AVIOContext *s, const unsigned char *buf, int size);
 
 AVPixelFormat selectCompatibleLosslessPixelFormat(AVPixelFormat src, const enum AVPixelFormat *candidates /* -1 terminator */);
+bool hasCompatibleLosslessPixelFormat(AVPixelFormat src, const enum AVPixelFormat *candidates /* -1 terminator */);
 std::vector<std::string> enumerateHashAlgorithms();
 
 #endif
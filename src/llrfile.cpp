@@ -18,18 +18,37 @@
 #include "llrfile.h"
 
 #include "log.h"
+#include "store.h"
 
 #include <err.h>
 #include <inttypes.h>
 
 static constexpr int32_t LLR_MAGIC_SIGNATURE = MKBETAG('L', 'L', 'R', '\0');
-static constexpr int64_t LLR_BUFFER_SIZE = 4096;
-
-void PacketReferences::addVideoStream(AVPixelFormat pixelFormat)
+static constexpr int32_t PARTIAL_LLR_MAGIC_SIGNATURE = MKBETAG('L', 'L', 'R', 'P');
+static constexpr int32_t SEQUENCE_LLR_MAGIC_SIGNATURE = MKBETAG('L', 'L', 'R', 'S');
+static constexpr int32_t STORE_LLR_MAGIC_SIGNATURE = MKBETAG('L', 'L', 'R', 'C');
+static constexpr int32_t SEGMENT_MANIFEST_MAGIC_SIGNATURE = MKBETAG('L', 'L', 'R', 'M');
+static constexpr int64_t LLR_BUFFER_SIZE = 1024 * 1024;
+
+// Embedded chunks are split in blocks of this size when they are kept in an
+// archive store, so that a change in a big chunk (e.g. an edited header in
+// front of a long non-raw stream) does not prevent the rest from being shared
+static constexpr int64_t STORE_BLOCK_SIZE = 4 * 1024 * 1024;
+
+void PacketReferences::addVideoStream(AVPixelFormat pixelFormat, const PlaneReduction &reduction)
 {
 	StreamInfo info;
-	info.type = Video;
+	info.type = reduction.isNone() ? Video : ReducedVideo;
 	info.pixelFormat = av_get_pix_fmt_name(pixelFormat);
+	info.reduction = reduction;
+	m_streams.push_back(info);
+}
+
+void PacketReferences::addAudioStream(AVCodecID pcmCodecId)
+{
+	StreamInfo info;
+	info.type = Audio;
+	info.pcmCodec = avcodec_get_name(pcmCodecId);
 	m_streams.push_back(info);
 }
 
@@ -40,6 +59,11 @@ void PacketReferences::addCopyStream()
 	m_streams.push_back(info);
 }
 
+void PacketReferences::addStream(const StreamInfo &info)
+{
+	m_streams.push_back(info);
+}
+
 void PacketReferences::addPacketReference(int streamIndex, size_t packetIndex, int64_t pts, int64_t origPos, int origSize)
 {
 	ReferenceInfo info;
@@ -69,6 +93,23 @@ const std::map<size_t, PacketReferences::ReferenceInfo> &PacketReferences::table
 	return m_table;
 }
 
+std::multimap<std::tuple<int, size_t, int64_t>, std::pair<int64_t, int>> PacketReferences::reverseTable() const
+{
+	std::multimap<std::tuple<int, size_t, int64_t>, std::pair<int64_t, int>> result;
+
+	for (const auto &[origPos, e] : m_table)
+		result.insert({{e.streamIndex, e.packetIndex, e.pts}, {origPos, e.origSize}});
+
+	return result;
+}
+
+size_t PacketReferences::memoryUsage() const
+{
+	// Each std::map node also stores three pointers and the node color
+	constexpr size_t nodeSize = sizeof(std::pair<const size_t, ReferenceInfo>) + 4 * sizeof(void*);
+	return m_table.size() * nodeSize;
+}
+
 void PacketReferences::debugDump() const
 {
 	logDebug("Streams (total %zu):\n", m_streams.size());
@@ -83,6 +124,12 @@ void PacketReferences::debugDump() const
 			case Video:
 				logDebug("video %s\n", info.pixelFormat.c_str());
 				break;
+			case ReducedVideo:
+				logDebug("video %s (shift %d, alpha %d)\n", info.pixelFormat.c_str(), info.reduction.shift, info.reduction.alphaValue);
+				break;
+			case Audio:
+				logDebug("audio %s\n", info.pcmCodec.c_str());
+				break;
 			case Copy:
 				logDebug("copy\n");
 				break;
@@ -120,6 +167,22 @@ void PacketReferences::deserialize(AVIOContext *src)
 				info.pixelFormat = buffer;
 				break;
 			}
+			case ReducedVideo:
+			{
+				char buffer[128];
+				avio_get_str(src, sizeof(buffer) - 1, buffer, sizeof(buffer));
+				info.pixelFormat = buffer;
+				info.reduction.shift = avio_r8(src);
+				info.reduction.alphaValue = (int32_t)avio_rb32(src);
+				break;
+			}
+			case Audio:
+			{
+				char buffer[128];
+				avio_get_str(src, sizeof(buffer) - 1, buffer, sizeof(buffer));
+				info.pcmCodec = buffer;
+				break;
+			}
 			case Copy:
 			{
 				break;
@@ -163,6 +226,18 @@ void PacketReferences::serialize(AVIOContext *dest) const
 				failOnWriteError(avio_put_str, dest, e.pixelFormat.c_str());
 				break;
 			}
+			case ReducedVideo:
+			{
+				failOnWriteError(avio_put_str, dest, e.pixelFormat.c_str());
+				failOnWriteError(avio_w8, dest, e.reduction.shift);
+				failOnWriteError(avio_wb32, dest, e.reduction.alphaValue);
+				break;
+			}
+			case Audio:
+			{
+				failOnWriteError(avio_put_str, dest, e.pcmCodec.c_str());
+				break;
+			}
 			case Copy:
 			{
 				break;
@@ -185,17 +260,56 @@ void PacketReferences::serialize(AVIOContext *dest) const
 	}
 }
 
-void writeLLR(AVIOContext *inputFile, const PacketReferences *packetRefs, AVIOContext *llrFile, const char *hashName)
+// Returns the position of the hash value, which is left blank. LLR files whose
+// embedded chunks are in an archive store always have a (possibly empty) list
+// of sequence files.
+static int64_t writeLLRHeader(AVIOContext *llrFile, int64_t originalFileSize, const char *hashName, int hashSize,
+	const std::vector<SequenceFile> &sequenceFiles, bool chunksInStore)
 {
-	unsigned char buffer[LLR_BUFFER_SIZE];
+	int32_t signature = LLR_MAGIC_SIGNATURE;
+	if (chunksInStore)
+		signature = STORE_LLR_MAGIC_SIGNATURE;
+	else if (!sequenceFiles.empty())
+		signature = SEQUENCE_LLR_MAGIC_SIGNATURE;
 
-	logDebug("Writing LLR file:\n");
-	failOnWriteError(avio_wb32, llrFile, LLR_MAGIC_SIGNATURE);
+	failOnWriteError(avio_wb32, llrFile, signature);
+	failOnWriteError(avio_wb64, llrFile, originalFileSize);
 
-	int64_t inputSize = avio_size(inputFile);
-	int64_t prevOffset = 0;
+	// Store hash name and size in output file + reserve space for the final hash
+	failOnWriteError(avio_put_str, llrFile, hashName);
+	failOnWriteError(avio_wb16, llrFile, hashSize);
+	int64_t hashPos = avio_tell(llrFile);
+	seekOrFail(llrFile, hashPos + hashSize);
 
-	failOnWriteError(avio_wb64, llrFile, inputSize);
+	if (signature != LLR_MAGIC_SIGNATURE)
+	{
+		failOnWriteError(avio_wb32, llrFile, sequenceFiles.size());
+		for (const SequenceFile &file : sequenceFiles)
+		{
+			if (file.hashBuffer.size() != (size_t)hashSize)
+				logError("Hash of %s is missing, probably a bug. halting!\n", file.name.c_str());
+
+			failOnWriteError(avio_put_str, llrFile, file.name.c_str());
+			failOnWriteError(avio_wb64, llrFile, file.size);
+			failOnWriteError(avio_write, llrFile, file.hashBuffer.data(), hashSize);
+		}
+	}
+
+	return hashPos;
+}
+
+// Writes an LLR file for the bytes of the input file between rangeStart and
+// rangeEnd, as if they were a file on their own. The positions in packetRefs
+// are relative to the whole input file.
+static void writeLLRRange(AVIOContext *inputFile, const uint8_t *mappedInput, const PacketReferences *packetRefs, AVIOContext *llrFile,
+	const char *hashName, const std::vector<SequenceFile> &sequenceFiles, const ArchiveStore *store, int64_t rangeStart, int64_t rangeEnd)
+{
+	std::vector<unsigned char> buffer(LLR_BUFFER_SIZE);
+	std::vector<uint8_t> storeBlock;
+
+	logDebug("Writing LLR file: range %" PRIi64 "-%" PRIi64 "\n", rangeStart, rangeEnd);
+
+	int64_t prevOffset = rangeStart;
 
 	// Initialize hashing
 	AVHashContext *hashCtx;
@@ -203,64 +317,102 @@ void writeLLR(AVIOContext *inputFile, const PacketReferences *packetRefs, AVIOCo
 	av_hash_init(hashCtx);
 	int hashSize = av_hash_get_size(hashCtx);
 
-	// Store hash name and size in output file + reserve space for the final hash
-	failOnWriteError(avio_put_str, llrFile, hashName);
-	failOnWriteError(avio_wb16, llrFile, hashSize);
-	int64_t hashPos = avio_tell(llrFile);
-	seekOrFail(llrFile, hashPos + hashSize);
+	int64_t hashPos = writeLLRHeader(llrFile, rangeEnd - rangeStart, hashName, hashSize, sequenceFiles, store != nullptr);
 
-	packetRefs->serialize(llrFile);
+	if (rangeStart == 0)
+	{
+		packetRefs->serialize(llrFile);
+	}
+	else
+	{
+		PacketReferences rangeRefs;
+		for (const PacketReferences::StreamInfo &info : packetRefs->streams())
+			rangeRefs.addStream(info);
+		for (const auto &[origPos, e] : packetRefs->table())
+			rangeRefs.addPacketReference(e.streamIndex, e.packetIndex, e.pts, origPos - rangeStart, e.origSize);
 
-	seekOrFail(inputFile, 0);
+		rangeRefs.serialize(llrFile);
+	}
 
-	auto embedChunk = [&](int64_t start, int64_t end)
-	{
-		logDebug("  %" PRIi64 "-%" PRIi64 ": Embedding - size %" PRIi64 "\n", start, end, end - start);
+	seekOrFail(inputFile, rangeStart);
 
-		if (avio_tell(inputFile) != start)
-			logError("embedChunk: Unexpected file offset, probably a bug. halting!\n");
+	// Hashes the input data between start and end and, if embed is true,
+	// copies it to the LLR file (or to storeBlock, if there is a store). If
+	// the input file is mapped in memory, the data is taken from the mapping
+	// and inputFile is not used.
+	auto processChunk = [&](int64_t start, int64_t end, bool embed)
+	{
+		if (mappedInput == nullptr && avio_tell(inputFile) != start)
+			logError("processChunk: Unexpected file offset, probably a bug. halting!\n");
 
 		while (start != end)
 		{
-			int64_t r = avio_read_partial(inputFile, buffer, std::min(LLR_BUFFER_SIZE, end - start));
-			if (r == 0)
-				logError("avio_read_partial: Premature end of file\n");
-			else if (r < 0)
-				failOnAVERROR(r, "avio_read_partial");
+			const unsigned char *data;
+			int64_t r;
+
+			if (mappedInput != nullptr)
+			{
+				data = mappedInput + start;
+				r = std::min(LLR_BUFFER_SIZE, end - start);
+			}
+			else
+			{
+				data = buffer.data();
+				r = avio_read_partial(inputFile, buffer.data(), std::min(LLR_BUFFER_SIZE, end - start));
+				if (r == 0)
+					logError("avio_read_partial: Premature end of file\n");
+				else if (r < 0)
+					failOnAVERROR(r, "avio_read_partial");
+			}
 
 			logDebug("   -> %" PRIi64 "-%" PRIi64 ": size %" PRIi64 "\n", start, start + r, r);
 
-			failOnWriteError(avio_write, llrFile, buffer, r);
-			av_hash_update(hashCtx, buffer, r);
+			if (embed && store != nullptr)
+				storeBlock.insert(storeBlock.end(), data, data + r);
+			else if (embed)
+				failOnWriteError(avio_write, llrFile, data, r);
+			av_hash_update(hashCtx, data, r);
 
 			start += r;
 		}
 	};
 
-	auto hashChunk = [&](int64_t start, int64_t end)
+	auto embedChunk = [&](int64_t start, int64_t end)
 	{
-		if (avio_tell(inputFile) != start)
-			logError("hashChunk: Unexpected file offset, probably a bug. halting!\n");
+		logDebug("  %" PRIi64 "-%" PRIi64 ": Embedding - size %" PRIi64 "\n", start, end, end - start);
+		if (store == nullptr)
+		{
+			processChunk(start, end, true);
+			return;
+		}
 
-		while (start != end)
+		// Only the keys of the blocks are stored in the LLR file
+		for (int64_t blockStart = start; blockStart != end; )
 		{
-			int64_t r = avio_read_partial(inputFile, buffer, std::min(LLR_BUFFER_SIZE, end - start));
-			if (r == 0)
-				logError("avio_read_partial: Premature end of file\n");
-			else if (r < 0)
-				failOnAVERROR(r, "avio_read_partial");
+			int64_t blockEnd = std::min(blockStart + STORE_BLOCK_SIZE, end);
 
-			logDebug("   -> %" PRIi64 "-%" PRIi64 ": size %" PRIi64 "\n", start, start + r, r);
+			storeBlock.clear();
+			processChunk(blockStart, blockEnd, true);
 
-			av_hash_update(hashCtx, buffer, r);
+			ArchiveStore::Key key = ArchiveStore::computeKey(nullptr, 0, storeBlock.data(), storeBlock.size());
+			store->save(ArchiveStore::Chunk, key, storeBlock.data(), storeBlock.size());
+			failOnWriteError(avio_write, llrFile, key.data(), key.size());
 
-			start += r;
+			blockStart = blockEnd;
 		}
 	};
 
+	auto hashChunk = [&](int64_t start, int64_t end)
+	{
+		processChunk(start, end, false);
+	};
+
 	for (const auto &[origPos, e] : packetRefs->table())
 	{
-		if (origPos != prevOffset)
+		if ((int64_t)origPos < prevOffset || (int64_t)origPos + e.origSize > rangeEnd)
+			logError("Packet reference outside of the range being written, probably a bug. halting!\n");
+
+		if ((int64_t)origPos != prevOffset)
 		{
 			embedChunk(prevOffset, origPos);
 			prevOffset = origPos;
@@ -274,8 +426,8 @@ void writeLLR(AVIOContext *inputFile, const PacketReferences *packetRefs, AVIOCo
 		hashChunk(origPos, prevOffset);
 	}
 
-	if (prevOffset != inputSize)
-		embedChunk(prevOffset, inputSize);
+	if (prevOffset != rangeEnd)
+		embedChunk(prevOffset, rangeEnd);
 
 	// Finalize hashing and write result
 	uint8_t hashBuffer[hashSize];
@@ -291,13 +443,28 @@ void writeLLR(AVIOContext *inputFile, const PacketReferences *packetRefs, AVIOCo
 	failOnWriteError(avio_write, llrFile, hashBuffer, hashSize);
 }
 
+void writeLLR(AVIOContext *inputFile, const uint8_t *mappedInput, const PacketReferences *packetRefs, AVIOContext *llrFile,
+	const char *hashName, const std::vector<SequenceFile> &sequenceFiles, const ArchiveStore *store)
+{
+	writeLLRRange(inputFile, mappedInput, packetRefs, llrFile, hashName, sequenceFiles, store, 0, avio_size(inputFile));
+}
+
+void writeSegmentLLR(AVIOContext *inputFile, const uint8_t *mappedInput, const PacketReferences *packetRefs, AVIOContext *llrFile,
+	const char *hashName, const ArchiveStore *store, int64_t rangeStart, int64_t rangeEnd)
+{
+	writeLLRRange(inputFile, mappedInput, packetRefs, llrFile, hashName, std::vector<SequenceFile>(), store, rangeStart, rangeEnd);
+}
+
 LLRInfo readLLRInfo(AVIOContext *llrFile)
 {
 	LLRInfo result;
 
-	if (avio_rb32(llrFile) != LLR_MAGIC_SIGNATURE)
+	int32_t signature = avio_rb32(llrFile);
+	if (signature != LLR_MAGIC_SIGNATURE && signature != SEQUENCE_LLR_MAGIC_SIGNATURE && signature != STORE_LLR_MAGIC_SIGNATURE)
 		logError("Invalid LLR file signature\n");
 
+	result.chunksInStore = signature == STORE_LLR_MAGIC_SIGNATURE;
+
 	logDebug("Reading LLR file:\n");
 
 	result.originalFileSize = avio_rb64(llrFile);
@@ -317,24 +484,71 @@ LLRInfo readLLRInfo(AVIOContext *llrFile)
 	logDebug("\n");
 
 	result.hashBuffer = hashBuffer;
+
+	if (signature != LLR_MAGIC_SIGNATURE)
+	{
+		uint32_t fileCount = avio_rb32(llrFile);
+		if (fileCount != 0)
+			logDebug("  Image sequence: %u files\n", fileCount);
+
+		char nameBuffer[4096];
+		while (fileCount-- != 0 && !avio_feof(llrFile))
+		{
+			SequenceFile file;
+			avio_get_str(llrFile, sizeof(nameBuffer) - 1, nameBuffer, sizeof(nameBuffer));
+			file.name = nameBuffer;
+			file.size = avio_rb64(llrFile);
+			file.hashBuffer.resize(hashSize);
+			avio_read(llrFile, file.hashBuffer.data(), hashSize);
+			result.sequenceFiles.push_back(file);
+		}
+
+		if (avio_feof(llrFile))
+			logError("Truncated LLR file\n");
+	}
+
 	return result;
 }
 
-LLRInfo readLLR(AVIOContext *llrFile, PacketReferences *outPacketRefs, AVIOContext *outputFile)
+void readLLR(AVIOContext *llrFile, const LLRInfo &info, PacketReferences *outPacketRefs, AVIOContext *outputFile, const ArchiveStore *store)
 {
-	unsigned char buffer[LLR_BUFFER_SIZE];
+	std::vector<unsigned char> buffer(LLR_BUFFER_SIZE);
+
+	if (info.chunksInStore && store == nullptr)
+		logError("Embedded chunks are kept in an archive store, which must be given with --store DIR\n");
 
-	LLRInfo info = readLLRInfo(llrFile);
 	outPacketRefs->deserialize(llrFile);
 
+	AVPacket *block = av_packet_alloc();
+	if (block == nullptr)
+		logError("av_packet_alloc failed\n");
+
 	auto loadChunk = [&](int64_t start, int64_t end)
 	{
 		logDebug("  %" PRIi64 "-%" PRIi64 ": Loading - size %" PRIi64 "\n", start, end, end - start);
 		seekOrFail(outputFile, start);
 
+		while (info.chunksInStore && start != end)
+		{
+			ArchiveStore::Key key;
+			if (avio_read(llrFile, key.data(), key.size()) != (int)key.size())
+				logError("Truncated LLR file\n");
+
+			if (!store->load(ArchiveStore::Chunk, key, block))
+				logError("Chunk %" PRIi64 "-%" PRIi64 " is missing from the archive store\n", start, end);
+
+			int64_t blockSize = std::min(STORE_BLOCK_SIZE, end - start);
+			if (block->size != blockSize)
+				logError("Chunk %" PRIi64 "-%" PRIi64 " has the wrong size in the archive store\n", start, end);
+
+			writeInChunks(outputFile, block->data, block->size);
+			av_packet_unref(block);
+			start += blockSize;
+		}
+
 		while (start != end)
 		{
-			int64_t r = avio_read_partial(llrFile, buffer, std::min(LLR_BUFFER_SIZE, end - start));
+			int64_t r = avio_read_partial(llrFile, buffer.data(), std::min(LLR_BUFFER_SIZE, end - start));
 			if (r == 0)
 				logError("avio_read_partial: Premature end of file\n");
 			else if (r < 0)
@@ -342,7 +556,7 @@ LLRInfo readLLR(AVIOContext *llrFile, PacketReferences *outPacketRefs, AVIOConte
 
 			logDebug("   -> %" PRIi64 "-%" PRIi64 ": size %" PRIi64 "\n", start, start + r, r);
 
-			failOnWriteError(avio_write, outputFile, buffer, r);
+			failOnWriteError(avio_write, outputFile, buffer.data(), r);
 			start += r;
 		}
 	};
@@ -351,7 +565,7 @@ LLRInfo readLLR(AVIOContext *llrFile, PacketReferences *outPacketRefs, AVIOConte
 
 	for (const auto &[origPos, e] : outPacketRefs->table())
 	{
-		if (origPos != prevOffset)
+		if ((int64_t)origPos != prevOffset)
 		{
 			loadChunk(prevOffset, origPos);
 			prevOffset = origPos;
@@ -363,5 +577,119 @@ LLRInfo readLLR(AVIOContext *llrFile, PacketReferences *outPacketRefs, AVIOConte
 	if (prevOffset != info.originalFileSize)
 		loadChunk(prevOffset, info.originalFileSize);
 
-	return info;
+	av_packet_free(&block);
+}
+
+void writePartialLLR(const PartialLLRInfo &info, const PacketReferences *packetRefs, AVIOContext *llrFile)
+{
+	logDebug("Writing partial LLR file: range %" PRIi64 "-%" PRIi64 "\n", info.rangeStart, info.rangeEnd);
+
+	failOnWriteError(avio_wb32, llrFile, PARTIAL_LLR_MAGIC_SIGNATURE);
+	failOnWriteError(avio_wb64, llrFile, info.originalFileSize);
+	failOnWriteError(avio_wb64, llrFile, info.rangeStart);
+	failOnWriteError(avio_wb64, llrFile, info.rangeEnd);
+
+	packetRefs->serialize(llrFile);
+}
+
+PartialLLRInfo readPartialLLR(AVIOContext *llrFile, PacketReferences *outPacketRefs)
+{
+	PartialLLRInfo result;
+
+	if (avio_rb32(llrFile) != PARTIAL_LLR_MAGIC_SIGNATURE)
+		logError("Invalid partial LLR file signature\n");
+
+	result.originalFileSize = avio_rb64(llrFile);
+	result.rangeStart = avio_rb64(llrFile);
+	result.rangeEnd = avio_rb64(llrFile);
+	logDebug("Reading partial LLR file: range %" PRIi64 "-%" PRIi64 "\n", result.rangeStart, result.rangeEnd);
+
+	outPacketRefs->deserialize(llrFile);
+	return result;
+}
+
+void rewriteLLR(AVIOContext *srcLlrFile, const LLRInfo &info, const PacketReferences *packetRefs, AVIOContext *destLlrFile)
+{
+	std::vector<unsigned char> buffer(LLR_BUFFER_SIZE);
+
+	logDebug("Rewriting LLR file:\n");
+
+	int64_t hashPos = writeLLRHeader(destLlrFile, info.originalFileSize, info.hashName.c_str(), info.hashBuffer.size(), info.sequenceFiles, info.chunksInStore);
+	packetRefs->serialize(destLlrFile);
+
+	// Embedded chunks (or the keys of their blocks in the archive store) are
+	// stored in the same order, regardless of the references
+	int64_t start = avio_tell(srcLlrFile), end = avio_size(srcLlrFile);
+	logDebug("  Copying embedded chunks - size %" PRIi64 "\n", end - start);
+
+	while (start != end)
+	{
+		int64_t r = avio_read_partial(srcLlrFile, buffer.data(), std::min(LLR_BUFFER_SIZE, end - start));
+		if (r == 0)
+			logError("avio_read_partial: Premature end of file\n");
+		else if (r < 0)
+			failOnAVERROR(r, "avio_read_partial");
+
+		failOnWriteError(avio_write, destLlrFile, buffer.data(), r);
+		start += r;
+	}
+
+	seekOrFail(destLlrFile, hashPos);
+	failOnWriteError(avio_write, destLlrFile, info.hashBuffer.data(), info.hashBuffer.size());
+}
+
+void writeSegmentManifest(const SegmentManifest &manifest, AVIOContext *llrFile)
+{
+	logDebug("Writing segment manifest: %zu segments\n", manifest.segments.size());
+
+	failOnWriteError(avio_wb32, llrFile, SEGMENT_MANIFEST_MAGIC_SIGNATURE);
+	failOnWriteError(avio_wb64, llrFile, manifest.originalFileSize);
+
+	failOnWriteError(avio_wb32, llrFile, manifest.segments.size());
+	for (const SegmentManifest::Segment &segment : manifest.segments)
+	{
+		failOnWriteError(avio_put_str, llrFile, segment.filename.c_str());
+		failOnWriteError(avio_wb64, llrFile, segment.rangeStart);
+		failOnWriteError(avio_wb64, llrFile, segment.rangeEnd);
+	}
+}
+
+std::optional<SegmentManifest> readSegmentManifest(AVIOContext *llrFile)
+{
+	SegmentManifest result;
+
+	if (avio_rb32(llrFile) != SEGMENT_MANIFEST_MAGIC_SIGNATURE)
+		return std::nullopt;
+
+	result.originalFileSize = avio_rb64(llrFile);
+
+	uint32_t segmentCount = avio_rb32(llrFile);
+	logDebug("Reading segment manifest: %u segments\n", segmentCount);
+
+	char nameBuffer[4096];
+	int64_t expectedStart = 0;
+	while (segmentCount-- != 0 && !avio_feof(llrFile))
+	{
+		SegmentManifest::Segment segment;
+		avio_get_str(llrFile, sizeof(nameBuffer) - 1, nameBuffer, sizeof(nameBuffer));
+		segment.filename = nameBuffer;
+		segment.rangeStart = avio_rb64(llrFile);
+		segment.rangeEnd = avio_rb64(llrFile);
+		logDebug("  %s: range %" PRIi64 "-%" PRIi64 "\n", segment.filename.c_str(), segment.rangeStart, segment.rangeEnd);
+
+		// Together, the segments must cover the whole original file
+		if (segment.rangeStart != expectedStart || segment.rangeEnd < segment.rangeStart)
+			logError("Invalid segment manifest\n");
+
+		expectedStart = segment.rangeEnd;
+		result.segments.push_back(segment);
+	}
+
+	if (avio_feof(llrFile))
+		logError("Truncated segment manifest\n");
+
+	if (expectedStart != result.originalFileSize)
+		logError("Invalid segment manifest\n");
+
+	return result;
 }
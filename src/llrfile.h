@@ -19,15 +19,22 @@
 #define LLRFILE_H
 
 #include "libav.h"
+#include "reduction.h"
 
 #include <map>
+#include <optional>
 #include <string>
+#include <tuple>
 #include <vector>
 
+class ArchiveStore;
+
 enum CodecType : char // These values are stored on-disk in LLR files
 {
 	Copy = 1,
-	Video = 2
+	Video = 2,
+	Audio = 3,
+	ReducedVideo = 4 // video encoded with a PlaneReduction
 };
 
 class PacketReferences
@@ -36,7 +43,18 @@ class PacketReferences
 		struct StreamInfo
 		{
 			CodecType type;
-			std::string pixelFormat;
+			std::string pixelFormat; // only if Video or ReducedVideo
+			PlaneReduction reduction; // only if ReducedVideo
+			std::string pcmCodec; // only if Audio
+
+			// Whether the stream can have packets that are only written to
+			// keep it decodable or playable, while the original data is
+			// stored as part of an embedded chunk (see VideoEncoder and
+			// AudioEncoder)
+			bool mayHaveUnreferencedPackets() const
+			{
+				return type == ReducedVideo || type == Audio;
+			}
 		};
 
 		struct ReferenceInfo
@@ -50,14 +68,23 @@ class PacketReferences
 			int64_t pts;
 		};
 
-		void addVideoStream(AVPixelFormat pixelFormat);
+		void addVideoStream(AVPixelFormat pixelFormat, const PlaneReduction &reduction = PlaneReduction());
+		void addAudioStream(AVCodecID pcmCodecId);
 		void addCopyStream();
+		void addStream(const StreamInfo &info);
 
 		void addPacketReference(int streamIndex, size_t packetIndex, int64_t pts, int64_t origPos, int origSize);
 
 		const std::vector<StreamInfo> &streams() const;
 		const std::map<size_t, ReferenceInfo> &table() const;
 
+		// (streamIndex, packetIndex, pts) -> (origPos, origSize). Duplicate
+		// frames are stored once, so a packet can have several entries.
+		std::multimap<std::tuple<int, size_t, int64_t>, std::pair<int64_t, int>> reverseTable() const;
+
+		// Approximate number of bytes taken by the table in memory
+		size_t memoryUsage() const;
+
 		void debugDump() const;
 
 		void deserialize(AVIOContext *src);
@@ -68,16 +95,80 @@ class PacketReferences
 		std::map<size_t, ReferenceInfo> m_table; // origPos -> other fields
 };
 
+// File of an image sequence. The original "file" of an image sequence is the
+// concatenation of all its files, in name order.
+struct SequenceFile
+{
+	std::string name;
+	int64_t size;
+	std::vector<uint8_t> hashBuffer; // same algorithm as the whole sequence
+};
+
 struct LLRInfo
 {
 	int64_t originalFileSize;
 
 	std::string hashName;
 	std::vector<uint8_t> hashBuffer; // hash value
+
+	std::vector<SequenceFile> sequenceFiles; // empty if the original is a single file
+	bool chunksInStore; // if set, embedded chunks are in an ArchiveStore
+};
+
+// Partial LLR files only contain the reference table of the packets located in
+// a range of the input file. They are merged into a regular LLR file later.
+struct PartialLLRInfo
+{
+	int64_t originalFileSize;
+	int64_t rangeStart, rangeEnd;
 };
 
-void writeLLR(AVIOContext *inputFile, const PacketReferences *packetRefs, AVIOContext *llrFile, const char *hashName);
+// If the input file is mapped in memory, mappedInput points to its contents and
+// the data is read from there instead of inputFile (which is only used to get
+// the file size). Otherwise mappedInput is nullptr. If the input is an image
+// sequence, sequenceFiles lists its files, whose hashes must already be set.
+// If store is not nullptr, embedded chunks are saved there instead.
+void writeLLR(AVIOContext *inputFile, const uint8_t *mappedInput, const PacketReferences *packetRefs, AVIOContext *llrFile,
+	const char *hashName, const std::vector<SequenceFile> &sequenceFiles, const ArchiveStore *store);
+
+// Same as writeLLR, but the LLR file only covers the bytes of the input file
+// between rangeStart and rangeEnd, and it can be decompressed on its own
+void writeSegmentLLR(AVIOContext *inputFile, const uint8_t *mappedInput, const PacketReferences *packetRefs, AVIOContext *llrFile,
+	const char *hashName, const ArchiveStore *store, int64_t rangeStart, int64_t rangeEnd);
 LLRInfo readLLRInfo(AVIOContext *llrFile);
-LLRInfo readLLR(AVIOContext *llrFile, PacketReferences *outPacketRefs, AVIOContext *outputFile);
+
+// Reads the reference table and writes the embedded chunks to outputFile.
+// llrFile must be positioned right after the header (i.e. readLLRInfo already
+// called). store is only needed if info.chunksInStore is set.
+void readLLR(AVIOContext *llrFile, const LLRInfo &info, PacketReferences *outPacketRefs, AVIOContext *outputFile, const ArchiveStore *store);
+
+void writePartialLLR(const PartialLLRInfo &info, const PacketReferences *packetRefs, AVIOContext *llrFile);
+PartialLLRInfo readPartialLLR(AVIOContext *llrFile, PacketReferences *outPacketRefs);
+
+// Writes a new LLR file with the same contents as srcLlrFile but different
+// packet references. srcLlrFile must be positioned right after its reference
+// table (i.e. readLLRInfo and PacketReferences::deserialize already called).
+void rewriteLLR(AVIOContext *srcLlrFile, const LLRInfo &info, const PacketReferences *packetRefs, AVIOContext *destLlrFile);
+
+// If the output of a compression is split into segments, each segment is a
+// regular .mkv/.llr pair covering a range of the original file, and the LLR
+// file of the whole output is replaced by a manifest listing them. Restoring
+// the segments and concatenating them in order gives back the original file.
+struct SegmentManifest
+{
+	struct Segment
+	{
+		std::string filename; // .mkv file, in the same directory as the manifest
+		int64_t rangeStart, rangeEnd;
+	};
+
+	int64_t originalFileSize;
+	std::vector<Segment> segments;
+};
+
+void writeSegmentManifest(const SegmentManifest &manifest, AVIOContext *llrFile);
+
+// Returns std::nullopt if llrFile is not a segment manifest
+std::optional<SegmentManifest> readSegmentManifest(AVIOContext *llrFile);
 
 #endif
@@ -15,14 +15,48 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "autocodec.h"
+#include "avireader.h"
+#include "checkpoint.h"
 #include "commandline.h"
+#include "cpus.h"
 #include "decoders.h"
 #include "encoders.h"
+#include "fileio.h"
+#include "imagesequence.h"
+#include "ioqueue.h"
 #include "log.h"
-
+#include "mappedfile.h"
+#include "memory.h"
+#include "pipeline.h"
+#include "reduction.h"
+#include "store.h"
+
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <optional>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavutil/time.h>
+}
+
+// Size of the reads performed while verifying the hash of the restored file
+static constexpr int HASH_BUFFER_SIZE = 1024 * 1024;
+
+// Number of video frames sampled to choose the codec (-v auto) and the plane
+// reduction of each stream
+static constexpr size_t SAMPLE_FRAME_COUNT = 8;
+
+// Maximum number of segments restored at the same time, each one with its own
+// decoders, read-ahead and write-behind buffers
+static constexpr size_t MAX_CONCURRENT_SEGMENTS = 4;
 
 static void errorIfUnusedOptions(const AVDictionary *opts)
 {
@@ -43,6 +77,153 @@ static void errorIfUnusedOptions(const AVDictionary *opts)
 		exit(EXIT_FAILURE);
 }
 
+// The available CPUs are shared evenly by the video encoders, which all run at
+// the same time
+static int videoEncoderThreadCount(int videoStreamCount)
+{
+	return std::max(availableCpuCount() / std::max(videoStreamCount, 1), 1);
+}
+
+// Runs the trial encodings of -v auto on the given raw frames of rawStream
+// and fills the options of the chosen codec
+static AVCodecID autoSelectVideoCodec(const CommandLine &cmd, const AVStream *rawStream, const std::vector<AVPacket*> &samples,
+	int threadCount, AVDictionary **outOptions)
+{
+	VideoCodecChoice choice = selectVideoCodec(rawStream, samples, *cmd.autoVideoCodecPolicy(), threadCount);
+
+	for (const auto &[k, v] : choice.options)
+		av_dict_set(outOptions, k.c_str(), v.c_str(), 0);
+
+	return choice.codecId;
+}
+
+// Image sequences cannot be seeked: the first images are used as samples
+static std::vector<AVPacket*> readSequenceSampleFrames(const CommandLine &cmd, size_t count)
+{
+	std::vector<AVPacket*> result;
+
+	std::unique_ptr<ImageSequence> sequence(ImageSequence::open(cmd.inputFile(), cmd.hashName().c_str()));
+	if (sequence == nullptr)
+		return result;
+
+	while (result.size() < count)
+	{
+		AVPacket *packet = av_packet_alloc();
+		if (packet == nullptr)
+			logError("av_packet_alloc failed\n");
+
+		int r = sequence->readPacket(packet);
+		if (r == AVERROR_EOF)
+		{
+			av_packet_free(&packet);
+			break;
+		}
+		failOnAVERROR(r, "readPacket");
+
+		result.push_back(packet);
+	}
+
+	return result;
+}
+
+// Reads the next input packet from the image sequence or from the AVI index
+// if possible, otherwise from the demuxer
+static int readInputPacket(AVFormatContext *inputFormatContext, ImageSequence *sequence, AviReader *aviReader, AVPacket *packet)
+{
+	if (sequence != nullptr)
+		return sequence->readPacket(packet);
+	else if (aviReader != nullptr)
+		return aviReader->readPacket(packet);
+	else
+		return av_read_frame(inputFormatContext, packet);
+}
+
+static void saveCheckpoint(const CommandLine &cmd, uint32_t generation, AVFormatContext *inputFormatContext, bool aviReader, int64_t inputPacketCount,
+	AVFormatContext *outputFormatContext, const std::map<int, Encoder*> &encoders, const PacketReferences &packetRefs)
+{
+	flushOutputToDisk(outputFormatContext);
+
+	Checkpoint checkpoint;
+	checkpoint.generation = generation;
+	checkpoint.inputFileSize = avio_size(inputFormatContext->pb);
+	checkpoint.inputPacketCount = inputPacketCount;
+	checkpoint.aviReader = aviReader;
+	checkpoint.outputFileSize = avio_tell(outputFormatContext->pb);
+
+	for (const auto &[streamIndex, encoder] : encoders)
+		checkpoint.outputPacketCounts.push_back(encoder->outputPacketCount());
+
+	checkpoint.packetRefs = packetRefs;
+	writeCheckpoint(cmd.checkpointFile(), checkpoint);
+}
+
+static void resumeFromCheckpoint(const Checkpoint &checkpoint, const char *sourceFilename, size_t readAheadSize,
+	const std::map<int, Encoder*> &encoders, PacketReferences *packetRefs)
+{
+	AVFormatContext *partialFormatContext = nullptr;
+
+	// Make sure that the encoders are configured as in the interrupted run
+	const std::vector<PacketReferences::StreamInfo> &expectedStreams = checkpoint.packetRefs.streams();
+	if (expectedStreams.size() != packetRefs->streams().size() || checkpoint.outputPacketCounts.size() != encoders.size())
+		logError("Stream count mismatch\n");
+
+	for (size_t i = 0; i < expectedStreams.size(); i++)
+	{
+		const PacketReferences::StreamInfo &a = expectedStreams.at(i), &b = packetRefs->streams().at(i);
+		if (a.type != b.type || a.pixelFormat != b.pixelFormat || a.reduction != b.reduction)
+			logError("Stream #0:%zu does not match the checkpoint\n", i);
+	}
+
+	failOnAVERROR(openInputFormat(&partialFormatContext, sourceFilename, readAheadSize), "openInputFormat: %s", sourceFilename);
+	failOnAVERROR(avformat_find_stream_info(partialFormatContext, nullptr), "avformat_find_stream_info");
+
+	if (avio_size(partialFormatContext->pb) < checkpoint.outputFileSize)
+		logError("Output file is shorter than the checkpoint\n");
+
+	if (partialFormatContext->nb_streams != encoders.size())
+		logError("Stream count mismatch\n");
+
+	for (const auto &[streamIndex, encoder] : encoders)
+	{
+		const AVCodecParameters *a = partialFormatContext->streams[streamIndex]->codecpar, *b = encoder->outputCodecParameters();
+		if (a->codec_id != b->codec_id || a->extradata_size != b->extradata_size ||
+			(a->extradata_size != 0 && memcmp(a->extradata, b->extradata, a->extradata_size) != 0))
+		{
+			logError("Stream #0:%d: codec or codec options differ from the interrupted run\n", streamIndex);
+		}
+	}
+
+	// Copy all the packets that were durably written before the checkpoint
+	logDebug("Resuming from checkpoint:\n");
+	size_t remainingPackets = 0;
+	for (size_t count : checkpoint.outputPacketCounts)
+		remainingPackets += count;
+
+	AVPacket *packet = av_packet_alloc();
+	while (remainingPackets != 0)
+	{
+		int errnum = av_read_frame(partialFormatContext, packet);
+		if (errnum == AVERROR_EOF)
+			logError("Output file is shorter than the checkpoint\n");
+		else
+			failOnAVERROR(errnum, "av_read_frame");
+
+		Encoder *encoder = encoders.at(packet->stream_index);
+		if (encoder->outputPacketCount() < checkpoint.outputPacketCounts.at(packet->stream_index))
+		{
+			encoder->writeResumedPacket(packet, partialFormatContext->streams[packet->stream_index]->time_base);
+			remainingPackets--;
+		}
+
+		av_packet_unref(packet);
+	}
+
+	av_packet_free(&packet);
+	closeInputFormat(&partialFormatContext);
+
+	*packetRefs = checkpoint.packetRefs;
+}
+
 static int compress(const CommandLine &cmd)
 {
 	AVFormatContext *inputFormatContext = nullptr, *outputFormatContext = nullptr;
@@ -51,96 +232,462 @@ static int compress(const CommandLine &cmd)
 	const char *outputFilename = cmd.outputFile();
 	const char *llrFilename = cmd.llrFile();
 
-	failOnAVERROR(avformat_open_input(&inputFormatContext, inputFilename, nullptr, nullptr), "avformat_open_input: %s", inputFilename);
-	failOnAVERROR(avformat_find_stream_info(inputFormatContext, nullptr), "avformat_find_stream_info");
-	av_dump_format(inputFormatContext, 0, inputFilename, false);
+	// A directory is compressed as an image sequence
+	ImageSequence *sequence = nullptr;
+	struct stat st;
+	if (stat(inputFilename, &st) == 0 && S_ISDIR(st.st_mode))
+	{
+		if (cmd.inputRange().has_value())
+			logError("--range cannot be used with image sequences\n");
 
-	logDebug("Encoders:\n");
-	failOnAVERROR(avformat_alloc_output_context2(&outputFormatContext, nullptr, "matroska", outputFilename), "avformat_alloc_output_context2: %s", outputFilename);
+		if (cmd.segmentSize() != 0 || cmd.segmentTime() != 0)
+			logError("--segment-size and --segment-time cannot be used with image sequences\n");
 
-	std::map<int, Encoder*> encoders;
-	PacketReferences packetRefs;
+		sequence = ImageSequence::open(inputFilename, cmd.hashName().c_str());
+		inputFormatContext = sequence->formatContext();
+	}
+
+	MappedFile *mappedInput = nullptr;
+	if (sequence == nullptr && cmd.mapInput())
+	{
+		mappedInput = MappedFile::open(inputFilename);
+		if (mappedInput == nullptr)
+			logWarning("Cannot map %s in memory, reading it normally\n", inputFilename);
+	}
+
+	if (sequence == nullptr)
+	{
+		if (mappedInput != nullptr)
+			failOnAVERROR(mappedInput->openInputFormat(&inputFormatContext, inputFilename), "openInputFormat: %s", inputFilename);
+		else
+			failOnAVERROR(openInputFormat(&inputFormatContext, inputFilename, cmd.readAheadSize()), "openInputFormat: %s", inputFilename);
+
+		failOnAVERROR(avformat_find_stream_info(inputFormatContext, nullptr), "avformat_find_stream_info");
+		av_dump_format(inputFormatContext, 0, inputFilename, false);
+	}
+
+	// The AVI reader does its own reads, which neither use the mapping nor
+	// bypass the page cache
+	AviReader *aviReader = nullptr;
+	if (sequence == nullptr && mappedInput == nullptr && !cmd.directIo() && strcmp(inputFormatContext->iformat->name, "avi") == 0)
+		aviReader = AviReader::open(inputFilename, inputFormatContext, cmd.readAheadSize());
+
+	// The video codec, its options and the plane reduction are chosen once,
+	// and they are shared by all the output segments
+	struct VideoSettings
+	{
+		AVCodecID codec;
+		AVDictionary *opts;
+		PlaneReduction reduction;
+	};
+
+	std::map<int, VideoSettings> videoSettings;
+
+	int videoStreamCount = 0;
+	for (unsigned int i = 0; i < inputFormatContext->nb_streams; i++)
+	{
+		if (inputFormatContext->streams[i]->codecpar->codec_id == AV_CODEC_ID_RAWVIDEO)
+			videoStreamCount++;
+	}
 
 	for (unsigned int i = 0; i < inputFormatContext->nb_streams; i++)
 	{
 		const AVStream *inputStream = inputFormatContext->streams[i];
-		AVCodecParameters *inputCodecParameters = inputStream->codecpar;
+		if (strcmp(avcodec_get_name(inputStream->codecpar->codec_id), "rawvideo") != 0)
+			continue;
 
-		const char *codecName = avcodec_get_name(inputCodecParameters->codec_id); // never nullptr (according to documentation)
-		logDebug("  Stream #0:%d: input_codec=%s output_codec=", inputStream->index, codecName);
+		// Adaptive encoders switch among codecs with different pixel formats
+		bool detectReduction = cmd.planeReduction() && cmd.targetFps() == 0;
+		std::vector<AVPacket*> samples;
+		if (cmd.autoVideoCodecPolicy() || detectReduction)
+		{
+			samples = (sequence != nullptr)
+				? readSequenceSampleFrames(cmd, SAMPLE_FRAME_COUNT)
+				: readSampleFrames(inputFilename, i, nullptr, SAMPLE_FRAME_COUNT);
+		}
 
-		Encoder *encoder = nullptr;
-		if (strcmp(codecName, "rawvideo") == 0)
+		VideoSettings settings = { cmd.videoCodec(), nullptr, PlaneReduction() };
+		if (cmd.autoVideoCodecPolicy())
+			settings.codec = autoSelectVideoCodec(cmd, inputStream, samples, videoEncoderThreadCount(videoStreamCount), &settings.opts);
+		else
+			cmd.fillVideoCodecOptions(&settings.opts);
+
+		if (detectReduction)
+			settings.reduction = detectPlaneReduction(inputStream, samples, avcodec_find_encoder(settings.codec));
+
+		for (AVPacket *&sample : samples)
+			av_packet_free(&sample);
+
+		videoSettings.emplace(i, settings);
+	}
+
+	PacketReferences packetRefs;
+	ProxyWriter *proxy = cmd.proxyWidth() != 0 ? new ProxyWriter(cmd.proxyFile(), cmd.proxyWidth()) : nullptr;
+
+	auto createEncoders = [&](AVFormatContext *outputFormatContext)
+	{
+		std::map<int, Encoder*> encoders;
+
+		logDebug("Encoders:\n");
+		for (unsigned int i = 0; i < inputFormatContext->nb_streams; i++)
 		{
-			logDebug("%s\n", avcodec_get_name(cmd.videoCodec()));
+			const AVStream *inputStream = inputFormatContext->streams[i];
+			AVCodecParameters *inputCodecParameters = inputStream->codecpar;
+
+			const char *codecName = avcodec_get_name(inputCodecParameters->codec_id); // never nullptr (according to documentation)
+			logDebug("  Stream #0:%d: input_codec=%s output_codec=", inputStream->index, codecName);
 
-			AVDictionary *opts = nullptr;
-			cmd.fillVideoCodecOptions(&opts);
-			encoder = new VideoEncoder(inputStream, outputFormatContext, &packetRefs, cmd.videoCodec(), &opts);
-			errorIfUnusedOptions(opts);
-			av_dict_free(&opts);
+			Encoder *encoder = nullptr;
+			if (strcmp(codecName, "rawvideo") == 0)
+			{
+				const VideoSettings &settings = videoSettings.at(i);
+				logDebug("%s\n", avcodec_get_name(settings.codec));
+
+				int threadCount = videoEncoderThreadCount(videoStreamCount);
+
+				AVDictionary *opts = nullptr;
+				av_dict_copy(&opts, settings.opts, 0);
+
+				if (cmd.targetFps() != 0)
+				{
+					AdaptiveVideoEncoder *adaptiveEncoder = new AdaptiveVideoEncoder(inputStream, outputFormatContext, &packetRefs, settings.codec, &opts, threadCount, cmd.targetFps());
+					if (proxy != nullptr)
+						adaptiveEncoder->enableProxy(proxy);
+					encoder = adaptiveEncoder;
+				}
+				else
+				{
+					VideoEncoder *videoEncoder = new VideoEncoder(inputStream, outputFormatContext, &packetRefs, settings.codec, &opts, threadCount, settings.reduction);
+					if (cmd.rawFallbackRatio() != 0)
+						videoEncoder->enableRawFallback(cmd.rawFallbackRatio());
+					if (proxy != nullptr)
+						videoEncoder->enableProxy(proxy);
+					encoder = videoEncoder;
+				}
+				errorIfUnusedOptions(opts);
+				av_dict_free(&opts);
+			}
+			else if (cmd.audioCodec() == AV_CODEC_ID_FLAC && AudioEncoder::isSupported(inputStream))
+			{
+				logDebug("flac\n");
+				encoder = new AudioEncoder(inputStream, outputFormatContext, &packetRefs);
+			}
+
+			if (encoder == nullptr)
+			{
+				logDebug("copy\n");
+				encoder = new CopyEncoder(inputStream, outputFormatContext, &packetRefs);
+			}
+
+			encoders.emplace(inputStream->index, encoder);
 		}
 
-		if (encoder == nullptr)
+		return encoders;
+	};
+
+	// If resuming, the output file that was being written becomes the source
+	// of the packets that were encoded before the last checkpoint
+	Checkpoint checkpoint;
+	uint32_t generation = 0; // of the checkpoints written by this run
+	std::string sourceFilename;
+	if (cmd.resume())
+	{
+		checkpoint = readCheckpoint(cmd.checkpointFile());
+
+		if (checkpoint.inputFileSize != avio_size(inputFormatContext->pb))
+			logError("Input file size does not match the checkpoint\n");
+
+		if (checkpoint.aviReader != (aviReader != nullptr))
+			logError("Input file is not read as in the interrupted run (--mmap and --direct-io must be set as before)\n");
+
+		// If a previous attempt to resume from the same checkpoint was
+		// interrupted too, the current output file is incomplete and the
+		// source has already been renamed. A source of an older generation is
+		// only left behind if it was interrupted before deleting it, after
+		// writing this checkpoint: it is stale.
+		generation = checkpoint.generation + 1;
+		sourceFilename = partialFilename(outputFilename, checkpoint.generation);
+		if (access(sourceFilename.c_str(), F_OK) != 0)
 		{
-			logDebug("copy\n");
-			encoder = new CopyEncoder(inputStream, outputFormatContext, &packetRefs);
+			if (rename(outputFilename, sourceFilename.c_str()) != 0)
+				logError("rename: %s: %s\n", outputFilename, strerror(errno));
+			syncParentDirectory(sourceFilename.c_str());
 		}
 
-		encoders.emplace(inputStream->index, encoder);
+		if (checkpoint.generation != 0)
+			unlink(partialFilename(outputFilename, checkpoint.generation - 1).c_str());
 	}
 
-	av_dump_format(outputFormatContext, 0, outputFilename, true);
+	// If the output is split into segments, each one is written like a
+	// whole output file, with its own encoders, and the LLR file of OUTPUT
+	// becomes the manifest that lists them
+	bool segmented = cmd.segmentSize() != 0 || cmd.segmentTime() != 0;
+	SegmentManifest manifest;
+	manifest.originalFileSize = avio_size(inputFormatContext->pb);
 
-	if ((outputFormatContext->oformat->flags & AVFMT_NOFILE) == 0)
-		failOnAVERROR(avio_open(&outputFormatContext->pb, outputFilename, AVIO_FLAG_WRITE), "avio_open: %s", outputFilename);
+	std::optional<std::pair<int64_t, int64_t>> inputRange = cmd.inputRange();
 
-	AVIOContext *llrFile;
-	failOnAVERROR(avio_open(&llrFile, llrFilename, AVIO_FLAG_WRITE), "avio_open: %s", llrFilename);
+	MemoryBudget memoryBudget(cmd.maxMemory());
+	memoryBudget.trackPacketReferences(&packetRefs);
+	ArchiveStore *store = cmd.storeDirectory() != nullptr ? new ArchiveStore(cmd.storeDirectory()) : nullptr;
 
-	failOnAVERROR(avformat_write_header(outputFormatContext, nullptr), "avformat_write_header");
+	std::map<int, Encoder*> encoders;
+	EncoderPipeline *pipeline = nullptr;
+	AVIOContext *llrFile = nullptr;
+
+	auto openOutput = [&](const char *filename, const char *llrFilename)
+	{
+		failOnAVERROR(avformat_alloc_output_context2(&outputFormatContext, nullptr, "matroska", filename), "avformat_alloc_output_context2: %s", filename);
+
+		packetRefs = PacketReferences();
+		encoders = createEncoders(outputFormatContext);
+
+		av_dump_format(outputFormatContext, 0, filename, true);
+
+		if ((outputFormatContext->oformat->flags & AVFMT_NOFILE) == 0)
+			failOnAVERROR(openWriteBehind(&outputFormatContext->pb, filename), "openWriteBehind: %s", filename);
+
+		failOnAVERROR(openWriteBehind(&llrFile, llrFilename), "openWriteBehind: %s", llrFilename);
+
+		failOnAVERROR(avformat_write_header(outputFormatContext, nullptr), "avformat_write_header");
+	};
+
+	auto closeOutput = [&](int64_t rangeStart, int64_t rangeEnd)
+	{
+		delete pipeline; // waits for pending packets
+		pipeline = nullptr;
+
+		if (proxy != nullptr)
+		{
+			proxy->writeTrailer();
+			delete proxy;
+			proxy = nullptr;
+		}
+
+		const uint8_t *mappedData = mappedInput != nullptr ? mappedInput->data() : nullptr;
+		if (segmented)
+		{
+			writeSegmentLLR(inputFormatContext->pb, mappedData, &packetRefs, llrFile, cmd.hashName().c_str(), store, rangeStart, rangeEnd);
+		}
+		else if (inputRange.has_value())
+		{
+			PartialLLRInfo partialInfo;
+			partialInfo.originalFileSize = avio_size(inputFormatContext->pb);
+			partialInfo.rangeStart = rangeStart;
+			partialInfo.rangeEnd = rangeEnd;
+			writePartialLLR(partialInfo, &packetRefs, llrFile);
+		}
+		else
+		{
+			writeLLR(inputFormatContext->pb, mappedData, &packetRefs, llrFile,
+				cmd.hashName().c_str(), sequence != nullptr ? sequence->files() : std::vector<SequenceFile>(), store);
+		}
+
+		failOnAVERROR(av_write_trailer(outputFormatContext), "av_write_trailer");
+
+		if ((outputFormatContext->oformat->flags & AVFMT_NOFILE) == 0)
+			failOnAVERROR(closeWriteBehind(&outputFormatContext->pb), "closeWriteBehind");
+
+		failOnAVERROR(closeWriteBehind(&llrFile), "closeWriteBehind");
+
+		for (const auto it : encoders)
+			delete it.second;
+		encoders.clear();
+
+		avformat_free_context(outputFormatContext);
+		outputFormatContext = nullptr;
+	};
+
+	auto openSegment = [&](int64_t rangeStart)
+	{
+		size_t index = manifest.segments.size();
+		std::string filename = cmd.segmentFile(index), segmentLlrFilename = cmd.segmentLlrFile(index);
+		logDebug("Starting segment %zu at input offset %" PRIi64 "\n", index, rangeStart);
+
+		// The manifest is next to the segments, so it only stores their base name
+		size_t slash = filename.rfind('/');
+		manifest.segments.push_back({ filename.substr(slash == std::string::npos ? 0 : slash + 1), rangeStart, rangeStart });
+
+		openOutput(filename.c_str(), segmentLlrFilename.c_str());
+		pipeline = new EncoderPipeline(encoders, &memoryBudget, cmd.deduplicateFrames(), store);
+	};
+
+	auto closeSegment = [&](int64_t rangeEnd)
+	{
+		SegmentManifest::Segment &segment = manifest.segments.back();
+		segment.rangeEnd = rangeEnd;
+		closeOutput(segment.rangeStart, segment.rangeEnd);
+	};
+
+	if (segmented)
+	{
+		openSegment(0);
+	}
+	else
+	{
+		openOutput(outputFilename, llrFilename);
+
+		if (proxy != nullptr)
+			proxy->writeHeader();
+	}
 
 	AVPacket *packet = av_packet_alloc();
+	int64_t inputPacketCount = 0;
+
+	if (cmd.resume())
+	{
+		resumeFromCheckpoint(checkpoint, sourceFilename.c_str(), cmd.readAheadSize(), encoders, &packetRefs);
+
+		logDebug("Skipping %" PRIi64 " input packets\n", checkpoint.inputPacketCount);
+		while (inputPacketCount != checkpoint.inputPacketCount)
+		{
+			int errnum = readInputPacket(inputFormatContext, sequence, aviReader, packet);
+			if (errnum == AVERROR_EOF)
+				logError("Input file is shorter than the checkpoint\n");
+			else
+				failOnAVERROR(errnum, "readInputPacket");
+
+			av_packet_unref(packet);
+			inputPacketCount++;
+		}
+	}
+
+	int64_t checkpointInterval = cmd.checkpointInterval() * (int64_t)AV_TIME_BASE;
+	int64_t nextCheckpointTime = av_gettime_relative() + checkpointInterval;
+
+	// A segment can only end where no packet of the segment continues past
+	// the boundary, i.e. after the furthest end of the packets submitted to it
+	int64_t segmentDataEnd = 0;
+	int64_t segmentStartTime = AV_NOPTS_VALUE;
+	bool segmentHasPackets = false;
+
+	if (pipeline == nullptr)
+		pipeline = new EncoderPipeline(encoders, &memoryBudget, cmd.deduplicateFrames(), store);
+
 	while (true)
 	{
-		int errnum = av_read_frame(inputFormatContext, packet);
+		if (checkpointInterval != 0 && av_gettime_relative() >= nextCheckpointTime)
+		{
+			pipeline->flush();
+			saveCheckpoint(cmd, generation, inputFormatContext, aviReader != nullptr, inputPacketCount, outputFormatContext, encoders, packetRefs);
+			if (cmd.resume())
+				unlink(sourceFilename.c_str()); // no longer needed
+			nextCheckpointTime = av_gettime_relative() + checkpointInterval;
+		}
+
+		int errnum = readInputPacket(inputFormatContext, sequence, aviReader, packet);
 		if (errnum == AVERROR_EOF)
 			break;
 		else
-			failOnAVERROR(errnum, "av_read_frame");
+			failOnAVERROR(errnum, "readInputPacket");
 
 		logDebug("Input packet: Stream #0:%d (pos %" PRIi64 " size %u) - pts %" PRIi64 " dts %" PRIi64 " duration %" PRIi64 "\n",
 			packet->stream_index, packet->pos, packet->size, packet->pts, packet->dts, packet->duration);
 
-		Encoder *encoder = encoders.at(packet->stream_index);
-		encoder->processPacket(packet);
+		if (inputRange.has_value())
+		{
+			// Packets are not always returned in file order (e.g. in
+			// non-interleaved files), so reading continues past the range.
+			// Packets that are not referenced by any part end up being
+			// embedded in the LLR file when merging.
+			if (packet->pos < inputRange->first || packet->pos >= inputRange->second)
+			{
+				logDebug(" -> Skipped (out of range)\n");
+				av_packet_unref(packet);
+				continue;
+			}
+		}
+
+		if (segmented)
+		{
+			if (packet->pos < manifest.segments.back().rangeStart)
+				logError("Input packets are not stored in file order, the output cannot be split into segments\n");
+
+			int64_t time = AV_NOPTS_VALUE;
+			if (packet->pts != AV_NOPTS_VALUE)
+				time = av_rescale_q(packet->pts, inputFormatContext->streams[packet->stream_index]->time_base, AV_TIME_BASE_Q);
+
+			bool full = (cmd.segmentSize() != 0 && avio_tell(outputFormatContext->pb) >= (int64_t)cmd.segmentSize()) ||
+				(cmd.segmentTime() != 0 && time != AV_NOPTS_VALUE && segmentStartTime != AV_NOPTS_VALUE &&
+				time - segmentStartTime >= cmd.segmentTime() * (int64_t)AV_TIME_BASE);
+
+			if (full && segmentHasPackets && packet->pos >= segmentDataEnd)
+			{
+				closeSegment(packet->pos);
+				openSegment(packet->pos);
+				segmentStartTime = AV_NOPTS_VALUE;
+				segmentHasPackets = false;
+			}
+
+			if (segmentStartTime == AV_NOPTS_VALUE)
+				segmentStartTime = time;
+
+			segmentDataEnd = std::max(segmentDataEnd, packet->pos + packet->size);
+			segmentHasPackets = true;
+		}
+
+		// The demuxer has copied the data, but the copy is released right
+		// away and the pipeline only keeps a reference to the mapping
+		if (mappedInput != nullptr)
+			mappedInput->referencePacket(packet);
+
+		pipeline->submit(packet);
 
 		av_packet_unref(packet);
+		inputPacketCount++;
 	}
 
 	av_packet_free(&packet);
 
-	writeLLR(inputFormatContext->pb, &packetRefs, llrFile, cmd.hashName().c_str());
+	if (segmented)
+	{
+		closeSegment(manifest.originalFileSize);
 
-	failOnAVERROR(av_write_trailer(outputFormatContext), "av_write_trailer");
+		failOnAVERROR(openWriteBehind(&llrFile, llrFilename), "openWriteBehind: %s", llrFilename);
+		writeSegmentManifest(manifest, llrFile);
+		failOnAVERROR(closeWriteBehind(&llrFile), "closeWriteBehind");
+	}
+	else if (inputRange.has_value())
+	{
+		closeOutput(inputRange->first, std::min(inputRange->second, avio_size(inputFormatContext->pb)));
+	}
+	else
+	{
+		closeOutput(0, avio_size(inputFormatContext->pb));
+	}
 
-	if ((outputFormatContext->oformat->flags & AVFMT_NOFILE) == 0)
-		failOnAVERROR(avio_closep(&outputFormatContext->pb), "avio_closep");
+	delete aviReader;
+	delete store;
 
-	failOnAVERROR(avio_closep(&llrFile), "avio_closep");
+	for (auto &[streamIndex, settings] : videoSettings)
+		av_dict_free(&settings.opts);
 
-	for (const auto it : encoders)
-		delete it.second;
+	if (sequence != nullptr)
+	{
+		delete sequence;
+	}
+	else if (mappedInput != nullptr)
+	{
+		mappedInput->closeInputFormat(&inputFormatContext);
+		delete mappedInput;
+	}
+	else
+	{
+		closeInputFormat(&inputFormatContext);
+	}
 
-	avformat_close_input(&inputFormatContext);
-	avformat_free_context(outputFormatContext);
+	// The job is complete, checkpoints are no longer needed
+	unlink(cmd.checkpointFile());
+	if (cmd.resume())
+		unlink(sourceFilename.c_str());
 
 	return EXIT_SUCCESS;
 }
 
-static bool verifyHash(AVIOContext *file, int64_t fileSize, const char *hashName, const std::vector<uint8_t> &expectedHash)
+// Hashes fileSize bytes of file, starting at offset
+static bool verifyHash(AVIOContext *file, int64_t offset, int64_t fileSize, const char *hashName, const std::vector<uint8_t> &expectedHash)
 {
-	static unsigned char buffer[4096];
+	std::vector<unsigned char> buffer(HASH_BUFFER_SIZE);
 
 	AVHashContext *hashCtx;
 	int r = av_hash_alloc(&hashCtx, hashName);
@@ -155,19 +702,19 @@ static bool verifyHash(AVIOContext *file, int64_t fileSize, const char *hashName
 		logError("Hash verification failed: hash size mismatch\n");
 
 	int64_t pos = 0;
-	seekOrFail(file, 0);
+	seekOrFail(file, offset);
 
 	logDebug("Computing final hash:\n");
 	while (pos != fileSize)
 	{
-		int r = avio_read(file, buffer, std::min<int64_t>(fileSize - pos, sizeof(buffer)));
+		int r = avio_read(file, buffer.data(), std::min<int64_t>(fileSize - pos, buffer.size()));
 		if (r == 0)
 			logError("avio_read_partial: Premature end of file\n");
 		else if (r < 0)
 			failOnAVERROR(r, "avio_read_partial");
 
 		logDebug("   -> %" PRIi64 "-%" PRIi64 ": size %d\n", pos, pos + r, r);
-		av_hash_update(hashCtx, buffer, r);
+		av_hash_update(hashCtx, buffer.data(), r);
 
 		pos += r;
 	}
@@ -188,26 +735,66 @@ static bool verifyHash(AVIOContext *file, int64_t fileSize, const char *hashName
 	return false;
 }
 
-static int decompress(const CommandLine &cmd)
+// Restores the original file of a .mkv/.llr pair and returns whether its hash
+// matches. If outputOffset is not -1, the original data is written at this
+// offset of outputFilename, which is not truncated (see openWriteBehindAt).
+static bool decompressFile(const CommandLine &cmd, const char *inputFilename, const char *llrFilename, const char *outputFilename,
+	int64_t outputOffset = -1)
 {
 	AVFormatContext *inputFormatContext = nullptr;
 
-	const char *inputFilename = cmd.inputFile();
-	const char *outputFilename = cmd.outputFile();
-	const char *llrFilename = cmd.llrFile();
-
-	failOnAVERROR(avformat_open_input(&inputFormatContext, inputFilename, nullptr, nullptr), "avformat_open_input: %s", inputFilename);
+	failOnAVERROR(openInputFormat(&inputFormatContext, inputFilename, cmd.readAheadSize()), "openInputFormat: %s", inputFilename);
 	failOnAVERROR(avformat_find_stream_info(inputFormatContext, nullptr), "avformat_find_stream_info");
 	av_dump_format(inputFormatContext, 0, inputFilename, false);
 
 	AVIOContext *llrFile, *outputFile;
-	failOnAVERROR(avio_open(&llrFile, llrFilename, AVIO_FLAG_READ), "avio_open: %s", llrFilename);
-	failOnAVERROR(avio_open(&outputFile, outputFilename, AVIO_FLAG_READ_WRITE | AVIO_FLAG_DIRECT), "avio_open: %s", outputFilename);
+	failOnAVERROR(openReadAhead(&llrFile, llrFilename, cmd.readAheadSize()), "openReadAhead: %s", llrFilename);
+	const LLRInfo info = readLLRInfo(llrFile);
+
+	// Image sequences are restored into a directory, possibly only one of
+	// their files. Its range is the part of the original data to be restored.
+	bool isSequence = !info.sequenceFiles.empty();
+	int onlyFile = -1;
+	int64_t rangeStart = 0, rangeEnd = info.originalFileSize;
+
+	if (cmd.restoreFile() != nullptr)
+	{
+		if (!isSequence)
+			logError("--file can only be used with image sequences\n");
+
+		for (size_t i = 0; i < info.sequenceFiles.size() && onlyFile == -1; i++)
+		{
+			if (info.sequenceFiles[i].name == cmd.restoreFile())
+			{
+				onlyFile = i;
+				rangeEnd = rangeStart + info.sequenceFiles[i].size;
+			}
+			else
+			{
+				rangeStart += info.sequenceFiles[i].size;
+			}
+		}
+
+		if (onlyFile == -1)
+			logError("%s is not part of the image sequence\n", cmd.restoreFile());
+	}
+
+	if (isSequence && outputOffset != -1)
+		logError("%s: image sequences cannot be restored into a part of a file\n", llrFilename);
+
+	if (isSequence)
+		failOnAVERROR(openSequenceOutput(&outputFile, outputFilename, info.sequenceFiles, onlyFile), "openSequenceOutput: %s", outputFilename);
+	else if (outputOffset != -1)
+		failOnAVERROR(openWriteBehindAt(&outputFile, outputFilename, outputOffset), "openWriteBehindAt: %s", outputFilename);
+	else
+		failOnAVERROR(openWriteBehind(&outputFile, outputFilename), "openWriteBehind: %s", outputFilename);
 
 	std::map<int, Decoder*> decoders;
 	PacketReferences packetRefs;
 
-	const LLRInfo info = readLLR(llrFile, &packetRefs, outputFile);
+	ArchiveStore *store = cmd.storeDirectory() != nullptr ? new ArchiveStore(cmd.storeDirectory()) : nullptr;
+	readLLR(llrFile, info, &packetRefs, outputFile, store);
+	delete store;
 	if (packetRefs.streams().size() != inputFormatContext->nb_streams)
 		logError("Stream count mismatch\n");
 
@@ -226,6 +813,7 @@ static int decompress(const CommandLine &cmd)
 		switch (info.type)
 		{
 			case Video:
+			case ReducedVideo:
 			{
 				logDebug("rawvideo %s\n", info.pixelFormat.c_str());
 
@@ -233,7 +821,18 @@ static int decompress(const CommandLine &cmd)
 				if (outputPixelFormat == AV_PIX_FMT_NONE)
 					logError("Invalid pixel format string\n");
 
-				decoder = new VideoDecoder(inputStream, outputPixelFormat);
+				decoder = new VideoDecoder(inputStream, outputPixelFormat, info.reduction);
+				break;
+			}
+			case Audio:
+			{
+				logDebug("%s\n", info.pcmCodec.c_str());
+
+				const AVCodecDescriptor *outputCodec = avcodec_descriptor_get_by_name(info.pcmCodec.c_str());
+				if (outputCodec == nullptr)
+					logError("Invalid PCM codec string\n");
+
+				decoder = new AudioDecoder(inputStream, outputCodec->id);
 				break;
 			}
 			case Copy:
@@ -250,14 +849,26 @@ static int decompress(const CommandLine &cmd)
 	}
 
 	// Build reverse packet mapping (streamIndex, packetIndex, pts) -> (origPos, origSize)
-	std::map<std::tuple<int, size_t, int64_t>, std::pair<int64_t, int>> reverseRefs;
-	for (const auto &[origPos, e] : packetRefs.table())
-		reverseRefs.insert({{e.streamIndex, e.packetIndex, e.pts}, {origPos, e.origSize}});
+	auto reverseRefs = packetRefs.reverseTable();
+
+	auto inRange = [&](const std::pair<int64_t, int> &origRange)
+	{
+		if (onlyFile == -1)
+			return true;
+
+		return origRange.first < rangeEnd && origRange.first + origRange.second > rangeStart;
+	};
+
+	size_t remainingInRange = std::count_if(reverseRefs.begin(), reverseRefs.end(), [&](const auto &e) { return inRange(e.second); });
+
+	// Packets outside of the range are only decoded if a packet in the range
+	// depends on them, i.e. from the last keyframe before it
+	std::map<int, std::vector<AVPacket*>> skippedPackets;
 
 	// Decode (uncompress) packets
 	std::map<int, size_t> packetIndexPerStream;
-	AVPacket *packet = av_packet_alloc();
-	while (true)
+	AVPacket *packet = av_packet_alloc(), *rawPacket = av_packet_alloc();
+	while (remainingInRange != 0)
 	{
 		int errnum = av_read_frame(inputFormatContext, packet);
 		if (errnum == AVERROR_EOF)
@@ -269,39 +880,671 @@ static int decompress(const CommandLine &cmd)
 		logDebug("Input packet: Stream #0:%d (index %zu) - pts %" PRIi64 " dts %" PRIi64 " duration %" PRIi64 "\n",
 			packet->stream_index, packetIndex, packet->pts, packet->dts, packet->duration);
 
-		auto it = reverseRefs.find({packet->stream_index, packetIndex, packet->pts});
-		if (it == reverseRefs.end())
+		// Duplicate frames have been encoded once, and are restored to all
+		// their original positions. Frames that do not fit in a reduced
+		// format and PCM packets that end with a partial sample have no
+		// position, but the next packets may depend on them.
+		auto [first, last] = reverseRefs.equal_range({packet->stream_index, packetIndex, packet->pts});
+		if (first == last && !packetRefs.streams().at(packet->stream_index).mayHaveUnreferencedPackets())
 			logError("Failed to find destination block\n");
 
 		Decoder *decoder = decoders.at(packet->stream_index);
-		std::vector<uint8_t> uncompressedData = decoder->decodePacket(packet);
-		if (uncompressedData.size() != it->second.second) // check origSize
-			logError("Decoded to %zu bytes (actual) instead of %d bytes (expected)\n", uncompressedData.size(), it->second.second);
+		std::vector<AVPacket*> &skipped = skippedPackets[packet->stream_index];
 
-		int64_t start = it->second.first; // origPos
-		logDebug(" -> %" PRIi64 "-%" PRIi64 ": writing %" PRIi64 " bytes\n", start, start + uncompressedData.size(), uncompressedData.size());
+		if (std::none_of(first, last, [&](const auto &e) { return inRange(e.second); }))
+		{
+			logDebug(" -> Outside of the file being restored\n");
 
-		seekOrFail(outputFile, start);
-		writeInChunks(outputFile, uncompressedData.data(), (int)uncompressedData.size());
+			if (packet->flags & AV_PKT_FLAG_KEY)
+			{
+				for (AVPacket *p : skipped)
+					av_packet_free(&p);
+				skipped.clear();
+			}
 
-		reverseRefs.erase(it);
+			skipped.push_back(av_packet_clone(packet));
+			if (skipped.back() == nullptr)
+				logError("av_packet_clone failed\n");
+
+			reverseRefs.erase(first, last);
+			av_packet_unref(packet);
+			continue;
+		}
+
+		for (AVPacket *p : skipped)
+		{
+			decoder->decodePacket(p, rawPacket);
+			av_packet_unref(rawPacket);
+			av_packet_free(&p);
+		}
+
+		skipped.clear();
+
+		decoder->decodePacket(packet, rawPacket);
+		for (auto it = first; it != last; ++it)
+		{
+			if (!inRange(it->second))
+				continue;
+
+			if (rawPacket->size != it->second.second) // check origSize
+				logError("Decoded to %d bytes (actual) instead of %d bytes (expected)\n", rawPacket->size, it->second.second);
+
+			int64_t start = it->second.first; // origPos
+			logDebug(" -> %" PRIi64 "-%" PRIi64 ": writing %d bytes\n", start, start + rawPacket->size, rawPacket->size);
+
+			seekOrFail(outputFile, start);
+			writeInChunks(outputFile, rawPacket->data, rawPacket->size);
+			remainingInRange--;
+		}
+
+		reverseRefs.erase(first, last);
+		av_packet_unref(rawPacket);
 		av_packet_unref(packet);
 	}
 
+	av_packet_free(&rawPacket);
 	av_packet_free(&packet);
 
-	failOnAVERROR(avio_closep(&llrFile), "avio_closep");
+	for (auto &[streamIndex, skipped] : skippedPackets)
+	{
+		for (AVPacket *p : skipped)
+			av_packet_free(&p);
+	}
+
+	for (const auto it : decoders)
+		delete it.second;
+
+	failOnAVERROR(closeReadAhead(&llrFile), "closeReadAhead");
+
+	closeInputFormat(&inputFormatContext);
+
+	if (remainingInRange != 0)
+		logError("One or more source packets are missing\n");
+
+	// Verify hash, reading the restored file back sequentially
+	bool hashOk;
+	if (onlyFile != -1)
+	{
+		const SequenceFile &file = info.sequenceFiles[onlyFile];
+		std::string filename = std::string(outputFilename) + "/" + file.name;
+
+		failOnAVERROR(closeSequenceFiles(&outputFile), "closeSequenceFiles");
+		failOnAVERROR(openReadAhead(&outputFile, filename.c_str(), cmd.readAheadSize()), "openReadAhead: %s", filename.c_str());
+		hashOk = verifyHash(outputFile, 0, file.size, info.hashName.c_str(), file.hashBuffer);
+		failOnAVERROR(closeReadAhead(&outputFile), "closeReadAhead");
+	}
+	else if (isSequence)
+	{
+		failOnAVERROR(closeSequenceFiles(&outputFile), "closeSequenceFiles");
+		failOnAVERROR(openSequenceInput(&outputFile, outputFilename, info.sequenceFiles), "openSequenceInput: %s", outputFilename);
+		hashOk = verifyHash(outputFile, 0, info.originalFileSize, info.hashName.c_str(), info.hashBuffer);
+		failOnAVERROR(closeSequenceFiles(&outputFile), "closeSequenceFiles");
+	}
+	else
+	{
+		failOnAVERROR(closeWriteBehind(&outputFile), "closeWriteBehind");
+		failOnAVERROR(openReadAhead(&outputFile, outputFilename, cmd.readAheadSize()), "openReadAhead: %s", outputFilename);
+		hashOk = verifyHash(outputFile, std::max<int64_t>(outputOffset, 0), info.originalFileSize, info.hashName.c_str(), info.hashBuffer);
+		failOnAVERROR(closeReadAhead(&outputFile), "closeReadAhead");
+	}
+
+	return hashOk;
+}
+
+// Restores the segments straight into their range of the output file, several
+// of them at the same time
+static bool decompressSegments(const CommandLine &cmd, const SegmentManifest &manifest)
+{
+	const char *outputFilename = cmd.outputFile();
+
+	std::string directory = cmd.llrFile();
+	size_t slash = directory.rfind('/');
+	directory = (slash == std::string::npos) ? "" : directory.substr(0, slash + 1);
+
+	// A segment that does not match its range would overwrite its neighbors
+	for (const SegmentManifest::Segment &segment : manifest.segments)
+	{
+		std::string segmentLlrFilename = directory + segment.filename.substr(0, segment.filename.length() - 4) + ".llr";
+
+		AVIOContext *llrFile;
+		failOnAVERROR(openReadAhead(&llrFile, segmentLlrFilename.c_str(), cmd.readAheadSize()), "openReadAhead: %s", segmentLlrFilename.c_str());
+		if (readLLRInfo(llrFile).originalFileSize != segment.rangeEnd - segment.rangeStart)
+			logError("%s: original size does not match the segment manifest\n", segmentLlrFilename.c_str());
+		failOnAVERROR(closeReadAhead(&llrFile), "closeReadAhead");
+	}
+
+	// Truncate the output file, the segments then fill it
+	AVIOContext *outputFile;
+	failOnAVERROR(openWriteBehind(&outputFile, outputFilename), "openWriteBehind: %s", outputFilename);
+	failOnAVERROR(closeWriteBehind(&outputFile), "closeWriteBehind");
+
+	std::atomic<size_t> nextSegment(0);
+	std::atomic<bool> ok(true);
+
+	auto restoreSegments = [&]
+	{
+		for (size_t i = nextSegment++; i < manifest.segments.size(); i = nextSegment++)
+		{
+			const SegmentManifest::Segment &segment = manifest.segments[i];
+			std::string filename = directory + segment.filename;
+			std::string segmentLlrFilename = filename.substr(0, filename.length() - 4) + ".llr";
+			logDebug("Restoring segment %s: range %" PRIi64 "-%" PRIi64 "\n", filename.c_str(), segment.rangeStart, segment.rangeEnd);
+
+			if (!decompressFile(cmd, filename.c_str(), segmentLlrFilename.c_str(), outputFilename, segment.rangeStart))
+				ok = false;
+		}
+	};
+
+	size_t threadCount = std::min({ manifest.segments.size(), MAX_CONCURRENT_SEGMENTS, (size_t)availableCpuCount() });
+	logDebug("Restoring %zu segments with %zu threads\n", manifest.segments.size(), threadCount);
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < threadCount; i++)
+		threads.emplace_back(restoreSegments);
+
+	restoreSegments();
+
+	for (std::thread &thread : threads)
+		thread.join();
+
+	return ok;
+}
+
+static int decompress(const CommandLine &cmd)
+{
+	// The .llr file of a compression split into segments is a manifest, and
+	// the .mkv file does not exist
+	AVIOContext *llrFile;
+	failOnAVERROR(openReadAhead(&llrFile, cmd.llrFile(), cmd.readAheadSize()), "openReadAhead: %s", cmd.llrFile());
+	std::optional<SegmentManifest> manifest = readSegmentManifest(llrFile);
+	failOnAVERROR(closeReadAhead(&llrFile), "closeReadAhead");
+
+	bool ok;
+	if (manifest.has_value())
+		ok = decompressSegments(cmd, *manifest);
+	else
+		ok = decompressFile(cmd, cmd.inputFile(), cmd.llrFile(), cmd.outputFile());
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int recompress(const CommandLine &cmd)
+{
+	AVFormatContext *inputFormatContext = nullptr, *outputFormatContext = nullptr, *rawFormatContext = nullptr;
+
+	const char *inputFilename = cmd.inputFile();
+	const char *outputFilename = cmd.outputFile();
+	const char *sourceLlrFilename = cmd.sourceLlrFile();
+	const char *llrFilename = cmd.llrFile();
+
+	// The .mkv file of a segment manifest does not exist
+	AVIOContext *sourceLlrFile;
+	failOnAVERROR(openReadAhead(&sourceLlrFile, sourceLlrFilename, cmd.readAheadSize()), "openReadAhead: %s", sourceLlrFilename);
+	if (readSegmentManifest(sourceLlrFile).has_value())
+		logError("%s is a segment manifest, which cannot be recompressed: recompress each segment instead\n", sourceLlrFilename);
+	seekOrFail(sourceLlrFile, 0);
+
+	failOnAVERROR(openInputFormat(&inputFormatContext, inputFilename, cmd.readAheadSize()), "openInputFormat: %s", inputFilename);
+	failOnAVERROR(avformat_find_stream_info(inputFormatContext, nullptr), "avformat_find_stream_info");
+	av_dump_format(inputFormatContext, 0, inputFilename, false);
+
+	PacketReferences sourcePacketRefs;
+	const LLRInfo info = readLLRInfo(sourceLlrFile);
+	sourcePacketRefs.deserialize(sourceLlrFile);
+	if (sourcePacketRefs.streams().size() != inputFormatContext->nb_streams)
+		logError("Stream count mismatch\n");
+
+	failOnAVERROR(avformat_alloc_output_context2(&outputFormatContext, nullptr, "matroska", outputFilename), "avformat_alloc_output_context2: %s", outputFilename);
+
+	// Holds the description of the raw video streams that are fed to the new
+	// encoders (i.e. the raw frames as they were in the original file)
+	rawFormatContext = avformat_alloc_context();
+	if (rawFormatContext == nullptr)
+		logError("avformat_alloc_context failed\n");
+
+	std::map<int, Decoder*> decoders;
+	std::map<int, Encoder*> encoders;
+	PacketReferences packetRefs;
+	ProxyWriter *proxy = cmd.proxyWidth() != 0 ? new ProxyWriter(cmd.proxyFile(), cmd.proxyWidth()) : nullptr;
+
+	int videoStreamCount = std::count_if(sourcePacketRefs.streams().begin(), sourcePacketRefs.streams().end(),
+		[](const PacketReferences::StreamInfo &streamInfo) { return streamInfo.type == Video || streamInfo.type == ReducedVideo; });
+
+	logDebug("Transcoders:\n");
+	for (unsigned int i = 0; i < inputFormatContext->nb_streams; i++)
+	{
+		const PacketReferences::StreamInfo &streamInfo = sourcePacketRefs.streams().at(i);
+
+		const AVStream *inputStream = inputFormatContext->streams[i];
+		AVCodecParameters *inputCodecParameters = inputStream->codecpar;
+
+		const char *codecName = avcodec_get_name(inputCodecParameters->codec_id); // never nullptr (according to documentation)
+		logDebug("  Stream #0:%d: input_codec=%s output_codec=", inputStream->index, codecName);
+
+		Decoder *decoder = nullptr;
+		Encoder *encoder = nullptr;
+		switch (streamInfo.type)
+		{
+			case Video:
+			case ReducedVideo:
+			{
+				logDebug("%s (via rawvideo %s)\n", cmd.autoVideoCodecPolicy() ? "auto" : avcodec_get_name(cmd.videoCodec()),
+					streamInfo.pixelFormat.c_str());
+
+				AVPixelFormat rawPixelFormat = av_get_pix_fmt(streamInfo.pixelFormat.c_str());
+				if (rawPixelFormat == AV_PIX_FMT_NONE)
+					logError("Invalid pixel format string\n");
+
+				decoder = new VideoDecoder(inputStream, rawPixelFormat, streamInfo.reduction);
+
+				AVStream *rawStream = avformat_new_stream(rawFormatContext, nullptr);
+				if (rawStream == nullptr)
+					logError("avformat_new_stream failed\n");
+
+				AVCodecParameters *rawCodecParameters = rawStream->codecpar;
+				rawCodecParameters->codec_type = AVMEDIA_TYPE_VIDEO;
+				rawCodecParameters->codec_id = AV_CODEC_ID_RAWVIDEO;
+				rawCodecParameters->format = rawPixelFormat;
+				rawCodecParameters->width = inputCodecParameters->width;
+				rawCodecParameters->height = inputCodecParameters->height;
+				rawCodecParameters->sample_aspect_ratio = inputCodecParameters->sample_aspect_ratio;
+				rawCodecParameters->field_order = inputCodecParameters->field_order;
+				rawCodecParameters->color_range = inputCodecParameters->color_range;
+				rawCodecParameters->color_primaries = inputCodecParameters->color_primaries;
+				rawCodecParameters->color_trc = inputCodecParameters->color_trc;
+				rawCodecParameters->color_space = inputCodecParameters->color_space;
+				rawCodecParameters->chroma_location = inputCodecParameters->chroma_location;
+				rawStream->time_base = inputStream->time_base;
+				rawStream->avg_frame_rate = inputStream->avg_frame_rate;
+				rawStream->duration = inputStream->duration;
+
+				int threadCount = videoEncoderThreadCount(videoStreamCount);
+
+				// The reduction of the source stream holds for all the
+				// frames that are referenced, without sampling them again
+				bool detectReduction = cmd.planeReduction() && streamInfo.type == Video;
+				std::vector<AVPacket*> samples;
+				if (cmd.autoVideoCodecPolicy() || detectReduction)
+				{
+					VideoDecoder sampleDecoder(inputStream, rawPixelFormat, streamInfo.reduction);
+					samples = readSampleFrames(inputFilename, i, &sampleDecoder, SAMPLE_FRAME_COUNT);
+				}
+
+				AVCodecID videoCodec = cmd.videoCodec();
+				AVDictionary *opts = nullptr;
+				if (cmd.autoVideoCodecPolicy())
+					videoCodec = autoSelectVideoCodec(cmd, rawStream, samples, threadCount, &opts);
+				else
+					cmd.fillVideoCodecOptions(&opts);
+
+				PlaneReduction reduction;
+				if (detectReduction)
+					reduction = detectPlaneReduction(rawStream, samples, avcodec_find_encoder(videoCodec));
+				else if (cmd.planeReduction())
+					reduction = fitPlaneReduction(rawPixelFormat, streamInfo.reduction, avcodec_find_encoder(videoCodec));
+
+				for (AVPacket *&sample : samples)
+					av_packet_free(&sample);
+
+				VideoEncoder *videoEncoder = new VideoEncoder(rawStream, outputFormatContext, &packetRefs, videoCodec, &opts, threadCount, reduction);
+				if (proxy != nullptr)
+					videoEncoder->enableProxy(proxy);
+				encoder = videoEncoder;
+				errorIfUnusedOptions(opts);
+				av_dict_free(&opts);
+				break;
+			}
+			case Audio:
+			{
+				const AVCodecDescriptor *rawCodec = avcodec_descriptor_get_by_name(streamInfo.pcmCodec.c_str());
+				if (rawCodec == nullptr || findPcmFormat(rawCodec->id) == nullptr)
+					logError("Invalid PCM codec string\n");
+
+				decoder = new AudioDecoder(inputStream, rawCodec->id);
+
+				AVStream *rawStream = avformat_new_stream(rawFormatContext, nullptr);
+				if (rawStream == nullptr)
+					logError("avformat_new_stream failed\n");
+
+				int bytesPerSample = findPcmFormat(rawCodec->id)->bytesPerSample;
+
+				AVCodecParameters *rawCodecParameters = rawStream->codecpar;
+				rawCodecParameters->codec_type = AVMEDIA_TYPE_AUDIO;
+				rawCodecParameters->codec_id = rawCodec->id;
+				rawCodecParameters->sample_rate = inputCodecParameters->sample_rate;
+				rawCodecParameters->channels = inputCodecParameters->channels;
+				rawCodecParameters->channel_layout = inputCodecParameters->channel_layout;
+				rawCodecParameters->bits_per_coded_sample = bytesPerSample * 8;
+				rawCodecParameters->block_align = bytesPerSample * inputCodecParameters->channels;
+				rawStream->time_base = inputStream->time_base;
+				rawStream->duration = inputStream->duration;
+
+				if (cmd.audioCodec() == AV_CODEC_ID_FLAC)
+				{
+					logDebug("flac (via %s)\n", rawCodec->name);
+					encoder = new AudioEncoder(rawStream, outputFormatContext, &packetRefs);
+				}
+				else
+				{
+					logDebug("copy (via %s)\n", rawCodec->name);
+					encoder = new CopyEncoder(rawStream, outputFormatContext, &packetRefs);
+				}
+				break;
+			}
+			case Copy:
+			{
+				// PCM audio that was stored as it is can be encoded now
+				if (cmd.audioCodec() == AV_CODEC_ID_FLAC && AudioEncoder::isSupported(inputStream))
+				{
+					logDebug("flac\n");
+					encoder = new AudioEncoder(inputStream, outputFormatContext, &packetRefs);
+				}
+				else
+				{
+					logDebug("copy\n");
+					encoder = new CopyEncoder(inputStream, outputFormatContext, &packetRefs);
+				}
+				break;
+			}
+			default:
+				abort();
+		}
+
+		if (decoder != nullptr)
+			decoders.emplace(inputStream->index, decoder);
+		encoders.emplace(inputStream->index, encoder);
+	}
+
+	av_dump_format(outputFormatContext, 0, outputFilename, true);
+
+	if ((outputFormatContext->oformat->flags & AVFMT_NOFILE) == 0)
+		failOnAVERROR(openWriteBehind(&outputFormatContext->pb, outputFilename), "openWriteBehind: %s", outputFilename);
+
+	AVIOContext *llrFile;
+	failOnAVERROR(openWriteBehind(&llrFile, llrFilename), "openWriteBehind: %s", llrFilename);
+
+	failOnAVERROR(avformat_write_header(outputFormatContext, nullptr), "avformat_write_header");
+
+	if (proxy != nullptr)
+		proxy->writeHeader();
+
+	// Each packet is re-encoded with the same origPos, so that the encoders
+	// build the new reference table on their own
+	auto reverseRefs = sourcePacketRefs.reverseTable();
+
+	std::map<int, size_t> packetIndexPerStream;
+	AVPacket *packet = av_packet_alloc(), *rawPacket = av_packet_alloc();
+	MemoryBudget memoryBudget(cmd.maxMemory());
+	memoryBudget.trackPacketReferences(&packetRefs);
+	ArchiveStore *store = cmd.storeDirectory() != nullptr ? new ArchiveStore(cmd.storeDirectory()) : nullptr;
+	EncoderPipeline *pipeline = new EncoderPipeline(encoders, &memoryBudget, cmd.deduplicateFrames(), store);
+	while (true)
+	{
+		int errnum = av_read_frame(inputFormatContext, packet);
+		if (errnum == AVERROR_EOF)
+			break;
+		else
+			failOnAVERROR(errnum, "av_read_frame");
+
+		size_t packetIndex = packetIndexPerStream[packet->stream_index]++;
+		logDebug("Input packet: Stream #0:%d (index %zu) - pts %" PRIi64 " dts %" PRIi64 " duration %" PRIi64 "\n",
+			packet->stream_index, packetIndex, packet->pts, packet->dts, packet->duration);
+
+		auto [first, last] = reverseRefs.equal_range({packet->stream_index, packetIndex, packet->pts});
+		if (first == last)
+		{
+			// Unreferenced packets are only decoded, since the next ones may
+			// depend on them. Their original data stays in the embedded chunks.
+			if (!sourcePacketRefs.streams().at(packet->stream_index).mayHaveUnreferencedPackets())
+				logError("Failed to find destination block\n");
+
+			logDebug(" -> Not referenced\n");
+			decoders.at(packet->stream_index)->decodePacket(packet, rawPacket);
+			av_packet_unref(rawPacket);
+			av_packet_unref(packet);
+			continue;
+		}
+
+		int origSize = first->second.second;
+
+		auto decoderIt = decoders.find(packet->stream_index);
+		if (decoderIt != decoders.end())
+		{
+			decoderIt->second->decodePacket(packet, rawPacket);
+			if (rawPacket->size != origSize)
+				logError("Decoded to %d bytes (actual) instead of %d bytes (expected)\n", rawPacket->size, origSize);
+
+			failOnAVERROR(av_packet_copy_props(rawPacket, packet), "av_packet_copy_props");
+		}
+		else
+		{
+			if (packet->size != origSize)
+				logError("Packet size mismatch\n");
+
+			failOnAVERROR(av_packet_ref(rawPacket, packet), "av_packet_ref");
+		}
+
+		// Duplicate frames are kept as such, without encoding them again
+		for (auto it = first; it != last; ++it)
+		{
+			if (it->second.second != origSize)
+				logError("Packet size mismatch\n");
+
+			rawPacket->pos = it->second.first; // origPos
+			pipeline->submit(rawPacket, it != first);
+		}
+
+		reverseRefs.erase(first, last);
+		av_packet_unref(rawPacket);
+		av_packet_unref(packet);
+	}
 
-	avformat_close_input(&inputFormatContext);
+	delete pipeline; // waits for pending packets
+	delete store;
+	av_packet_free(&rawPacket);
+	av_packet_free(&packet);
+
+	if (proxy != nullptr)
+	{
+		proxy->writeTrailer();
+		delete proxy;
+	}
 
 	if (!reverseRefs.empty())
 		logError("One or more source packets are missing\n");
 
-	// Verify hash
-	bool hashOk = verifyHash(outputFile, info.originalFileSize, info.hashName.c_str(), info.hashBuffer);
-	failOnAVERROR(avio_closep(&outputFile), "avio_closep");
+	// The original file has not changed, and neither did its embedded chunks
+	rewriteLLR(sourceLlrFile, info, &packetRefs, llrFile);
+
+	failOnAVERROR(av_write_trailer(outputFormatContext), "av_write_trailer");
+
+	if ((outputFormatContext->oformat->flags & AVFMT_NOFILE) == 0)
+		failOnAVERROR(closeWriteBehind(&outputFormatContext->pb), "closeWriteBehind");
+
+	failOnAVERROR(closeWriteBehind(&llrFile), "closeWriteBehind");
+	failOnAVERROR(closeReadAhead(&sourceLlrFile), "closeReadAhead");
+
+	for (const auto it : encoders)
+		delete it.second;
+	for (const auto it : decoders)
+		delete it.second;
+
+	closeInputFormat(&inputFormatContext);
+	avformat_free_context(outputFormatContext);
+	avformat_free_context(rawFormatContext);
+
+	return EXIT_SUCCESS;
+}
+
+static int merge(const CommandLine &cmd)
+{
+	AVFormatContext *outputFormatContext = nullptr;
+
+	const char *inputFilename = cmd.inputFile();
+	const char *outputFilename = cmd.outputFile();
+	const char *llrFilename = cmd.llrFile();
+
+	// The original file is only read to copy unreferenced chunks and compute
+	// the hash, therefore it is not demuxed
+	AVIOContext *inputFile;
+	failOnAVERROR(openReadAhead(&inputFile, inputFilename, cmd.readAheadSize()), "openReadAhead: %s", inputFilename);
+	int64_t inputSize = avio_size(inputFile);
+
+	struct Part
+	{
+		std::string filename;
+		AVFormatContext *formatContext;
+		PartialLLRInfo info;
+		PacketReferences packetRefs;
+	};
+
+	std::vector<Part> parts;
+	for (const std::string &filename : cmd.mergeFiles())
+	{
+		Part part;
+		part.filename = filename;
+		part.formatContext = nullptr;
+
+		std::string partLlrFilename = filename.substr(0, filename.length() - 4) + ".llr";
+		AVIOContext *partLlrFile;
+		failOnAVERROR(openReadAhead(&partLlrFile, partLlrFilename.c_str(), cmd.readAheadSize()), "openReadAhead: %s", partLlrFilename.c_str());
+		part.info = readPartialLLR(partLlrFile, &part.packetRefs);
+		failOnAVERROR(closeReadAhead(&partLlrFile), "closeReadAhead");
+
+		failOnAVERROR(openInputFormat(&part.formatContext, filename.c_str(), cmd.readAheadSize()), "openInputFormat: %s", filename.c_str());
+		failOnAVERROR(avformat_find_stream_info(part.formatContext, nullptr), "avformat_find_stream_info");
+
+		if (part.info.originalFileSize != inputSize)
+			logError("%s: input file size mismatch\n", filename.c_str());
+
+		parts.push_back(std::move(part));
+	}
+
+	// Parts can be given in any order, but together they must cover the whole input file
+	std::sort(parts.begin(), parts.end(), [](const Part &a, const Part &b) { return a.info.rangeStart < b.info.rangeStart; });
 
-	return hashOk ? EXIT_SUCCESS : EXIT_FAILURE;
+	int64_t expectedStart = 0;
+	for (const Part &part : parts)
+	{
+		if (part.info.rangeStart != expectedStart)
+			logError("%s: range %" PRIi64 "-%" PRIi64 " does not start at %" PRIi64 "\n",
+				part.filename.c_str(), part.info.rangeStart, part.info.rangeEnd, expectedStart);
+		expectedStart = part.info.rangeEnd;
+	}
+
+	if (expectedStart != inputSize)
+		logError("Parts do not cover the whole input file (%" PRIi64 "-%" PRIi64 " is missing)\n", expectedStart, inputSize);
+
+	// All parts must have been compressed with the same settings
+	const Part &firstPart = parts.front();
+	for (const Part &part : parts)
+	{
+		if (part.formatContext->nb_streams != firstPart.formatContext->nb_streams ||
+			part.packetRefs.streams().size() != firstPart.formatContext->nb_streams)
+		{
+			logError("%s: stream count mismatch\n", part.filename.c_str());
+		}
+
+		for (unsigned int i = 0; i < part.formatContext->nb_streams; i++)
+		{
+			const PacketReferences::StreamInfo &a = part.packetRefs.streams().at(i), &b = firstPart.packetRefs.streams().at(i);
+			const AVCodecParameters *pa = part.formatContext->streams[i]->codecpar, *pb = firstPart.formatContext->streams[i]->codecpar;
+
+			if (a.type != b.type || a.pixelFormat != b.pixelFormat || a.reduction != b.reduction || pa->codec_id != pb->codec_id ||
+				pa->extradata_size != pb->extradata_size || (pa->extradata_size != 0 && memcmp(pa->extradata, pb->extradata, pa->extradata_size) != 0))
+			{
+				logError("%s: Stream #0:%u does not match the other parts\n", part.filename.c_str(), i);
+			}
+		}
+	}
+
+	failOnAVERROR(avformat_alloc_output_context2(&outputFormatContext, nullptr, "matroska", outputFilename), "avformat_alloc_output_context2: %s", outputFilename);
+
+	PacketReferences packetRefs;
+	for (unsigned int i = 0; i < firstPart.formatContext->nb_streams; i++)
+	{
+		const AVStream *partStream = firstPart.formatContext->streams[i];
+
+		AVStream *outputStream = avformat_new_stream(outputFormatContext, nullptr);
+		if (outputStream == nullptr)
+			logError("avformat_new_stream failed\n");
+
+		failOnAVERROR(avcodec_parameters_copy(outputStream->codecpar, partStream->codecpar), "avcodec_parameters_copy");
+		outputStream->codecpar->codec_tag = 0;
+		outputStream->avg_frame_rate = partStream->avg_frame_rate;
+		outputStream->time_base = partStream->time_base;
+
+		packetRefs.addStream(firstPart.packetRefs.streams().at(i));
+	}
+
+	av_dump_format(outputFormatContext, 0, outputFilename, true);
+
+	if ((outputFormatContext->oformat->flags & AVFMT_NOFILE) == 0)
+		failOnAVERROR(openWriteBehind(&outputFormatContext->pb, outputFilename), "openWriteBehind: %s", outputFilename);
+
+	AVIOContext *llrFile;
+	failOnAVERROR(openWriteBehind(&llrFile, llrFilename), "openWriteBehind: %s", llrFilename);
+
+	failOnAVERROR(avformat_write_header(outputFormatContext, nullptr), "avformat_write_header");
+
+	// Concatenate packets, renumbering them with the offset of each stream
+	std::vector<size_t> packetIndexOffsets(outputFormatContext->nb_streams, 0);
+	AVPacket *packet = av_packet_alloc();
+
+	for (Part &part : parts)
+	{
+		logDebug("Merging %s:\n", part.filename.c_str());
+
+		std::vector<size_t> packetCounts(outputFormatContext->nb_streams, 0);
+		while (true)
+		{
+			int errnum = av_read_frame(part.formatContext, packet);
+			if (errnum == AVERROR_EOF)
+				break;
+			else
+				failOnAVERROR(errnum, "av_read_frame");
+
+			av_packet_rescale_ts(packet, part.formatContext->streams[packet->stream_index]->time_base,
+				outputFormatContext->streams[packet->stream_index]->time_base);
+			packet->pos = -1;
+			packetCounts.at(packet->stream_index)++;
+
+			failOnAVERROR(av_interleaved_write_frame(outputFormatContext, packet), "av_write_frame");
+		}
+
+		for (const auto &[origPos, e] : part.packetRefs.table())
+		{
+			if (e.packetIndex >= packetCounts.at(e.streamIndex))
+				logError("%s: reference to a missing packet\n", part.filename.c_str());
+
+			int64_t pts = av_rescale_q(e.pts, part.formatContext->streams[e.streamIndex]->time_base,
+				outputFormatContext->streams[e.streamIndex]->time_base);
+			packetRefs.addPacketReference(e.streamIndex, e.packetIndex + packetIndexOffsets.at(e.streamIndex), pts, origPos, e.origSize);
+		}
+
+		for (unsigned int i = 0; i < outputFormatContext->nb_streams; i++)
+			packetIndexOffsets.at(i) += packetCounts.at(i);
+
+		closeInputFormat(&part.formatContext);
+	}
+
+	av_packet_free(&packet);
+
+	ArchiveStore *store = cmd.storeDirectory() != nullptr ? new ArchiveStore(cmd.storeDirectory()) : nullptr;
+	writeLLR(inputFile, nullptr, &packetRefs, llrFile, cmd.hashName().c_str(), std::vector<SequenceFile>(), store);
+	delete store;
+
+	failOnAVERROR(av_write_trailer(outputFormatContext), "av_write_trailer");
+
+	if ((outputFormatContext->oformat->flags & AVFMT_NOFILE) == 0)
+		failOnAVERROR(closeWriteBehind(&outputFormatContext->pb), "closeWriteBehind");
+
+	failOnAVERROR(closeWriteBehind(&llrFile), "closeWriteBehind");
+	failOnAVERROR(closeReadAhead(&inputFile), "closeReadAhead");
+
+	avformat_free_context(outputFormatContext);
+
+	return EXIT_SUCCESS;
 }
 
 int main(int argc, char *argv[])
@@ -310,9 +1553,20 @@ int main(int argc, char *argv[])
 
 	av_log_set_level(cmd.libavLogLevel());
 	setupLogDebug(cmd.enableLogDebug());
+	IoQueue::selectBackend(cmd.ioBackend());
+	setDirectIo(cmd.directIo());
 
-	if (cmd.operation() == CommandLine::Compress)
-		return compress(cmd);
-	else
-		return decompress(cmd);
+	switch (cmd.operation())
+	{
+		case CommandLine::Compress:
+			return compress(cmd);
+		case CommandLine::Decompress:
+			return decompress(cmd);
+		case CommandLine::Recompress:
+			return recompress(cmd);
+		case CommandLine::Merge:
+			return merge(cmd);
+		default:
+			abort();
+	}
 }
@@ -0,0 +1,200 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mappedfile.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Size of the AVIOContext buffer for the demuxer
+static constexpr int MAPPED_AVIO_BUFFER_SIZE = 64 * 1024;
+
+static void unmapCallback(void *opaque, uint8_t *data)
+{
+	munmap(data, (size_t)(uintptr_t)opaque);
+}
+
+MappedFile *MappedFile::open(const char *filename)
+{
+	int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return nullptr;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); // the mapping keeps the file open
+	if (data == MAP_FAILED)
+		return nullptr;
+
+	// Packets are mostly read in file order
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	// The size stored in the AVBufferRef is not used (and it is an int),
+	// the real size is kept by the MappedFile and the unmap callback.
+	// Packets must never write into the mapping, even if they end up being
+	// the last reference to it.
+	AVBufferRef *buffer = av_buffer_create((uint8_t*)data, 0, unmapCallback, (void*)(uintptr_t)st.st_size, AV_BUFFER_FLAG_READONLY);
+	if (buffer == nullptr)
+	{
+		munmap(data, st.st_size);
+		return nullptr;
+	}
+
+	return new MappedFile(buffer, st.st_size);
+}
+
+MappedFile::MappedFile(AVBufferRef *buffer, int64_t size)
+: m_buffer(buffer), m_size(size), m_position(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	av_buffer_unref(&m_buffer);
+}
+
+const uint8_t *MappedFile::data() const
+{
+	return m_buffer->data;
+}
+
+int64_t MappedFile::size() const
+{
+	return m_size;
+}
+
+int MappedFile::readPacketCallback(void *opaque, uint8_t *buf, int size)
+{
+	MappedFile *file = (MappedFile*)opaque;
+
+	if (file->m_position >= file->m_size)
+		return AVERROR_EOF;
+
+	int result = std::min<int64_t>(size, file->m_size - file->m_position);
+	memcpy(buf, file->data() + file->m_position, result);
+	file->m_position += result;
+
+	return result;
+}
+
+int64_t MappedFile::seekCallback(void *opaque, int64_t offset, int whence)
+{
+	MappedFile *file = (MappedFile*)opaque;
+
+	switch (whence & ~AVSEEK_FORCE)
+	{
+		case AVSEEK_SIZE:
+			return file->m_size;
+		case SEEK_SET:
+			break;
+		case SEEK_CUR:
+			offset += file->m_position;
+			break;
+		case SEEK_END:
+			offset += file->m_size;
+			break;
+		default:
+			return AVERROR(EINVAL);
+	}
+
+	if (offset < 0)
+		return AVERROR(EINVAL);
+
+	file->m_position = offset;
+	return offset;
+}
+
+int MappedFile::openInputFormat(AVFormatContext **formatContext, const char *filename)
+{
+	unsigned char *buffer = (unsigned char*)av_malloc(MAPPED_AVIO_BUFFER_SIZE);
+	if (buffer == nullptr)
+		return AVERROR(ENOMEM);
+
+	m_position = 0;
+	AVIOContext *pb = avio_alloc_context(buffer, MAPPED_AVIO_BUFFER_SIZE, 0, this, readPacketCallback, nullptr, seekCallback);
+	if (pb == nullptr)
+	{
+		av_free(buffer);
+		return AVERROR(ENOMEM);
+	}
+
+	*formatContext = avformat_alloc_context();
+	if (*formatContext == nullptr)
+	{
+		av_freep(&pb->buffer);
+		avio_context_free(&pb);
+		return AVERROR(ENOMEM);
+	}
+
+	(*formatContext)->pb = pb;
+	(*formatContext)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	int r = avformat_open_input(formatContext, filename, nullptr, nullptr);
+	if (r < 0) // formatContext has already been freed
+	{
+		av_freep(&pb->buffer);
+		avio_context_free(&pb);
+	}
+
+	return r;
+}
+
+void MappedFile::closeInputFormat(AVFormatContext **formatContext)
+{
+	if (*formatContext == nullptr)
+		return;
+
+	AVIOContext *pb = (*formatContext)->pb;
+	avformat_close_input(formatContext);
+
+	av_freep(&pb->buffer);
+	avio_context_free(&pb);
+}
+
+bool MappedFile::referencePacket(AVPacket *packet) const
+{
+	// Decoders may read up to AV_INPUT_BUFFER_PADDING_SIZE bytes past the
+	// end of the packet, so they must still belong to the file
+	if (packet->pos < 0 || packet->pos + packet->size + AV_INPUT_BUFFER_PADDING_SIZE > m_size)
+		return false;
+
+	AVBufferRef *ref = av_buffer_ref(m_buffer);
+	if (ref == nullptr)
+		return false;
+
+	ref->data += packet->pos;
+	ref->size = packet->size;
+
+	av_buffer_unref(&packet->buf);
+	packet->buf = ref;
+	packet->data = ref->data;
+
+	return true;
+}
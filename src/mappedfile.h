@@ -0,0 +1,59 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include "libav.h"
+
+// Read-only memory mapping of a whole input file. Packets read from it can be
+// made to point straight into the mapping, so that the encoders read the input
+// data in place and the data is never copied into separate buffers. The
+// mapping stays valid until the last packet that references it is freed.
+class MappedFile
+{
+	public:
+		// Returns nullptr if filename cannot be mapped (e.g. it is not a
+		// regular file)
+		static MappedFile *open(const char *filename);
+		~MappedFile();
+
+		const uint8_t *data() const;
+		int64_t size() const;
+
+		// Same as avformat_open_input and avformat_close_input, but the file
+		// is read from the mapping
+		int openInputFormat(AVFormatContext **formatContext, const char *filename);
+		void closeInputFormat(AVFormatContext **formatContext);
+
+		// Replaces the data of a packet that has been read from this file
+		// with a reference to the same bytes in the mapping. Returns false
+		// (leaving the packet unchanged) if that is not possible.
+		bool referencePacket(AVPacket *packet) const;
+
+	private:
+		MappedFile(AVBufferRef *buffer, int64_t size);
+
+		static int readPacketCallback(void *opaque, uint8_t *buf, int size);
+		static int64_t seekCallback(void *opaque, int64_t offset, int whence);
+
+		AVBufferRef *m_buffer; // covers the whole mapping
+		int64_t m_size;
+		int64_t m_position; // of the AVIOContext
+};
+
+#endif
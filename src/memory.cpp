@@ -0,0 +1,51 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memory.h"
+
+#include <assert.h>
+
+MemoryBudget::MemoryBudget(size_t limit)
+: m_limit(limit), m_charged(0), m_packetRefs(nullptr)
+{
+}
+
+void MemoryBudget::trackPacketReferences(const PacketReferences *packetRefs)
+{
+	m_packetRefs = packetRefs;
+}
+
+void MemoryBudget::charge(size_t bytes)
+{
+	m_charged += bytes;
+}
+
+void MemoryBudget::release(size_t bytes)
+{
+	assert(bytes <= m_charged);
+	m_charged -= bytes;
+}
+
+size_t MemoryBudget::used() const
+{
+	return m_charged + (m_packetRefs != nullptr ? m_packetRefs->memoryUsage() : 0);
+}
+
+bool MemoryBudget::wouldExceed(size_t bytes) const
+{
+	return m_limit != 0 && used() + bytes > m_limit;
+}
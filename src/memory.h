@@ -0,0 +1,50 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include "llrfile.h"
+
+#include <stddef.h>
+
+// Keeps track of the memory taken by data whose amount grows with the speed of
+// the reader or with the length of the input (frames and packets in flight,
+// packet references), so that the reader can be throttled before the process
+// runs out of memory. All methods must be called from the same thread.
+class MemoryBudget
+{
+	public:
+		explicit MemoryBudget(size_t limit); // 0 means unlimited
+
+		// The memory taken by packetRefs is counted as used
+		void trackPacketReferences(const PacketReferences *packetRefs);
+
+		void charge(size_t bytes);
+		void release(size_t bytes);
+
+		size_t used() const;
+
+		// Returns true if charging the given amount would exceed the limit
+		bool wouldExceed(size_t bytes) const;
+
+	private:
+		size_t m_limit, m_charged;
+		const PacketReferences *m_packetRefs;
+};
+
+#endif
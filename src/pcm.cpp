@@ -0,0 +1,107 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pcm.h"
+
+extern "C"
+{
+#include <libavutil/intreadwrite.h>
+}
+
+static const PcmFormat pcmFormats[] =
+{
+	{ AV_CODEC_ID_PCM_U8, 1, false, true },
+	{ AV_CODEC_ID_PCM_S16LE, 2, false, false },
+	{ AV_CODEC_ID_PCM_S16BE, 2, true, false },
+	{ AV_CODEC_ID_PCM_S24LE, 3, false, false },
+	{ AV_CODEC_ID_PCM_S24BE, 3, true, false }
+};
+
+AVSampleFormat PcmFormat::flacSampleFormat() const
+{
+	return bytesPerSample <= 2 ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_S32;
+}
+
+int PcmFormat::flacBitsPerSample() const
+{
+	return bytesPerSample <= 2 ? 16 : 24;
+}
+
+const PcmFormat *findPcmFormat(AVCodecID codecId)
+{
+	for (const PcmFormat &e : pcmFormats)
+	{
+		if (e.codecId == codecId)
+			return &e;
+	}
+
+	return nullptr;
+}
+
+void unpackPcmSamples(const PcmFormat *format, const uint8_t *src, int count, uint8_t *dest)
+{
+	int16_t *dest16 = (int16_t*)dest;
+	int32_t *dest32 = (int32_t*)dest;
+
+	switch (format->bytesPerSample)
+	{
+		case 1: // 8-bit samples become the most significant byte
+			for (int i = 0; i < count; i++)
+				dest16[i] = (int16_t)((src[i] ^ 0x80) << 8);
+			break;
+		case 2:
+			for (int i = 0; i < count; i++, src += 2)
+				dest16[i] = format->bigEndian ? AV_RB16(src) : AV_RL16(src);
+			break;
+		case 3:
+			for (int i = 0; i < count; i++, src += 3)
+				dest32[i] = (int32_t)((format->bigEndian ? AV_RB24(src) : AV_RL24(src)) << 8);
+			break;
+	}
+}
+
+void packPcmSamples(const PcmFormat *format, const uint8_t *src, int count, uint8_t *dest)
+{
+	const int16_t *src16 = (const int16_t*)src;
+	const int32_t *src32 = (const int32_t*)src;
+
+	switch (format->bytesPerSample)
+	{
+		case 1:
+			for (int i = 0; i < count; i++)
+				dest[i] = (uint8_t)(src16[i] >> 8) ^ 0x80;
+			break;
+		case 2:
+			for (int i = 0; i < count; i++, dest += 2)
+			{
+				if (format->bigEndian)
+					AV_WB16(dest, src16[i]);
+				else
+					AV_WL16(dest, src16[i]);
+			}
+			break;
+		case 3:
+			for (int i = 0; i < count; i++, dest += 3)
+			{
+				if (format->bigEndian)
+					AV_WB24(dest, (uint32_t)src32[i] >> 8);
+				else
+					AV_WL24(dest, (uint32_t)src32[i] >> 8);
+			}
+			break;
+	}
+}
@@ -0,0 +1,45 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PCM_H
+#define PCM_H
+
+#include "libav.h"
+
+// Uncompressed PCM formats that can be stored losslessly as FLAC. Their
+// samples are exchanged with the FLAC codec as interleaved S16 (up to 16 bits)
+// or S32 (24 bits, in the most significant bits) samples.
+struct PcmFormat
+{
+	AVCodecID codecId;
+	int bytesPerSample;
+	bool bigEndian;
+	bool isUnsigned;
+
+	AVSampleFormat flacSampleFormat() const;
+	int flacBitsPerSample() const;
+};
+
+// Returns nullptr if the format is not supported
+const PcmFormat *findPcmFormat(AVCodecID codecId);
+
+// Convert count samples (of all channels) between the PCM bytes and the FLAC
+// sample format
+void unpackPcmSamples(const PcmFormat *format, const uint8_t *src, int count, uint8_t *dest);
+void packPcmSamples(const PcmFormat *format, const uint8_t *src, int count, uint8_t *dest);
+
+#endif
@@ -0,0 +1,396 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pipeline.h"
+
+#include "cpus.h"
+#include "log.h"
+
+#include <algorithm>
+#include <string.h>
+
+// Maximum number of packets that can be waiting to be written, per stream
+static constexpr size_t MAX_JOBS_PER_STREAM = 8;
+
+// Number of submitted packets between two adjustments of the conversion pool
+static constexpr size_t REBALANCE_INTERVAL = 16;
+
+EncoderPipeline::EncoderPipeline(const std::map<int, Encoder*> &encoders, MemoryBudget *memoryBudget, bool deduplicateFrames,
+	const ArchiveStore *store)
+: m_submittedSinceRebalance(0), m_memoryBudget(memoryBudget), m_store(store), m_memoryWarningShown(false),
+  m_encodeBacklog(0), m_stopping(false)
+{
+	int encodeThreadsWithConversion = 0;
+
+	for (const auto &[streamIndex, encoder] : encoders)
+	{
+		std::unique_ptr<EncodeWorker> worker(new EncodeWorker);
+		worker->encoder = encoder;
+		worker->submittedPacketCount = encoder->outputPacketCount(); // resumed packets
+		worker->pendingJobCount = 0;
+		worker->lastOriginal = { 0, AV_NOPTS_VALUE };
+
+		// The first converter is kept for later use by the conversion pool
+		std::unique_ptr<FrameConverter> converter(encoder->createConverter());
+		worker->needsConversion = converter != nullptr;
+		if (worker->needsConversion)
+		{
+			worker->idleConverters.push_back(std::move(converter));
+			encodeThreadsWithConversion++;
+		}
+
+		// Only video encoders need conversion
+		if (deduplicateFrames && worker->needsConversion)
+			worker->duplicateDetector.reset(new DuplicateFrameDetector(memoryBudget));
+
+		// The store is looked up by the conversion threads
+		if (store != nullptr && worker->needsConversion)
+			worker->packetReuseContext = encoder->packetReuseContext();
+
+		worker->thread = std::thread(&EncoderPipeline::encodeWorkerMain, this, worker.get());
+		m_encodeWorkers.emplace(streamIndex, std::move(worker));
+	}
+
+	// Start one conversion thread per CPU, but only leave enough of them
+	// active to fill the CPUs that are not taken by the encoders
+	int cpuCount = availableCpuCount();
+	int convertThreadCount = encodeThreadsWithConversion != 0 ? cpuCount : 0;
+	m_activeConvertWorkers = std::max(1, cpuCount - encodeThreadsWithConversion);
+	m_maxJobs = MAX_JOBS_PER_STREAM * encoders.size() + 2 * convertThreadCount;
+
+	for (int i = 0; i < convertThreadCount; i++)
+		m_convertThreads.emplace_back(&EncoderPipeline::convertWorkerMain, this, i);
+
+	logDebug("Pipeline: %zu encoding threads, %d conversion threads (%d active)\n",
+		m_encodeWorkers.size(), convertThreadCount, m_activeConvertWorkers);
+}
+
+EncoderPipeline::~EncoderPipeline()
+{
+	flush();
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+
+	m_convertAvailable.notify_all();
+	m_encodeAvailable.notify_all();
+
+	for (std::thread &thread : m_convertThreads)
+		thread.join();
+
+	for (auto &[streamIndex, worker] : m_encodeWorkers)
+		worker->thread.join();
+
+	for (Job *job : m_freeJobs)
+	{
+		av_packet_free(&job->inputPacket);
+		av_packet_free(&job->outputPacket);
+		av_frame_free(&job->convertedFrame);
+		delete job;
+	}
+}
+
+void EncoderPipeline::submit(const AVPacket *inputPacket, bool sameAsPrevious)
+{
+	EncodeWorker *worker = m_encodeWorkers.at(inputPacket->stream_index).get();
+
+	// Output packets are numbered in submission order, so the index of the
+	// packet that a duplicate refers to is already known
+	std::optional<DuplicateFrameDetector::Original> duplicateOf;
+	if (sameAsPrevious)
+		duplicateOf = worker->lastOriginal;
+	else if (worker->duplicateDetector != nullptr)
+		duplicateOf = worker->duplicateDetector->find(inputPacket);
+
+	if (!duplicateOf.has_value())
+	{
+		worker->lastOriginal = { worker->submittedPacketCount++, inputPacket->pts };
+		if (worker->duplicateDetector != nullptr)
+			worker->duplicateDetector->add(inputPacket, worker->lastOriginal);
+	}
+
+	// Estimate how much memory this packet will take until it is written:
+	// the copy of the input packet, the converted frame and the encoded
+	// packet (which is assumed not to be bigger than the raw input)
+	size_t jobMemory = 0;
+	if (!duplicateOf.has_value())
+		jobMemory += inputPacket->size;
+	if (!duplicateOf.has_value() && worker->needsConversion)
+		jobMemory += worker->encoder->convertedFrameSize() + inputPacket->size;
+
+	// Write packets that are already encoded, and block if too many are
+	// pending (in total or for this stream, so that a slow stream cannot take
+	// all the jobs) or if there is not enough memory left for the new one
+	while (!m_jobs.empty())
+	{
+		bool overBudget = m_memoryBudget->wouldExceed(jobMemory);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_jobs.front()->done && m_jobs.size() < m_maxJobs && worker->pendingJobCount < MAX_JOBS_PER_STREAM && !overBudget)
+				break;
+		}
+
+		writeFirstJob();
+	}
+
+	// If even a single packet does not fit, go ahead anyway
+	if (m_memoryBudget->wouldExceed(jobMemory) && !m_memoryWarningShown)
+	{
+		logWarning("Memory limit is too low: %zu bytes are already in use and a packet needs %zu more\n",
+			m_memoryBudget->used(), jobMemory);
+		m_memoryWarningShown = true;
+	}
+
+	// Reuse a written job if possible, so that no allocation is needed
+	Job *job;
+	if (!m_freeJobs.empty())
+	{
+		job = m_freeJobs.back();
+		m_freeJobs.pop_back();
+	}
+	else
+	{
+		job = new Job;
+		job->inputPacket = av_packet_alloc();
+		job->outputPacket = av_packet_alloc();
+		job->convertedFrame = av_frame_alloc();
+
+		if (job->inputPacket == nullptr || job->outputPacket == nullptr)
+			logError("av_packet_alloc failed\n");
+		if (job->convertedFrame == nullptr)
+			logError("av_frame_alloc failed\n");
+	}
+
+	// The packet data is shared (not copied) if inputPacket is reference-counted
+	if (duplicateOf.has_value())
+	{
+		// Only the position and the size are needed to write the reference
+		failOnAVERROR(av_packet_copy_props(job->inputPacket, inputPacket), "av_packet_copy_props");
+		job->inputPacket->size = inputPacket->size;
+	}
+	else
+	{
+		failOnAVERROR(av_packet_ref(job->inputPacket, inputPacket), "av_packet_ref");
+
+		// Palettes are only sent when they change, and the decoder keeps the
+		// last one. Converters may get any packet, so every packet of a
+		// palettized stream carries its palette.
+		int paletteSize;
+		const uint8_t *palette = av_packet_get_side_data(job->inputPacket, AV_PKT_DATA_PALETTE, &paletteSize);
+		if (palette != nullptr)
+		{
+			worker->palette.assign(palette, palette + paletteSize);
+		}
+		else if (!worker->palette.empty() && worker->needsConversion)
+		{
+			uint8_t *data = av_packet_new_side_data(job->inputPacket, AV_PKT_DATA_PALETTE, worker->palette.size());
+			if (data == nullptr)
+				logError("av_packet_new_side_data failed\n");
+			memcpy(data, worker->palette.data(), worker->palette.size());
+		}
+	}
+
+	job->converted = !worker->needsConversion;
+	job->done = false;
+	job->chargedMemory = jobMemory;
+	job->duplicateOf = duplicateOf;
+	job->loadedFromStore = false;
+	job->storeKey.reset();
+
+	m_memoryBudget->charge(jobMemory);
+	worker->pendingJobCount++;
+
+	if (duplicateOf.has_value())
+	{
+		job->converted = true;
+		job->done = true;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(job);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(job);
+		worker->queue.push_back(job);
+
+		if (job->converted)
+			m_encodeBacklog++;
+		else
+			m_convertQueue.push_back(job);
+
+		if (++m_submittedSinceRebalance == REBALANCE_INTERVAL)
+		{
+			rebalance();
+			m_submittedSinceRebalance = 0;
+		}
+	}
+
+	if (job->converted)
+		m_encodeAvailable.notify_all();
+	else
+		m_convertAvailable.notify_all();
+}
+
+void EncoderPipeline::flush()
+{
+	while (!m_jobs.empty())
+		writeFirstJob();
+}
+
+// Must be called with m_mutex locked
+void EncoderPipeline::rebalance()
+{
+	int maxConvertWorkers = m_convertThreads.size();
+	int oldActiveConvertWorkers = m_activeConvertWorkers;
+	size_t convertBacklog = m_convertQueue.size();
+
+	if (convertBacklog > m_encodeBacklog && m_activeConvertWorkers < maxConvertWorkers)
+		m_activeConvertWorkers++;
+	else if (convertBacklog < m_encodeBacklog && m_activeConvertWorkers > 1)
+		m_activeConvertWorkers--;
+
+	if (m_activeConvertWorkers != oldActiveConvertWorkers)
+	{
+		logDebug("Pipeline: %d active conversion threads (%zu frames waiting for conversion, %zu for encoding)\n",
+			m_activeConvertWorkers, convertBacklog, m_encodeBacklog);
+		m_convertAvailable.notify_all();
+	}
+}
+
+void EncoderPipeline::convertWorkerMain(int index)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (true)
+	{
+		m_convertAvailable.wait(lock, [&] { return m_stopping || (index < m_activeConvertWorkers && !m_convertQueue.empty()); });
+		if (m_stopping)
+			break;
+
+		Job *job = m_convertQueue.front();
+		m_convertQueue.pop_front();
+
+		// Take an idle converter for this stream, or create a new one
+		EncodeWorker *worker = m_encodeWorkers.at(job->inputPacket->stream_index).get();
+		std::unique_ptr<FrameConverter> converter;
+		if (!worker->idleConverters.empty())
+		{
+			converter = std::move(worker->idleConverters.back());
+			worker->idleConverters.pop_back();
+		}
+
+		lock.unlock();
+
+		// Frames that have already been encoded for another file need
+		// neither conversion nor encoding
+		if (!worker->packetReuseContext.empty())
+		{
+			ArchiveStore::Key key = ArchiveStore::computeKey(worker->packetReuseContext.data(), worker->packetReuseContext.size(),
+				job->inputPacket->data, job->inputPacket->size);
+
+			if (m_store->load(ArchiveStore::Frame, key, job->outputPacket))
+			{
+				logDebug(" -> Output packet loaded from the archive store\n");
+				job->outputPacket->flags |= AV_PKT_FLAG_KEY;
+				job->loadedFromStore = true;
+			}
+			else
+			{
+				job->storeKey = key;
+			}
+		}
+
+		if (!job->loadedFromStore)
+		{
+			if (converter == nullptr)
+				converter.reset(worker->encoder->createConverter());
+			converter->convert(job->inputPacket, job->convertedFrame);
+		}
+
+		lock.lock();
+
+		if (converter != nullptr)
+			worker->idleConverters.push_back(std::move(converter));
+		job->converted = true;
+		m_encodeBacklog++;
+		m_encodeAvailable.notify_all();
+	}
+}
+
+void EncoderPipeline::encodeWorkerMain(EncodeWorker *worker)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (true)
+	{
+		// Jobs are converted out of order, but they must be encoded in order
+		m_encodeAvailable.wait(lock, [&] { return m_stopping || (!worker->queue.empty() && worker->queue.front()->converted); });
+		if (worker->queue.empty())
+			break; // stopping
+
+		Job *job = worker->queue.front();
+		worker->queue.pop_front();
+		m_encodeBacklog--;
+
+		lock.unlock();
+		if (!job->loadedFromStore)
+			worker->encoder->encodePacket(job->inputPacket, worker->needsConversion ? job->convertedFrame : nullptr, job->outputPacket);
+
+		// Only keyframes can be decoded on their own
+		if (job->storeKey.has_value() && (job->outputPacket->flags & AV_PKT_FLAG_KEY))
+			m_store->save(ArchiveStore::Frame, *job->storeKey, job->outputPacket->data, job->outputPacket->size);
+		lock.lock();
+
+		job->done = true;
+		m_jobDone.notify_all();
+	}
+}
+
+void EncoderPipeline::writeFirstJob()
+{
+	Job *job;
+
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_jobDone.wait(lock, [&] { return m_jobs.front()->done; });
+
+		job = m_jobs.front();
+		m_jobs.pop_front();
+	}
+
+	EncodeWorker *worker = m_encodeWorkers.at(job->inputPacket->stream_index).get();
+	worker->pendingJobCount--;
+
+	Encoder *encoder = worker->encoder;
+	if (job->duplicateOf.has_value())
+		encoder->writeDuplicatePacket(job->inputPacket, job->duplicateOf->packetIndex, job->duplicateOf->pts);
+	else
+		encoder->finalizeAndWritePacket(job->inputPacket, job->outputPacket);
+
+	// Return buffers to their pools
+	av_packet_unref(job->inputPacket);
+	av_packet_unref(job->outputPacket);
+	av_frame_unref(job->convertedFrame);
+	m_memoryBudget->release(job->chargedMemory);
+
+	m_freeJobs.push_back(job);
+}
@@ -0,0 +1,126 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "dedup.h"
+#include "encoders.h"
+#include "memory.h"
+#include "store.h"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs each encoder on its own worker thread, and the conversion of raw frames
+// (see FrameConverter) on a shared pool of threads. Encoded packets are written
+// by the thread that submits the input packets, in the same order as the input
+// packets, so that the output file is the same as if packets were encoded one
+// at a time.
+//
+// The number of conversion threads that are allowed to run is periodically
+// adjusted by looking at which queue is growing: if frames are waiting to be
+// converted, more conversion threads are activated; if converted frames are
+// waiting for the encoders, some are parked so that the encoders get the CPU.
+//
+// The memory taken by each packet in flight is charged to the given budget: if
+// it is exhausted, submit blocks until enough packets have been written.
+//
+// If deduplicateFrames is set, video frames that are identical to a recent one
+// are not encoded: their references point to the earlier output packet.
+//
+// If store is not nullptr, the encoders whose packets can be reused take them
+// from the store instead of converting and encoding frames that have already
+// been encoded for another file, and they save the new ones.
+class EncoderPipeline
+{
+	public:
+		EncoderPipeline(const std::map<int, Encoder*> &encoders, MemoryBudget *memoryBudget, bool deduplicateFrames,
+			const ArchiveStore *store);
+		~EncoderPipeline();
+
+		// Queues a copy of inputPacket and writes any packet that is ready.
+		// If sameAsPrevious is set, inputPacket is known to be identical to
+		// the previous packet of its stream, and it is never encoded.
+		void submit(const AVPacket *inputPacket, bool sameAsPrevious = false);
+
+		// Waits until all the submitted packets have been written
+		void flush();
+
+	private:
+		struct Job
+		{
+			AVPacket *inputPacket, *outputPacket;
+			AVFrame *convertedFrame; // unused if the encoder takes no converted frame
+			bool converted, done;
+			size_t chargedMemory;
+
+			// Set if the input packet is a duplicate, which has no data
+			std::optional<DuplicateFrameDetector::Original> duplicateOf;
+
+			// Set by the conversion thread if the store is used: either the
+			// output packet has been loaded from it, or it must be saved
+			bool loadedFromStore;
+			std::optional<ArchiveStore::Key> storeKey;
+		};
+
+		struct EncodeWorker
+		{
+			Encoder *encoder;
+			bool needsConversion;
+			std::vector<uint8_t> packetReuseContext; // empty if packets are not reused
+			std::vector<std::unique_ptr<FrameConverter>> idleConverters;
+			std::deque<Job*> queue;
+			std::thread thread;
+
+			// Only accessed by the thread that submits packets
+			std::unique_ptr<DuplicateFrameDetector> duplicateDetector; // nullptr if disabled
+			size_t submittedPacketCount; // not counting duplicates
+			size_t pendingJobCount; // submitted but not written yet
+			std::vector<uint8_t> palette; // last palette of a palettized stream
+			DuplicateFrameDetector::Original lastOriginal;
+		};
+
+		void encodeWorkerMain(EncodeWorker *worker);
+		void convertWorkerMain(int index);
+		void rebalance();
+		void writeFirstJob();
+
+		std::map<int, std::unique_ptr<EncodeWorker>> m_encodeWorkers;
+		std::vector<std::thread> m_convertThreads;
+		size_t m_maxJobs;
+		size_t m_submittedSinceRebalance;
+		MemoryBudget *m_memoryBudget;
+		const ArchiveStore *m_store;
+		bool m_memoryWarningShown;
+
+		std::mutex m_mutex;
+		std::condition_variable m_convertAvailable, m_encodeAvailable, m_jobDone;
+		std::deque<Job*> m_jobs; // in submission order
+		std::vector<Job*> m_freeJobs; // written jobs, ready to be reused
+		std::deque<Job*> m_convertQueue;
+		size_t m_encodeBacklog; // jobs ready to be encoded
+		int m_activeConvertWorkers;
+		bool m_stopping;
+};
+
+#endif
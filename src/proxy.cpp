@@ -0,0 +1,165 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "proxy.h"
+
+#include "fileio.h"
+#include "log.h"
+
+#include <algorithm>
+#include <math.h>
+
+// MJPEG quantizer scale of proxy frames (2-31, lower is better)
+static constexpr int PROXY_QSCALE = 5;
+
+ProxyWriter::ProxyWriter(const char *filename, int width)
+: m_filename(filename), m_width(width), m_outputFormatContext(nullptr)
+{
+	failOnAVERROR(avformat_alloc_output_context2(&m_outputFormatContext, nullptr, "matroska", filename), "avformat_alloc_output_context2: %s", filename);
+}
+
+ProxyWriter::~ProxyWriter()
+{
+	for (std::unique_ptr<Stream> &stream : m_streams)
+	{
+		av_packet_free(&stream->packet);
+		av_frame_free(&stream->scaledFrame);
+		sws_freeContext(stream->swscaleContext);
+		avcodec_free_context(&stream->codecContext);
+	}
+
+	avformat_free_context(m_outputFormatContext);
+}
+
+int ProxyWriter::addStream(const AVFrame *frameTemplate, AVRational timeBase)
+{
+	std::unique_ptr<Stream> stream(new Stream());
+	stream->timeBase = timeBase;
+
+	// Even sizes, as required by 4:2:0 chroma subsampling
+	int width = std::max(std::min(m_width, frameTemplate->width) & ~1, 2);
+	int height = std::max((int)lrint((double)frameTemplate->height * width / frameTemplate->width) & ~1, 2);
+
+	stream->outputStream = avformat_new_stream(m_outputFormatContext, nullptr);
+	if (stream->outputStream == nullptr)
+		logError("avformat_new_stream failed\n");
+
+	AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+	if (codec == nullptr)
+		logError("MJPEG encoder not available\n");
+
+	stream->codecContext = avcodec_alloc_context3(codec);
+	if (stream->codecContext == nullptr)
+		logError("avcodec_alloc_context3 failed\n");
+
+	stream->codecContext->width = width;
+	stream->codecContext->height = height;
+	stream->codecContext->sample_aspect_ratio = frameTemplate->sample_aspect_ratio;
+	// Full range YUV, as JPEG expects (the YUVJ formats are deprecated)
+	stream->codecContext->pix_fmt = AV_PIX_FMT_YUV420P;
+	stream->codecContext->color_range = AVCOL_RANGE_JPEG;
+	stream->codecContext->time_base = timeBase;
+	stream->codecContext->flags |= AV_CODEC_FLAG_QSCALE;
+	stream->codecContext->global_quality = FF_QP2LAMBDA * PROXY_QSCALE;
+	stream->codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	failOnAVERROR(avcodec_open2(stream->codecContext, codec, nullptr), "avcodec_open2");
+	failOnAVERROR(avcodec_parameters_from_context(stream->outputStream->codecpar, stream->codecContext), "avcodec_parameters_from_context");
+	stream->outputStream->time_base = timeBase;
+	stream->outputStream->sample_aspect_ratio = frameTemplate->sample_aspect_ratio;
+
+	stream->swscaleContext = sws_getContext(
+		frameTemplate->width, frameTemplate->height, (AVPixelFormat)frameTemplate->format,
+		width, height, AV_PIX_FMT_YUV420P,
+		SWS_BILINEAR, nullptr, nullptr, nullptr);
+	if (stream->swscaleContext == nullptr)
+		logError("sws_getContext failed\n");
+
+	// The output range is only implied by the deprecated formats
+	int *invTable, *table;
+	int srcRange, dstRange, brightness, contrast, saturation;
+	if (sws_getColorspaceDetails(stream->swscaleContext, &invTable, &srcRange, &table, &dstRange, &brightness, &contrast, &saturation) < 0 ||
+		sws_setColorspaceDetails(stream->swscaleContext, invTable, srcRange, table, 1, brightness, contrast, saturation) < 0)
+		logError("sws_setColorspaceDetails failed\n");
+
+	stream->scaledFrame = av_frame_alloc();
+	stream->packet = av_packet_alloc();
+	if (stream->scaledFrame == nullptr || stream->packet == nullptr)
+		logError("av_frame_alloc or av_packet_alloc failed\n");
+
+	stream->scaledFrame->width = width;
+	stream->scaledFrame->height = height;
+	stream->scaledFrame->format = AV_PIX_FMT_YUV420P;
+	stream->scaledFrame->color_range = AVCOL_RANGE_JPEG;
+	failOnAVERROR(av_frame_get_buffer(stream->scaledFrame, 0), "av_frame_get_buffer");
+
+	logDebug("    proxy: Stream #0:%d mjpeg %dx%d\n", stream->outputStream->index, width, height);
+
+	m_streams.push_back(std::move(stream));
+	return m_streams.size() - 1;
+}
+
+void ProxyWriter::writeHeader()
+{
+	// Without video streams, there is nothing to browse
+	if (m_streams.empty())
+	{
+		logWarning("No video streams, proxy file not written: %s\n", m_filename.c_str());
+		return;
+	}
+
+	if ((m_outputFormatContext->oformat->flags & AVFMT_NOFILE) == 0)
+		failOnAVERROR(openWriteBehind(&m_outputFormatContext->pb, m_filename.c_str()), "openWriteBehind: %s", m_filename.c_str());
+
+	failOnAVERROR(avformat_write_header(m_outputFormatContext, nullptr), "avformat_write_header");
+}
+
+void ProxyWriter::writeFrame(int streamIndex, const AVFrame *frame, int64_t duration)
+{
+	Stream *stream = m_streams.at(streamIndex).get();
+
+	// The encoder may still hold a reference to the previous frame
+	failOnAVERROR(av_frame_make_writable(stream->scaledFrame), "av_frame_make_writable");
+
+	sws_scale(stream->swscaleContext,
+		frame->data, frame->linesize,
+		0, frame->height,
+		stream->scaledFrame->data, stream->scaledFrame->linesize);
+	stream->scaledFrame->pts = frame->pts;
+	stream->scaledFrame->quality = stream->codecContext->global_quality;
+
+	failOnAVERROR(avcodec_send_frame(stream->codecContext, stream->scaledFrame), "avcodec_send_frame");
+	failOnAVERROR(avcodec_receive_packet(stream->codecContext, stream->packet), "avcodec_receive_packet");
+
+	stream->packet->duration = duration;
+	stream->packet->stream_index = stream->outputStream->index;
+	av_packet_rescale_ts(stream->packet, stream->timeBase, stream->outputStream->time_base);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	failOnAVERROR(av_interleaved_write_frame(m_outputFormatContext, stream->packet), "av_write_frame");
+}
+
+void ProxyWriter::writeTrailer()
+{
+	if (m_streams.empty())
+		return;
+
+	failOnAVERROR(av_write_trailer(m_outputFormatContext), "av_write_trailer");
+
+	if ((m_outputFormatContext->oformat->flags & AVFMT_NOFILE) == 0)
+		failOnAVERROR(closeWriteBehind(&m_outputFormatContext->pb), "closeWriteBehind");
+}
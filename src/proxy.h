@@ -0,0 +1,73 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "libav.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Writes a downscaled MJPEG copy of the video streams to a separate Matroska
+// file, so that the footage can be browsed without decoding the lossless
+// streams. The proxy file is not needed to decompress, and its frames do not
+// have to be exact.
+class ProxyWriter
+{
+	public:
+		// Frames are scaled to the given width (or left as they are, if
+		// they are narrower), keeping their aspect ratio
+		ProxyWriter(const char *filename, int width);
+		~ProxyWriter();
+
+		// Adds a stream for frames with the size, pixel format and aspect
+		// ratio of frameTemplate, whose timestamps are in timeBase. All the
+		// streams must be added before writeHeader is called.
+		int addStream(const AVFrame *frameTemplate, AVRational timeBase);
+		void writeHeader();
+
+		// Frames of each stream must be written in order. Different streams
+		// can be written from different threads at the same time.
+		void writeFrame(int streamIndex, const AVFrame *frame, int64_t duration);
+
+		// Must be called after the last frame. If no stream has been added,
+		// no file is written.
+		void writeTrailer();
+
+	private:
+		struct Stream
+		{
+			AVRational timeBase;
+			AVStream *outputStream;
+			AVCodecContext *codecContext;
+			SwsContext *swscaleContext;
+			AVFrame *scaledFrame;
+			AVPacket *packet;
+		};
+
+		std::string m_filename;
+		int m_width;
+		AVFormatContext *m_outputFormatContext;
+		std::vector<std::unique_ptr<Stream>> m_streams;
+
+		std::mutex m_mutex; // held while writing to the muxer
+};
+
+#endif
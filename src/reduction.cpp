@@ -0,0 +1,365 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "reduction.h"
+
+#include "encoders.h"
+#include "log.h"
+
+#include <algorithm>
+#include <limits.h>
+#include <string.h>
+
+static constexpr uint64_t UNSUPPORTED_PIX_FMT_FLAGS = AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM |
+	AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BAYER | AV_PIX_FMT_FLAG_FLOAT;
+
+static const bool NATIVE_BIG_ENDIAN = AV_PIX_FMT_RGB48 == AV_PIX_FMT_RGB48BE;
+
+// Returns the format that has one plane per component, in native byte order,
+// with the same color model and subsampling as like and the given depth. If
+// alpha is not set, the alpha component of like (if any) is left out.
+static AVPixelFormat findPlanarPixelFormat(const AVPixFmtDescriptor *like, bool alpha, int depth)
+{
+	bool likeHasAlpha = (like->flags & AV_PIX_FMT_FLAG_ALPHA) != 0;
+	int componentCount = like->nb_components - ((likeHasAlpha && !alpha) ? 1 : 0);
+	int bytesPerSample = (depth > 8) ? 2 : 1;
+
+	for (const AVPixFmtDescriptor *desc = av_pix_fmt_desc_next(nullptr); desc != nullptr; desc = av_pix_fmt_desc_next(desc))
+	{
+		if (desc->nb_components != componentCount || (desc->flags & UNSUPPORTED_PIX_FMT_FLAGS) != 0 ||
+			(desc->flags & AV_PIX_FMT_FLAG_RGB) != (like->flags & AV_PIX_FMT_FLAG_RGB) ||
+			((desc->flags & AV_PIX_FMT_FLAG_ALPHA) != 0) != (likeHasAlpha && alpha) ||
+			desc->log2_chroma_w != like->log2_chroma_w || desc->log2_chroma_h != like->log2_chroma_h)
+			continue;
+
+		// Deprecated full-range formats
+		if (strncmp(desc->name, "yuvj", 4) == 0)
+			continue;
+
+		if (bytesPerSample != 1 && ((desc->flags & AV_PIX_FMT_FLAG_BE) != 0) != NATIVE_BIG_ENDIAN)
+			continue;
+
+		AVPixelFormat pixelFormat = av_pix_fmt_desc_get_id(desc);
+		if (av_pix_fmt_count_planes(pixelFormat) != componentCount)
+			continue;
+
+		bool matches = true;
+		for (int c = 0; c < componentCount; c++)
+		{
+			const AVComponentDescriptor &comp = desc->comp[c];
+			if (comp.depth != depth || comp.step != bytesPerSample || comp.offset != 0 || comp.shift != 0)
+				matches = false;
+		}
+
+		if (matches && sws_isSupportedInput(pixelFormat) != 0 && sws_isSupportedOutput(pixelFormat) != 0)
+			return pixelFormat;
+	}
+
+	return AV_PIX_FMT_NONE;
+}
+
+AVPixelFormat widePixelFormat(AVPixelFormat rawFormat)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(rawFormat);
+	if (desc == nullptr || (desc->flags & UNSUPPORTED_PIX_FMT_FLAGS) != 0)
+		return AV_PIX_FMT_NONE;
+
+	// All the color components must have the same depth
+	int colorComponentCount = desc->nb_components - ((desc->flags & AV_PIX_FMT_FLAG_ALPHA) ? 1 : 0);
+	for (int c = 1; c < colorComponentCount; c++)
+	{
+		if (desc->comp[c].depth != desc->comp[0].depth)
+			return AV_PIX_FMT_NONE;
+	}
+
+	return findPlanarPixelFormat(desc, true, desc->comp[0].depth);
+}
+
+AVPixelFormat reducedPixelFormat(AVPixelFormat rawFormat, const PlaneReduction &reduction)
+{
+	AVPixelFormat wideFormat = widePixelFormat(rawFormat);
+	if (wideFormat == AV_PIX_FMT_NONE || reduction.isNone())
+		return wideFormat;
+
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(wideFormat);
+	return findPlanarPixelFormat(desc, reduction.alphaValue < 0, desc->comp[0].depth - reduction.shift);
+}
+
+// Size (in samples) of the plane holding the given component
+static void componentSize(const AVPixFmtDescriptor *desc, int component, int width, int height, int *outWidth, int *outHeight)
+{
+	bool chroma = (component == 1 || component == 2) && (desc->flags & AV_PIX_FMT_FLAG_RGB) == 0;
+	*outWidth = chroma ? AV_CEIL_RSHIFT(width, desc->log2_chroma_w) : width;
+	*outHeight = chroma ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+}
+
+struct ComponentStats
+{
+	unsigned int setBits = 0; // OR of all the samples
+	int minValue = INT_MAX, maxValue = INT_MIN;
+};
+
+template <typename T>
+static void accumulateStats(const uint8_t *data, int linesize, int width, int height, ComponentStats *stats)
+{
+	for (int y = 0; y < height; y++)
+	{
+		const T *row = (const T*)(data + (ptrdiff_t)y * linesize);
+		for (int x = 0; x < width; x++)
+		{
+			stats->setBits |= row[x];
+			stats->minValue = std::min<int>(stats->minValue, row[x]);
+			stats->maxValue = std::max<int>(stats->maxValue, row[x]);
+		}
+	}
+}
+
+PlaneReduction detectPlaneReduction(const AVStream *rawStream, const std::vector<AVPacket*> &samples, const AVCodec *encoder)
+{
+	AVPixelFormat rawFormat = (AVPixelFormat)rawStream->codecpar->format;
+	AVPixelFormat wideFormat = widePixelFormat(rawFormat);
+	if (wideFormat == AV_PIX_FMT_NONE || samples.empty() || encoder == nullptr)
+		return PlaneReduction();
+
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(wideFormat);
+	int width = rawStream->codecpar->width, height = rawStream->codecpar->height;
+
+	// Convert the samples to the wide format, where each sample is easy to read
+	AVFrame *frameTemplate = av_frame_alloc(), *frame = av_frame_alloc();
+	if (frameTemplate == nullptr || frame == nullptr)
+		logError("av_frame_alloc failed\n");
+
+	frameTemplate->width = width;
+	frameTemplate->height = height;
+	frameTemplate->format = wideFormat;
+
+	FrameBufferPool framePool(wideFormat, width, height);
+	FrameConverter converter(rawStream, frameTemplate, &framePool);
+
+	std::vector<ComponentStats> stats(desc->nb_components);
+	for (const AVPacket *sample : samples)
+	{
+		converter.convert(sample, frame);
+
+		for (int c = 0; c < desc->nb_components; c++)
+		{
+			int plane = desc->comp[c].plane, componentWidth, componentHeight;
+			componentSize(desc, c, width, height, &componentWidth, &componentHeight);
+
+			if (desc->comp[c].depth > 8)
+				accumulateStats<uint16_t>(frame->data[plane], frame->linesize[plane], componentWidth, componentHeight, &stats[c]);
+			else
+				accumulateStats<uint8_t>(frame->data[plane], frame->linesize[plane], componentWidth, componentHeight, &stats[c]);
+		}
+
+		av_frame_unref(frame);
+	}
+
+	av_frame_free(&frame);
+	av_frame_free(&frameTemplate);
+
+	bool hasAlpha = (desc->flags & AV_PIX_FMT_FLAG_ALPHA) != 0;
+	int colorComponentCount = desc->nb_components - (hasAlpha ? 1 : 0);
+
+	unsigned int colorSetBits = 0;
+	for (int c = 0; c < colorComponentCount; c++)
+		colorSetBits |= stats[c].setBits;
+
+	// Black samples tell nothing about the low bits. Samples of 8 bits or
+	// less take one byte anyway.
+	PlaneReduction result;
+	if (colorSetBits != 0)
+		result.shift = std::min(__builtin_ctz(colorSetBits), std::max(desc->comp[0].depth - 8, 0));
+
+	// An alpha plane can only be dropped if it is constant
+	if (hasAlpha && stats.back().minValue == stats.back().maxValue)
+		result.alphaValue = stats.back().minValue;
+
+	logDebug("    samples: %s with %d zero low bits, alpha %d\n", av_get_pix_fmt_name(wideFormat),
+		result.shift, result.alphaValue);
+
+	result = fitPlaneReduction(rawFormat, result, encoder);
+	if (!result.isNone())
+		logDebug("    plane reduction: %s\n", av_get_pix_fmt_name(reducedPixelFormat(rawFormat, result)));
+
+	return result;
+}
+
+PlaneReduction fitPlaneReduction(AVPixelFormat rawFormat, const PlaneReduction &reduction, const AVCodec *encoder)
+{
+	AVPixelFormat wideFormat = widePixelFormat(rawFormat);
+	if (wideFormat == AV_PIX_FMT_NONE || reduction.isNone())
+		return PlaneReduction();
+
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(wideFormat);
+	int rawDepth = desc->comp[0].depth;
+
+	// Reduced formats have the same depth for every component: an alpha
+	// plane that is kept would have to be reduced too
+	bool hasAlpha = (desc->flags & AV_PIX_FMT_FLAG_ALPHA) != 0;
+	if (hasAlpha != (reduction.alphaValue >= 0))
+		return PlaneReduction();
+
+	for (int shift = std::min(reduction.shift, rawDepth - 1); shift >= 0; shift--)
+	{
+		PlaneReduction candidate;
+		candidate.shift = shift;
+		candidate.alphaValue = reduction.alphaValue;
+		if (candidate.isNone())
+			break;
+
+		AVPixelFormat reducedFormat = reducedPixelFormat(rawFormat, candidate);
+		for (const AVPixelFormat *p = encoder->pix_fmts; p != nullptr && *p != AV_PIX_FMT_NONE; p++)
+		{
+			if (*p == reducedFormat)
+				return candidate;
+		}
+	}
+
+	return PlaneReduction();
+}
+
+template <typename In, typename Out>
+static bool shiftSamplesDown(const uint8_t *src, int srcLinesize, uint8_t *dst, int dstLinesize, int width, int height, int shift)
+{
+	unsigned int lowMask = (1u << shift) - 1, lostBits = 0;
+
+	for (int y = 0; y < height; y++)
+	{
+		const In *srcRow = (const In*)(src + (ptrdiff_t)y * srcLinesize);
+		Out *dstRow = (Out*)(dst + (ptrdiff_t)y * dstLinesize);
+		for (int x = 0; x < width; x++)
+		{
+			unsigned int value = srcRow[x];
+			lostBits |= value & lowMask;
+			dstRow[x] = (Out)(value >> shift);
+		}
+	}
+
+	return lostBits == 0;
+}
+
+template <typename In, typename Out>
+static void shiftSamplesUp(const uint8_t *src, int srcLinesize, uint8_t *dst, int dstLinesize, int width, int height, int shift)
+{
+	for (int y = 0; y < height; y++)
+	{
+		const In *srcRow = (const In*)(src + (ptrdiff_t)y * srcLinesize);
+		Out *dstRow = (Out*)(dst + (ptrdiff_t)y * dstLinesize);
+		for (int x = 0; x < width; x++)
+			dstRow[x] = (Out)((unsigned int)srcRow[x] << shift);
+	}
+}
+
+template <typename T>
+static bool isPlaneConstant(const uint8_t *data, int linesize, int width, int height, int value)
+{
+	bool result = true;
+
+	for (int y = 0; y < height; y++)
+	{
+		const T *row = (const T*)(data + (ptrdiff_t)y * linesize);
+		for (int x = 0; x < width; x++)
+			result &= row[x] == value;
+	}
+
+	return result;
+}
+
+template <typename T>
+static void fillPlane(uint8_t *data, int linesize, int width, int height, int value)
+{
+	for (int y = 0; y < height; y++)
+		std::fill_n((T*)(data + (ptrdiff_t)y * linesize), width, (T)value);
+}
+
+bool reducePlanes(const AVFrame *wideFrame, AVFrame *reducedFrame, const PlaneReduction &reduction)
+{
+	const AVPixFmtDescriptor *wideDesc = av_pix_fmt_desc_get((AVPixelFormat)wideFrame->format);
+	const AVPixFmtDescriptor *reducedDesc = av_pix_fmt_desc_get((AVPixelFormat)reducedFrame->format);
+	bool lossless = true;
+
+	for (int c = 0; c < wideDesc->nb_components; c++)
+	{
+		int width, height;
+		componentSize(wideDesc, c, wideFrame->width, wideFrame->height, &width, &height);
+
+		int srcPlane = wideDesc->comp[c].plane, srcDepth = wideDesc->comp[c].depth;
+		const uint8_t *src = wideFrame->data[srcPlane];
+		int srcLinesize = wideFrame->linesize[srcPlane];
+
+		// Dropped alpha plane
+		if (c >= reducedDesc->nb_components)
+		{
+			if (srcDepth > 8)
+				lossless &= isPlaneConstant<uint16_t>(src, srcLinesize, width, height, reduction.alphaValue);
+			else
+				lossless &= isPlaneConstant<uint8_t>(src, srcLinesize, width, height, reduction.alphaValue);
+			continue;
+		}
+
+		int dstPlane = reducedDesc->comp[c].plane, dstDepth = reducedDesc->comp[c].depth;
+		uint8_t *dst = reducedFrame->data[dstPlane];
+		int dstLinesize = reducedFrame->linesize[dstPlane];
+
+		if (srcDepth > 8 && dstDepth > 8)
+			lossless &= shiftSamplesDown<uint16_t, uint16_t>(src, srcLinesize, dst, dstLinesize, width, height, reduction.shift);
+		else if (srcDepth > 8)
+			lossless &= shiftSamplesDown<uint16_t, uint8_t>(src, srcLinesize, dst, dstLinesize, width, height, reduction.shift);
+		else
+			lossless &= shiftSamplesDown<uint8_t, uint8_t>(src, srcLinesize, dst, dstLinesize, width, height, reduction.shift);
+	}
+
+	return lossless;
+}
+
+void expandPlanes(const AVFrame *reducedFrame, AVFrame *wideFrame, const PlaneReduction &reduction)
+{
+	const AVPixFmtDescriptor *reducedDesc = av_pix_fmt_desc_get((AVPixelFormat)reducedFrame->format);
+	const AVPixFmtDescriptor *wideDesc = av_pix_fmt_desc_get((AVPixelFormat)wideFrame->format);
+
+	for (int c = 0; c < wideDesc->nb_components; c++)
+	{
+		int width, height;
+		componentSize(wideDesc, c, wideFrame->width, wideFrame->height, &width, &height);
+
+		int dstPlane = wideDesc->comp[c].plane, dstDepth = wideDesc->comp[c].depth;
+		uint8_t *dst = wideFrame->data[dstPlane];
+		int dstLinesize = wideFrame->linesize[dstPlane];
+
+		// Dropped alpha plane
+		if (c >= reducedDesc->nb_components)
+		{
+			if (dstDepth > 8)
+				fillPlane<uint16_t>(dst, dstLinesize, width, height, reduction.alphaValue);
+			else
+				fillPlane<uint8_t>(dst, dstLinesize, width, height, reduction.alphaValue);
+			continue;
+		}
+
+		int srcPlane = reducedDesc->comp[c].plane, srcDepth = reducedDesc->comp[c].depth;
+		const uint8_t *src = reducedFrame->data[srcPlane];
+		int srcLinesize = reducedFrame->linesize[srcPlane];
+
+		if (srcDepth > 8 && dstDepth > 8)
+			shiftSamplesUp<uint16_t, uint16_t>(src, srcLinesize, dst, dstLinesize, width, height, reduction.shift);
+		else if (dstDepth > 8)
+			shiftSamplesUp<uint8_t, uint16_t>(src, srcLinesize, dst, dstLinesize, width, height, reduction.shift);
+		else
+			shiftSamplesUp<uint8_t, uint8_t>(src, srcLinesize, dst, dstLinesize, width, height, reduction.shift);
+	}
+}
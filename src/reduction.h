@@ -0,0 +1,74 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REDUCTION_H
+#define REDUCTION_H
+
+#include "libav.h"
+
+#include <vector>
+
+// Parts of the raw video frames of a stream that carry no information: low
+// bits that are zero in every sample and an alpha plane whose samples all have
+// the same value. The frames are encoded without them, in a format with one
+// plane per component (see reducedPixelFormat), and they are restored after
+// decoding.
+struct PlaneReduction
+{
+	int shift = 0; // low bits dropped from the color samples
+	int alphaValue = -1; // value of every alpha sample, -1 if alpha is kept
+
+	bool isNone() const
+	{
+		return shift == 0 && alphaValue < 0;
+	}
+
+	bool operator==(const PlaneReduction &other) const
+	{
+		return shift == other.shift && alphaValue == other.alphaValue;
+	}
+
+	bool operator!=(const PlaneReduction &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+// Format with one plane per component and the same components, subsampling
+// and depth as rawFormat, or AV_PIX_FMT_NONE if there is no such format
+AVPixelFormat widePixelFormat(AVPixelFormat rawFormat);
+
+// Same as widePixelFormat, with the given reduction applied
+AVPixelFormat reducedPixelFormat(AVPixelFormat rawFormat, const PlaneReduction &reduction);
+
+// Analyzes the raw sample frames (packets of rawStream) and returns the
+// largest reduction that they allow and that the given encoder supports
+PlaneReduction detectPlaneReduction(const AVStream *rawStream, const std::vector<AVPacket*> &samples, const AVCodec *encoder);
+
+// Returns the largest part of reduction whose reduced format the encoder
+// supports, keeping more low bits if needed
+PlaneReduction fitPlaneReduction(AVPixelFormat rawFormat, const PlaneReduction &reduction, const AVCodec *encoder);
+
+// Converts a frame from the wide format to the reduced one (the format of
+// reducedFrame, which must already have its buffer). Returns false if some of
+// the samples do not fit in it, i.e. the reduced frame is not lossless.
+bool reducePlanes(const AVFrame *wideFrame, AVFrame *reducedFrame, const PlaneReduction &reduction);
+
+// Restores a wide frame (which must already have its buffer)
+void expandPlanes(const AVFrame *reducedFrame, AVFrame *wideFrame, const PlaneReduction &reduction);
+
+#endif
@@ -0,0 +1,142 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "store.h"
+
+#include "log.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void makeDirectory(const std::string &path)
+{
+	if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST)
+		logError("mkdir: %s: %s\n", path.c_str(), strerror(errno));
+}
+
+ArchiveStore::ArchiveStore(const char *directory)
+: m_directory(directory)
+{
+	makeDirectory(m_directory);
+	makeDirectory(m_directory + "/chunks");
+	makeDirectory(m_directory + "/frames");
+}
+
+ArchiveStore::Key ArchiveStore::computeKey(const uint8_t *prefix, size_t prefixSize, const uint8_t *data, size_t size)
+{
+	AVHashContext *hashCtx;
+	failOnAVERROR(av_hash_alloc(&hashCtx, "SHA256"), "av_hash_alloc");
+	av_hash_init(hashCtx);
+
+	av_hash_update(hashCtx, prefix, prefixSize);
+	av_hash_update(hashCtx, data, size);
+
+	Key result;
+	av_hash_final(hashCtx, result.data());
+	av_hash_freep(&hashCtx);
+
+	return result;
+}
+
+// Blobs are spread over 256 subdirectories, named after the first byte of the key
+std::string ArchiveStore::blobPath(BlobType type, const Key &key, bool createDirectory) const
+{
+	char hex[2 * sizeof(Key) + 1];
+	for (size_t i = 0; i < key.size(); i++)
+		snprintf(hex + 2 * i, 3, "%02x", key[i]);
+
+	std::string directory = m_directory + (type == Chunk ? "/chunks/" : "/frames/") + std::string(hex, 2);
+	if (createDirectory)
+		makeDirectory(directory);
+
+	return directory + "/" + (hex + 2);
+}
+
+bool ArchiveStore::load(BlobType type, const Key &key, AVPacket *outPacket) const
+{
+	std::string path = blobPath(type, key, false);
+
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		if (errno == ENOENT)
+			return false;
+
+		logError("open: %s: %s\n", path.c_str(), strerror(errno));
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		logError("fstat: %s: %s\n", path.c_str(), strerror(errno));
+	if (st.st_size > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE)
+		logError("Blob is too big: %s\n", path.c_str());
+
+	failOnAVERROR(av_new_packet(outPacket, st.st_size), "av_new_packet");
+
+	size_t done = 0;
+	while (done != (size_t)st.st_size)
+	{
+		ssize_t r = read(fd, outPacket->data + done, st.st_size - done);
+		if (r == 0)
+			logError("read: %s: Premature end of file\n", path.c_str());
+		else if (r < 0 && errno != EINTR)
+			logError("read: %s: %s\n", path.c_str(), strerror(errno));
+		else if (r > 0)
+			done += r;
+	}
+
+	close(fd);
+	return true;
+}
+
+void ArchiveStore::save(BlobType type, const Key &key, const uint8_t *data, size_t size) const
+{
+	std::string path = blobPath(type, key, true);
+	if (access(path.c_str(), F_OK) == 0)
+		return;
+
+	// Write to a temporary file first, so that other readers never see
+	// incomplete blobs, and make sure it is on disk before it becomes visible
+	std::string tempPath = path + ".XXXXXX";
+	int fd = mkostemp(&tempPath[0], O_CLOEXEC);
+	if (fd == -1)
+		logError("mkostemp: %s: %s\n", tempPath.c_str(), strerror(errno));
+
+	size_t done = 0;
+	while (done != size)
+	{
+		ssize_t r = write(fd, data + done, size - done);
+		if (r < 0 && errno != EINTR)
+			logError("write: %s: %s\n", tempPath.c_str(), strerror(errno));
+		else if (r > 0)
+			done += r;
+	}
+
+	if (fchmod(fd, 0444) != 0)
+		logError("fchmod: %s: %s\n", tempPath.c_str(), strerror(errno));
+	if (fdatasync(fd) != 0)
+		logError("fdatasync: %s: %s\n", tempPath.c_str(), strerror(errno));
+	close(fd);
+
+	// If another process has saved the same blob in the meantime, it is
+	// replaced by an identical one
+	if (rename(tempPath.c_str(), path.c_str()) != 0)
+		logError("rename: %s: %s\n", path.c_str(), strerror(errno));
+}
@@ -0,0 +1,65 @@
+/* rawcompr: Losslessly compress raw streams in multimedia files.
+ * Copyright (C) 2021  Fabio D'Urso <fabiodurso@hotmail.it>
+ *
+ * "rawcompr" is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include "libav.h"
+
+#include <array>
+#include <string>
+
+// Directory of blobs keyed by SHA-256, shared by all the files that are
+// compressed with the same --store option, so that data that has already been
+// stored for another file is not stored (or encoded) again:
+//  - Chunks: blocks of the data that LLR files would otherwise embed, keyed by
+//    the hash of their contents
+//  - Frames: encoded video packets, keyed by the hash of the raw frame and of
+//    the encoder configuration (see Encoder::packetReuseContext)
+//
+// Blobs are written atomically and never modified, so the store can be used
+// by multiple threads and processes at the same time.
+class ArchiveStore
+{
+	public:
+		typedef std::array<uint8_t, 32> Key;
+
+		enum BlobType
+		{
+			Chunk,
+			Frame
+		};
+
+		// Creates the directory if it does not exist
+		explicit ArchiveStore(const char *directory);
+
+		// Hash of prefix followed by data
+		static Key computeKey(const uint8_t *prefix, size_t prefixSize, const uint8_t *data, size_t size);
+
+		// Returns false if there is no such blob
+		bool load(BlobType type, const Key &key, AVPacket *outPacket) const;
+
+		// Does nothing if the blob already exists
+		void save(BlobType type, const Key &key, const uint8_t *data, size_t size) const;
+
+	private:
+		std::string blobPath(BlobType type, const Key &key, bool createDirectory) const;
+
+		std::string m_directory;
+};
+
+#endif